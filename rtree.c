@@ -5,28 +5,150 @@
 #include <string.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#define RTREE_IMPLEMENTATION
 #include "rtree.h"
 
 ////////////////////////////////
 
-#define DATATYPE void *
+// These may be changed by defining RTREE_DATATYPE, RTREE_NUMTYPE, RTREE_DIMS,
+// and RTREE_MAXITEMS. See rtree.h for RTREE_PREFIX.
+#define DATATYPE RTREE_DATA
+#define NUMTYPE RTREE_NUM
+#ifdef RTREE_DIMS
+#define DIMS RTREE_DIMS
+#else
 #define DIMS 2
-#define NUMTYPE double
-#define MAXITEMS 64
+#endif
+#ifdef RTREE_MAXITEMS
+#define NODEITEMS RTREE_MAXITEMS
+#else
+#define NODEITEMS 64
+#endif
+
+// The leaves and the branches may have their own number of children by
+// defining RTREE_LEAFITEMS and RTREE_BRANCHITEMS. Each kind of node is then
+// allocated with room for just its own children.
+#ifdef RTREE_LEAFITEMS
+#define LEAF_MAXITEMS RTREE_LEAFITEMS
+#else
+#define LEAF_MAXITEMS NODEITEMS
+#endif
+#ifdef RTREE_BRANCHITEMS
+#define BRANCH_MAXITEMS RTREE_BRANCHITEMS
+#else
+#define BRANCH_MAXITEMS NODEITEMS
+#endif
+
+// the most children of either kind of node
+#define MAXITEMS (LEAF_MAXITEMS > BRANCH_MAXITEMS ? LEAF_MAXITEMS : \
+    BRANCH_MAXITEMS)
 
 ////////////////////////////////
 
 // used for splits
 #define MINITEMS_PERCENTAGE 10
-#define MINITEMS ((MAXITEMS) * (MINITEMS_PERCENTAGE) / 100 + 1)
+#define MINITEMS(maxitems) ((maxitems) * (MINITEMS_PERCENTAGE) / 100 + 1)
+
+// used for R*-tree splits and forced reinserts, which is rounded up and at
+// least 2, so that a small node is not split into one child and the rest, but
+// at most half of the node
+#define RSTAR_MINITEMS_PERCENTAGE 40
+#define RSTAR_MINITEMS0(maxitems) \
+    (((maxitems) * (RSTAR_MINITEMS_PERCENTAGE) + 99) / 100 > 2 ? \
+    ((maxitems) * (RSTAR_MINITEMS_PERCENTAGE) + 99) / 100 : 2)
+#define RSTAR_MINITEMS(maxitems) \
+    (RSTAR_MINITEMS0(maxitems) < (maxitems) / 2 ? \
+    RSTAR_MINITEMS0(maxitems) : (maxitems) / 2)
+#define RSTAR_REINSERT_PERCENTAGE 30
 
 #ifndef RTREE_NOPATHHINT
 #define USE_PATHHINT
 #endif
 
-#ifdef RTREE_MAXITEMS
-#undef MAXITEMS
-#define MAXITEMS RTREE_MAXITEMS
+// the number of levels, from the root, that a path hint holds
+#define HINT_DEPTH ((int)(sizeof(((struct rtree_hint*)0)->path)/sizeof(int)))
+
+// Use a per-dimension (structure of arrays) layout for the node rects, which
+// allows for checking multiple child rects at once using SIMD instructions.
+// Optionally, define RTREE_NOSIMD to use the SoA layout with scalar code.
+#ifdef RTREE_SOA
+#define USE_SOA
+// number of children that are checked at once
+#define SOA_BLOCK 4
+// MAXITEMS rounded up to a whole number of blocks
+#define SOA_MAXITEMS (((MAXITEMS)+SOA_BLOCK-1)/SOA_BLOCK*SOA_BLOCK)
+#ifndef RTREE_NOSIMD
+#if defined(__AVX__)
+#include <immintrin.h>
+#define USE_AVX
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+#endif
+#define NUMTYPE_IS_DOUBLE _Generic((NUMTYPE)0, double: 1, default: 0)
+#define NUMTYPE_IS_FLOAT _Generic((NUMTYPE)0, float: 1, default: 0)
+#endif
+
+// Store the rects of branch nodes as floats, which are rounded outwards so
+// that each still contains all of its child rects. This halves the size of
+// the branch rects, while the leaf rects keep the full precision of NUMTYPE.
+#ifdef RTREE_FLOATBRANCH
+#ifdef USE_SOA
+#error "RTREE_FLOATBRANCH cannot be used with RTREE_SOA"
+#endif
+#define USE_FLOATBRANCH
+#include <float.h>
+#endif
+
+// Store the rects of the branch nodes of leaves as 8 or 16 bit steps within a
+// frame rect, which is kept in the node, as in compressed R-trees. Each child
+// rect is rounded outwards to the nearest steps, and the frame grows, with
+// some slack, when a child rect does not fit. Define RTREE_QUANTBRANCH as 8 or
+// 16.
+#ifdef RTREE_QUANTBRANCH
+#if defined(USE_SOA) || defined(USE_FLOATBRANCH)
+#error "RTREE_QUANTBRANCH cannot be used with RTREE_SOA or RTREE_FLOATBRANCH"
+#endif
+#define USE_QUANTBRANCH
+#if RTREE_QUANTBRANCH == 8
+typedef uint8_t quant_t;
+#define QUANT_MAX UINT8_MAX
+#else
+typedef uint16_t quant_t;
+#define QUANT_MAX UINT16_MAX
+#endif
+#endif
+
+// Store only one corner of each item in the leaves, when every item is a
+// point, which halves the size of the leaf rects. The max coordinates that are
+// passed to the functions for changing the rtree must be NULL or the same as
+// the min coordinates, which is asserted. Otherwise only the min is used.
+#ifdef RTREE_POINTS
+#ifdef USE_SOA
+#error "RTREE_POINTS cannot be used with RTREE_SOA"
+#endif
+#define USE_POINTS
+#endif
+
+// Prefetch the children of a branch node that match a search, before any of
+// them are searched, so that their loads from memory overlap. This helps when
+// the tree is much larger than the CPU caches.
+#if defined(RTREE_PREFETCH) && defined(__GNUC__)
+#define USE_PREFETCH
+// number of cache lines of the child rects that are prefetched
+#define PREFETCH_LINES 4
+#endif
+
+// Use threads for rtree_search_parallel, which requires atomics.
+// Optionally, define RTREE_NOTHREADS to always search on the calling thread.
+#if !defined(RTREE_NOTHREADS) && !defined(RTREE_NOATOMICS)
+#define USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
 #endif
 
 #ifdef RTREE_NOATOMICS
@@ -45,6 +167,20 @@ static int rc_fetch_add(rc_t *ptr, int val) {
     *ptr += val;
     return rc;
 }
+typedef int lock_t;
+static void lock_acquire(lock_t *lock) {
+    (void)lock; // nothing to do
+}
+static void lock_release(lock_t *lock) {
+    (void)lock; // nothing to do
+}
+typedef void *ptr_t;
+static void *ptr_load(ptr_t *ptr) {
+    return *ptr;
+}
+static void ptr_store(ptr_t *ptr, void *val) {
+    *ptr = val;
+}
 #else 
 #include <stdatomic.h>
 typedef atomic_int rc_t;
@@ -61,6 +197,20 @@ static int rc_fetch_sub(rc_t *ptr, int delta) {
 static int rc_fetch_add(rc_t *ptr, int delta) {
     return atomic_fetch_add(ptr, delta);
 }
+typedef atomic_flag lock_t;
+static void lock_acquire(lock_t *lock) {
+    while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {}
+}
+static void lock_release(lock_t *lock) {
+    atomic_flag_clear_explicit(lock, memory_order_release);
+}
+typedef void *_Atomic ptr_t;
+static void *ptr_load(ptr_t *ptr) {
+    return atomic_load(ptr);
+}
+static void ptr_store(ptr_t *ptr, void *val) {
+    atomic_store(ptr, val);
+}
 #endif
 
 enum kind {
@@ -74,18 +224,63 @@ struct rect {
 };
 
 struct item {
-    const DATATYPE data;
+    DATATYPE data;
+};
+
+#ifdef USE_FLOATBRANCH
+struct frect {
+    float min[DIMS];
+    float max[DIMS];
+};
+#endif
+
+#ifdef USE_QUANTBRANCH
+struct qrect {
+    quant_t min[DIMS];
+    quant_t max[DIMS];
 };
+#endif
+
+#ifdef USE_POINTS
+struct point {
+    NUMTYPE coords[DIMS];
+};
+#endif
 
 struct node {
     rc_t rc;            // reference counter for copy-on-write
     enum kind kind;     // LEAF or BRANCH
     int count;          // number of rects
-    struct rect rects[MAXITEMS];
+    lock_t lock;        // latched by writers in concurrent mode
+#ifdef USE_QUANTBRANCH
+    bool quant;         // BRANCH of leaves, with quantized rects
+#endif
+#ifdef USE_SOA
+    NUMTYPE mins[DIMS][SOA_MAXITEMS];
+    NUMTYPE maxs[DIMS][SOA_MAXITEMS];
+#endif
+    union {
+        struct node *nodes[BRANCH_MAXITEMS];
+        struct item datas[LEAF_MAXITEMS];
+    };
+#ifndef USE_SOA
+    // The rects go last, allowing for each kind of node to be allocated 
+    // without the part of the rects that it does not use.
     union {
-        struct node *nodes[MAXITEMS];
-        struct item datas[MAXITEMS];
+        struct rect rects[MAXITEMS];        // LEAF, or BRANCH
+#ifdef USE_POINTS
+        struct point points[LEAF_MAXITEMS]; // LEAF
+#endif
+#if defined(USE_FLOATBRANCH)
+        struct frect frects[BRANCH_MAXITEMS];   // BRANCH
+#elif defined(USE_QUANTBRANCH)
+        struct {                            // BRANCH, when quant
+            struct rect frame;              // contains all child rects
+            struct qrect qrects[BRANCH_MAXITEMS];
+        };
+#endif
     };
+#endif
 };
 
 struct rtree {
@@ -94,9 +289,17 @@ struct rtree {
     size_t count;
     size_t height;
 #ifdef USE_PATHHINT
-    int path_hint[16];
+    struct rtree_hint path_hint; // used when the caller has no hint of its own
 #endif
     bool relaxed;
+    bool rstar;         // use the R*-tree split and forced reinserts
+    bool reinserted;    // a forced reinsert happened during this insert
+    bool concurrent;    // inserts and deletes latch the nodes
+    lock_t lock;        // guards the root, rect, height, and count when
+                        // concurrent
+    struct slab *slab;  // optional node allocator, shared with clones
+    struct index *index; // optional index of the items, shared with clones
+                         // until changed
     void *(*malloc)(size_t);
     void (*free)(void *);
     void *udata;
@@ -121,18 +324,383 @@ void rtree_set_udata(struct rtree *tr, void *udata) {
     tr->udata = udata;
 }
 
+// The slab allocator carves nodes out of large chunks of memory. Freed nodes
+// are kept in a free list for reuse, and the chunks are only released after
+// the rtree and all of its clones have been freed. Each size of node, see
+// node_size, has its own class of chunks and free list, so that leaves and
+// branches are not all as large as a struct node.
+#define SLAB_MINCHUNK 8     // number of nodes in the first chunk
+#define SLAB_MAXCHUNK 256   // max number of nodes in a chunk
+#define SLAB_NCLASSES 3     // leaves, branches, and quantized branches
+
+struct slab_chunk {
+    struct slab_chunk *next;
+    size_t count;       // number of nodes, also pads the header for alignment
+};
+
+struct slab_free {
+    struct slab_free *next;
+};
+
+struct slab_class {
+    size_t size;                // bytes of each node, or zero when unused
+    size_t nextcount;           // number of nodes in the next chunk
+    struct slab_free *freelist;
+};
+
+struct slab {
+    rc_t rc;                    // number of sharing rtrees, minus one
+    lock_t lock;                // guards the fields below
+    struct slab_chunk *chunks;  // of all classes
+    struct slab_class classes[SLAB_NCLASSES];
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+};
+
+// Returns the class for nodes of the size, which is claimed on first use. The
+// size is rounded up to keep the nodes in a chunk aligned.
+static struct slab_class *slab_class(struct slab *slab, size_t size) {
+    size_t align = _Alignof(struct node);
+    size = (size+align-1)/align*align;
+    int i = 0;
+    while (slab->classes[i].size != size && slab->classes[i].size != 0) {
+        i++;
+    }
+    assert(i < SLAB_NCLASSES);
+    if (slab->classes[i].size == 0) {
+        slab->classes[i].size = size;
+        slab->classes[i].nextcount = SLAB_MINCHUNK;
+    }
+    return &slab->classes[i];
+}
+
+static void *slab_alloc(struct slab *slab, size_t size) {
+    lock_acquire(&slab->lock);
+    struct slab_class *class = slab_class(slab, size);
+    if (!class->freelist) {
+        struct slab_chunk *chunk = (struct slab_chunk *)slab->malloc(
+            sizeof(struct slab_chunk)+class->size*class->nextcount);
+        if (chunk) {
+            chunk->count = class->nextcount;
+            chunk->next = slab->chunks;
+            slab->chunks = chunk;
+            char *nodes = (char *)(chunk+1);
+            for (size_t i = chunk->count; i > 0; i--) {
+                struct slab_free *fnode = 
+                    (struct slab_free *)(nodes+class->size*(i-1));
+                fnode->next = class->freelist;
+                class->freelist = fnode;
+            }
+            if (class->nextcount < SLAB_MAXCHUNK) {
+                class->nextcount *= 2;
+            }
+        }
+    }
+    struct slab_free *fnode = class->freelist;
+    if (fnode) {
+        class->freelist = fnode->next;
+    }
+    lock_release(&slab->lock);
+    return fnode;
+}
+
+static void slab_dealloc(struct slab *slab, void *ptr, size_t size) {
+    struct slab_free *fnode = (struct slab_free *)ptr;
+    lock_acquire(&slab->lock);
+    struct slab_class *class = slab_class(slab, size);
+    fnode->next = class->freelist;
+    class->freelist = fnode;
+    lock_release(&slab->lock);
+}
+
+static void slab_release(struct slab *slab) {
+    if (rc_fetch_sub(&slab->rc, 1) > 0) return;
+    while (slab->chunks) {
+        struct slab_chunk *chunk = slab->chunks;
+        slab->chunks = chunk->next;
+        slab->free(chunk);
+    }
+    slab->free(slab);
+}
+
+// The index maps the data of each item, or a key that is taken from it, to
+// the rect of the item, see rtree_opt_index. It's a hash table using linear
+// probing, which is shared with clones and copied before it's changed.
+#define INDEX_MINSLOTS 16
+
+struct index_entry {
+    uint64_t hash;      // zero for an empty slot
+    struct item item;
+    struct rect rect;
+};
+
+struct index {
+    rc_t rc;                    // number of sharing rtrees, minus one
+    size_t count;               // number of entries
+    size_t nslots;              // zero or a power of two
+    struct index_entry *slots;
+    uint64_t (*hash)(const DATATYPE data, void *udata);
+    bool (*equal)(const DATATYPE a, const DATATYPE b, void *udata);
+};
+
+static uint64_t index_hash(const struct rtree *tr, struct item item) {
+    uint64_t x;
+    if (tr->index->hash) {
+        x = tr->index->hash(item.data, tr->udata);
+    } else {
+        // FNV-1a of the bytes of the data
+        const unsigned char *bytes = (const unsigned char *)&item.data;
+        x = 14695981039346656037ULL;
+        for (size_t i = 0; i < sizeof(DATATYPE); i++) {
+            x = (x ^ bytes[i]) * 1099511628211ULL;
+        }
+    }
+    // The bits are mixed, as the slot is taken from the low bits, and the
+    // high bit is set, as zero is an empty slot.
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x = x ^ (x >> 31);
+    return x | ((uint64_t)1 << 63);
+}
+
+static bool index_equal(const struct rtree *tr, struct item a, struct item b) 
+{
+    if (tr->index->equal) {
+        return tr->index->equal(a.data, b.data, tr->udata);
+    }
+    return memcmp(&a.data, &b.data, sizeof(DATATYPE)) == 0;
+}
+
+// Returns the slot of the entry for the item, or the empty slot where it 
+// would go.
+static size_t index_find(const struct rtree *tr, struct item item, 
+    uint64_t hash)
+{
+    const struct index *index = tr->index;
+    size_t mask = index->nslots-1;
+    size_t i = hash & mask;
+    while (index->slots[i].hash) {
+        if (index->slots[i].hash == hash && 
+            index_equal(tr, item, index->slots[i].item))
+        {
+            break;
+        }
+        i = (i+1) & mask;
+    }
+    return i;
+}
+
+// Returns the entry for the item, or NULL if there's none.
+static const struct index_entry *index_get(const struct rtree *tr,
+    struct item item)
+{
+    if (!tr->index || tr->index->count == 0) {
+        return NULL;
+    }
+    size_t i = index_find(tr, item, index_hash(tr, item));
+    return tr->index->slots[i].hash ? &tr->index->slots[i] : NULL;
+}
+
+static void index_release(struct index *index, void (*free)(void *)) {
+    if (rc_fetch_sub(&index->rc, 1) > 0) return;
+    if (index->slots) {
+        free(index->slots);
+    }
+    free(index);
+}
+
+// Prepares the index for a change that adds up to count entries, so that
+// the change itself cannot fail. The index is copied when it's shared with a
+// clone, and grown to keep it at most half full.
+//
+// Returns false if out of memory.
+static bool index_prepare(struct rtree *tr, size_t count) {
+    struct index *index = tr->index;
+    if (!index) {
+        return true;
+    }
+    bool shared = rc_load(&index->rc, tr->relaxed) > 0;
+    size_t nslots = index->nslots;
+    while (nslots < INDEX_MINSLOTS || (index->count+count)*2 > nslots) {
+        nslots = nslots < INDEX_MINSLOTS ? INDEX_MINSLOTS : nslots*2;
+    }
+    if (!shared && nslots == index->nslots) {
+        return true;
+    }
+    struct index_entry *slots = (struct index_entry *)tr->malloc(
+        sizeof(struct index_entry)*nslots);
+    if (!slots) {
+        return false;
+    }
+    struct index *index2 = index;
+    if (shared) {
+        index2 = (struct index *)tr->malloc(sizeof(struct index));
+        if (!index2) {
+            tr->free(slots);
+            return false;
+        }
+        memset(index2, 0, sizeof(struct index));
+        index2->count = index->count;
+        index2->hash = index->hash;
+        index2->equal = index->equal;
+    }
+    memset(slots, 0, sizeof(struct index_entry)*nslots);
+    for (size_t i = 0; i < index->nslots; i++) {
+        if (index->slots[i].hash) {
+            size_t j = index->slots[i].hash & (nslots-1);
+            while (slots[j].hash) {
+                j = (j+1) & (nslots-1);
+            }
+            slots[j] = index->slots[i];
+        }
+    }
+    if (shared) {
+        // another rtree may have released it in the meantime
+        index_release(index, tr->free);
+    } else {
+        tr->free(index->slots);
+    }
+    index2->slots = slots;
+    index2->nslots = nslots;
+    tr->index = index2;
+    return true;
+}
+
+// Adds or replaces the entry for the item, after index_prepare.
+static void index_set(struct rtree *tr, struct item item, 
+    const struct rect *rect)
+{
+    struct index *index = tr->index;
+    uint64_t hash = index_hash(tr, item);
+    size_t i = index_find(tr, item, hash);
+    if (!index->slots[i].hash) {
+        index->count++;
+    }
+    index->slots[i].hash = hash;
+    index->slots[i].item = item;
+    index->slots[i].rect = *rect;
+}
+
+// Removes the entry for the item, after index_prepare. The entries that
+// follow it are shifted back, as there are no markers for removed entries.
+static void index_delete(struct rtree *tr, struct item item) {
+    struct index *index = tr->index;
+    if (index->count == 0) {
+        return;
+    }
+    size_t mask = index->nslots-1;
+    size_t i = index_find(tr, item, index_hash(tr, item));
+    if (!index->slots[i].hash) {
+        return;
+    }
+    size_t j = i;
+    while (1) {
+        j = (j+1) & mask;
+        if (!index->slots[j].hash) {
+            break;
+        }
+        // The entry may move back to the hole, unless the slot it hashes to
+        // is after the hole.
+        size_t k = index->slots[j].hash & mask;
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+            index->slots[i] = index->slots[j];
+            i = j;
+        }
+    }
+    index->slots[i].hash = 0;
+    index->count--;
+}
+
+// returns the most children that a node of the kind may have
+static int node_maxitems(enum kind kind) {
+    return kind == LEAF ? LEAF_MAXITEMS : BRANCH_MAXITEMS;
+}
+
+// returns the number of bytes used by a node of the kind, where quant is for
+// a branch node with quantized rects
+static size_t node_size(enum kind kind, bool quant) {
+    (void)quant;
+#if defined(USE_SOA)
+    (void)kind;
+    return sizeof(struct node);
+#else
+    if (kind == LEAF) {
+#ifdef USE_POINTS
+        return offsetof(struct node, points)+
+            sizeof(struct point)*LEAF_MAXITEMS;
+#else
+        return offsetof(struct node, rects)+sizeof(struct rect)*LEAF_MAXITEMS;
+#endif
+    }
+#if defined(USE_FLOATBRANCH)
+    return offsetof(struct node, frects)+
+        sizeof(struct frect)*BRANCH_MAXITEMS;
+#elif defined(USE_QUANTBRANCH)
+    if (quant) {
+        return offsetof(struct node, qrects)+
+            sizeof(struct qrect)*BRANCH_MAXITEMS;
+    }
+#endif
+    return offsetof(struct node, rects)+sizeof(struct rect)*BRANCH_MAXITEMS;
+#endif
+}
+
+// returns the number of bytes used by the node, as it was allocated
+static size_t node_size_of(const struct node *node) {
+#ifdef USE_QUANTBRANCH
+    return node_size(node->kind, node->quant);
+#else
+    return node_size(node->kind, false);
+#endif
+}
+
+static struct node *node_alloc(struct rtree *tr, size_t size) {
+    if (tr->slab) {
+        return (struct node *)slab_alloc(tr->slab, size);
+    }
+    return (struct node *)tr->malloc(size);
+}
+
+static void node_dealloc(struct rtree *tr, struct node *node) {
+    if (tr->slab) {
+        slab_dealloc(tr->slab, node, node_size_of(node));
+    } else {
+        tr->free(node);
+    }
+}
+
 static struct node *node_new(struct rtree *tr, enum kind kind) {
-    struct node *node = (struct node *)tr->malloc(sizeof(struct node));
+    struct node *node = node_alloc(tr, node_size(kind, false));
     if (!node) return NULL;
-    memset(node, 0, sizeof(struct node));
+    memset(node, 0, node_size(kind, false));
     node->kind = kind;
     return node;
 }
 
+// Returns a new branch node for children of the kind. Only the rects of a
+// branch node of leaves are quantized, see RTREE_QUANTBRANCH, because the
+// steps of the nodes above would be much coarser than the leaves that an
+// insert is routed to.
+static struct node *node_new_branch(struct rtree *tr, enum kind kind) {
+#ifdef USE_QUANTBRANCH
+    if (kind == LEAF) {
+        struct node *node = node_alloc(tr, node_size(BRANCH, true));
+        if (!node) return NULL;
+        memset(node, 0, node_size(BRANCH, true));
+        node->kind = BRANCH;
+        node->quant = true;
+        return node;
+    }
+#endif
+    (void)kind;
+    return node_new(tr, BRANCH);
+}
+
 static struct node *node_copy(struct rtree *tr, struct node *node) {
-    struct node *node2 = (struct node *)tr->malloc(sizeof(struct node));
+    size_t size = node_size_of(node);
+    struct node *node2 = node_alloc(tr, size);
     if (!node2) return NULL;
-    memcpy(node2, node, sizeof(struct node));
+    memcpy(node2, node, size);
     node2->rc = 0;
     if (node2->kind == BRANCH) {
         for (int i = 0; i < node2->count; i++) {
@@ -157,7 +725,7 @@ static struct node *node_copy(struct rtree *tr, struct node *node) {
                         tr->item_free(node2->datas[i].data, tr->udata);
                     }
                 }
-                tr->free(node2);
+                node_dealloc(tr, node2);
                 return NULL;
             }
         }
@@ -178,7 +746,7 @@ static void node_free(struct rtree *tr, struct node *node) {
             }
         }
     }
-    tr->free(node);
+    node_dealloc(tr, node);
 }
 
 #define cow_node_or(rnode, code) { \
@@ -235,6 +803,7 @@ static bool rect_intersects(const struct rect *rect, const struct rect *other) {
     return bits == 0;
 }
 
+#ifndef USE_QUANTBRANCH
 static bool rect_onedge(const struct rect *rect, const struct rect *other) {
     for (int i = 0; i < DIMS; i++) {
         if (feq(rect->min[i], other->min[i]) || 
@@ -245,6 +814,7 @@ static bool rect_onedge(const struct rect *rect, const struct rect *other) {
     }
     return false;
 }
+#endif
 
 static bool rect_equals(const struct rect *rect, const struct rect *other) {
     for (int i = 0; i < DIMS; i++) {
@@ -268,6 +838,96 @@ static bool rect_equals_bin(const struct rect *rect, const struct rect *other) {
     return true;
 }
 
+#ifdef USE_FLOATBRANCH
+
+// returns the greatest float that is not greater than x
+static float float_down(NUMTYPE x) {
+    if (x > FLT_MAX) return FLT_MAX;
+    if (x < -FLT_MAX) return -INFINITY;
+    float f = (float)x;
+    if ((double)f > (double)x) f = nextafterf(f, -INFINITY);
+    return f;
+}
+
+// returns the least float that is not less than x
+static float float_up(NUMTYPE x) {
+    if (x < -FLT_MAX) return -FLT_MAX;
+    if (x > FLT_MAX) return INFINITY;
+    float f = (float)x;
+    if ((double)f < (double)x) f = nextafterf(f, INFINITY);
+    return f;
+}
+
+#endif
+
+#ifdef USE_QUANTBRANCH
+
+// Returns the coordinate of step q between min and max. The result is kept
+// between min and max, which keeps the steps in order even when the distance
+// between min and max overflows.
+static NUMTYPE quant_decode(NUMTYPE min, NUMTYPE max, quant_t q) {
+    if (q == 0) return min;
+    if (q == QUANT_MAX) return max;
+    NUMTYPE x = min + (NUMTYPE)((double)(max - min) / QUANT_MAX * q);
+    if (!(x <= max)) return max;
+    if (!(x >= min)) return min;
+    return x;
+}
+
+// Returns the greatest step that does not decode greater than x, or the least
+// step that does not decode less than x when up is true. The steps around the
+// estimate are searched first, and all steps when it's too far off.
+static quant_t quant_encode(NUMTYPE min, NUMTYPE max, NUMTYPE x, bool up) {
+    double t = (double)(x - min) / (double)(max - min) * QUANT_MAX;
+    int q = t >= QUANT_MAX ? QUANT_MAX : t > 0 ? (int)t : 0;
+    int lo = q > 2 ? q-2 : 0;
+    int hi = q < QUANT_MAX-2 ? q+2 : QUANT_MAX;
+    if (up) {
+        if ((lo > 0 && quant_decode(min, max, lo) >= x) || 
+            (hi < QUANT_MAX && quant_decode(min, max, hi) < x))
+        {
+            lo = 0;
+            hi = QUANT_MAX;
+        }
+        while (lo < hi) {
+            int mid = (lo+hi)/2;
+            if (quant_decode(min, max, mid) >= x) {
+                hi = mid;
+            } else {
+                lo = mid+1;
+            }
+        }
+    } else {
+        if ((lo > 0 && quant_decode(min, max, lo) > x) || 
+            (hi < QUANT_MAX && quant_decode(min, max, hi) <= x))
+        {
+            lo = 0;
+            hi = QUANT_MAX;
+        }
+        while (lo < hi) {
+            int mid = (lo+hi+1)/2;
+            if (quant_decode(min, max, mid) <= x) {
+                lo = mid;
+            } else {
+                hi = mid-1;
+            }
+        }
+    }
+    return lo;
+}
+
+#endif
+
+#ifdef USE_FLOATBRANCH
+// Rounds the rect outwards to the precision of the branch rects
+static void rect_round(struct rect *rect) {
+    for (int i = 0; i < DIMS; i++) {
+        rect->min[i] = float_down(rect->min[i]);
+        rect->max[i] = float_up(rect->max[i]);
+    }
+}
+#endif
+
 static int rect_largest_axis(const struct rect *rect) {
     int axis = 0;
     NUMTYPE nlength = rect->max[0] - rect->min[0];
@@ -281,475 +941,4104 @@ static int rect_largest_axis(const struct rect *rect) {
     return axis;
 }
 
-// swap two rectangles
-static void node_swap(struct node *node, int i, int j) {
-    struct rect tmp = node->rects[i];
-    node->rects[i] = node->rects[j];
-    node->rects[j] = tmp;
-    if (node->kind == LEAF) {
-        struct item tmp = node->datas[i];
-        node->datas[i] = node->datas[j];
-        node->datas[j] = tmp;
-    } else {
-        struct node *tmp = node->nodes[i];
-        node->nodes[i] = node->nodes[j];
-        node->nodes[j] = tmp;
-    }
-}
+#ifndef USE_SOA
 
-struct rect4 {
-    NUMTYPE all[DIMS*2];
-};
+// The rects of the items in a leaf, which are stored as points when all of
+// them are points, see RTREE_POINTS.
+#ifdef USE_POINTS
 
-static void node_qsort(struct node *node, int s, int e, int index) { 
-    int nrects = e - s;
-    if (nrects < 2) {
-        return;
-    }
-    int left = 0;
-    int right = nrects-1;
-    int pivot = nrects / 2;
-    node_swap(node, s+pivot, s+right);
-    struct rect4 *rects = (struct rect4 *)&node->rects[s];
-    for (int i = 0; i < nrects; i++) {
-        if (rects[right].all[index] < rects[i].all[index]) {
-            node_swap(node, s+i, s+left);
-            left++;
-        }
-    }
-    node_swap(node, s+left, s+right);
-    node_qsort(node, s, s+left, index);
-    node_qsort(node, s+left+1, e, index);
+static inline struct rect leaf_rect(const struct node *node, int i) {
+    struct rect rect;
+    memcpy(rect.min, node->points[i].coords, sizeof(NUMTYPE)*DIMS);
+    memcpy(rect.max, node->points[i].coords, sizeof(NUMTYPE)*DIMS);
+    return rect;
 }
 
-// sort the node rectangles by the axis. used during splits
-static void node_sort_by_axis(struct node *node, int axis, bool max) {
-    int by_index = max ? DIMS+axis : axis;
-    node_qsort(node, 0, node->count, by_index);
+static inline void leaf_set_rect(struct node *node, int i, 
+    const struct rect *rect)
+{
+    memcpy(node->points[i].coords, rect->min, sizeof(NUMTYPE)*DIMS);
 }
 
-static void node_move_rect_at_index_into(struct node *from, int index, 
-    struct node *into)
+static inline NUMTYPE leaf_coord(const struct node *node, int i, int index) {
+    return node->points[i].coords[index < DIMS ? index : index-DIMS];
+}
+
+static inline bool leaf_intersects(const struct node *node, int i, 
+    const struct rect *rect)
 {
-    into->rects[into->count] = from->rects[index];
-    from->rects[index] = from->rects[from->count-1];
-    if (from->kind == LEAF) {
-        into->datas[into->count] = from->datas[index];
-        from->datas[index] = from->datas[from->count-1];
-    } else {
-        into->nodes[into->count] = from->nodes[index];
-        from->nodes[index] = from->nodes[from->count-1];
+    int bits = 0;
+    for (int j = 0; j < DIMS; j++) {
+        bits |= node->points[i].coords[j] < rect->min[j];
+        bits |= node->points[i].coords[j] > rect->max[j];
     }
-    from->count--;
-    into->count++;
+    return bits == 0;
 }
 
-static bool node_split_largest_axis_edge_snap(struct rtree *tr, 
-    struct rect *rect, struct node *node, struct node **right_out) 
+static inline bool leaf_contains(const struct node *node, int i, 
+    const struct rect *rect)
 {
-    int axis = rect_largest_axis(rect);
-    struct node *right = node_new(tr, node->kind);
-    if (!right) {
-        return false;
+    int bits = 0;
+    for (int j = 0; j < DIMS; j++) {
+        bits |= rect->min[j] < node->points[i].coords[j];
+        bits |= rect->max[j] > node->points[i].coords[j];
     }
-    for (int i = 0; i < node->count; i++) {
-        NUMTYPE min_dist = node->rects[i].min[axis] - rect->min[axis];
-        NUMTYPE max_dist = rect->max[axis] - node->rects[i].max[axis];
-        if (max_dist < min_dist) {
-            // move to right
-            node_move_rect_at_index_into(node, i, right);
-            i--;
-        }
-    }
-    // Make sure that both left and right nodes have at least
-    // MINITEMS by moving datas into underflowed nodes.
-    if (node->count < MINITEMS) {
-        // reverse sort by min axis
-        node_sort_by_axis(right, axis, false);
-        do { 
-            node_move_rect_at_index_into(right, right->count-1, node);
-        } while (node->count < MINITEMS);
-    } else if (right->count < MINITEMS) {
-        // reverse sort by max axis
-        node_sort_by_axis(node, axis, true);
-        do { 
-            node_move_rect_at_index_into(node, node->count-1, right);
-        } while (right->count < MINITEMS);
-    }
-    if (node->kind == BRANCH) {
-        node_sort_by_axis(node, 0, false);
-        node_sort_by_axis(right, 0, false);
-    }
-    *right_out = right;
-    return true;
+    return bits == 0;
 }
 
-static bool node_split(struct rtree *tr, struct rect *rect, struct node *node,
-    struct node **right) 
+// returns true if the max coordinates are missing or the same as the min
+static inline bool coords_ispoint(const NUMTYPE *min, const NUMTYPE *max) {
+    return !max || memcmp(min, max, sizeof(NUMTYPE)*DIMS) == 0;
+}
+
+#else
+
+static inline struct rect leaf_rect(const struct node *node, int i) {
+    return node->rects[i];
+}
+
+static inline void leaf_set_rect(struct node *node, int i, 
+    const struct rect *rect)
 {
-    return node_split_largest_axis_edge_snap(tr, rect, node, right);
+    node->rects[i] = *rect;
 }
 
-static int node_choose_least_enlargement(const struct node *node, 
-    const struct rect *ir)
+static inline NUMTYPE leaf_coord(const struct node *node, int i, int index) {
+    return index < DIMS ? node->rects[i].min[index] : 
+        node->rects[i].max[index-DIMS];
+}
+
+static inline bool leaf_intersects(const struct node *node, int i, 
+    const struct rect *rect)
+{
+    return rect_intersects(&node->rects[i], rect);
+}
+
+static inline bool leaf_contains(const struct node *node, int i, 
+    const struct rect *rect)
+{
+    return rect_contains(&node->rects[i], rect);
+}
+
+#endif
+
+// Calls the iter for each item of the leaf that intersects the rect.
+static bool leaf_search(const struct node *node, const struct rect *rect,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata) 
 {
-    int j = 0;
-    NUMTYPE jenlarge = INFINITY;
     for (int i = 0; i < node->count; i++) {
-        // calculate the enlarged area
-        NUMTYPE uarea = rect_unioned_area(&node->rects[i], ir);
-        NUMTYPE area = rect_area(&node->rects[i]);
-        NUMTYPE enlarge = uarea - area;
-        if (enlarge < jenlarge) {
-            j = i;
-            jenlarge = enlarge;
+#ifdef USE_POINTS
+        const NUMTYPE *min = node->points[i].coords;
+        const NUMTYPE *max = min;
+#else
+        const NUMTYPE *min = node->rects[i].min;
+        const NUMTYPE *max = node->rects[i].max;
+#endif
+        if (leaf_intersects(node, i, rect) && 
+            !iter(min, max, node->datas[i].data, udata))
+        {
+            return false;
         }
     }
-    return j;
+    return true;
 }
 
-static int node_choose(struct rtree *tr, const struct node *node, 
-    const struct rect *rect, int depth)
+#endif
+
+#ifdef USE_SOA
+
+static struct rect node_rect(const struct node *node, int i) {
+    struct rect rect;
+    for (int j = 0; j < DIMS; j++) {
+        rect.min[j] = node->mins[j][i];
+        rect.max[j] = node->maxs[j][i];
+    }
+    return rect;
+}
+
+static void node_set_rect(struct node *node, int i, const struct rect *rect) {
+    for (int j = 0; j < DIMS; j++) {
+        node->mins[j][i] = rect->min[j];
+        node->maxs[j][i] = rect->max[j];
+    }
+}
+
+// return the min (index < DIMS) or max coordinate of a child rect
+static NUMTYPE node_coord(const struct node *node, int i, int index) {
+    return index < DIMS ? node->mins[index][i] : node->maxs[index-DIMS][i];
+}
+
+// Returns a bitmask for the block of children starting at index i, where each
+// bit is set when the child min is not greater than a and the child max is 
+// not less than b, for every dimension.
+static int node_block_mask(const struct node *node, int i, const NUMTYPE *a,
+    const NUMTYPE *b)
 {
-#ifdef USE_PATHHINT
-    int h = tr->path_hint[depth];
-    if (h < node->count) {
-        if (rect_contains(&node->rects[h], rect)) {
-            return h;
+#if defined(USE_AVX)
+    if (NUMTYPE_IS_DOUBLE) {
+        __m256d m = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        for (int j = 0; j < DIMS; j++) {
+            __m256d mins = _mm256_loadu_pd((const double*)&node->mins[j][i]);
+            __m256d maxs = _mm256_loadu_pd((const double*)&node->maxs[j][i]);
+            m = _mm256_and_pd(m, _mm256_cmp_pd(mins, 
+                _mm256_set1_pd((double)a[j]), _CMP_NGT_UQ));
+            m = _mm256_and_pd(m, _mm256_cmp_pd(maxs, 
+                _mm256_set1_pd((double)b[j]), _CMP_NLT_UQ));
         }
+        return _mm256_movemask_pd(m);
+    }
+#elif defined(USE_SSE2)
+    if (NUMTYPE_IS_DOUBLE) {
+        __m128d m0 = _mm_castsi128_pd(_mm_set1_epi32(-1));
+        __m128d m1 = m0;
+        for (int j = 0; j < DIMS; j++) {
+            __m128d va = _mm_set1_pd((double)a[j]);
+            __m128d vb = _mm_set1_pd((double)b[j]);
+            const double *mins = (const double*)&node->mins[j][i];
+            const double *maxs = (const double*)&node->maxs[j][i];
+            m0 = _mm_and_pd(m0, _mm_cmpngt_pd(_mm_loadu_pd(mins+0), va));
+            m1 = _mm_and_pd(m1, _mm_cmpngt_pd(_mm_loadu_pd(mins+2), va));
+            m0 = _mm_and_pd(m0, _mm_cmpnlt_pd(_mm_loadu_pd(maxs+0), vb));
+            m1 = _mm_and_pd(m1, _mm_cmpnlt_pd(_mm_loadu_pd(maxs+2), vb));
+        }
+        return _mm_movemask_pd(m0) | _mm_movemask_pd(m1) << 2;
     }
 #endif
-    // Take a quick look for the first node that contain the rect.
-    for (int i = 0; i < node->count; i++) {
-        if (rect_contains(&node->rects[i], rect)) {
-#ifdef USE_PATHHINT
-            tr->path_hint[depth] = i;
-#endif
-            return i;
+#if defined(USE_AVX) || defined(USE_SSE2)
+    if (NUMTYPE_IS_FLOAT) {
+        __m128 m = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int j = 0; j < DIMS; j++) {
+            __m128 mins = _mm_loadu_ps((const float*)&node->mins[j][i]);
+            __m128 maxs = _mm_loadu_ps((const float*)&node->maxs[j][i]);
+            m = _mm_and_ps(m, _mm_cmpngt_ps(mins, _mm_set1_ps((float)a[j])));
+            m = _mm_and_ps(m, _mm_cmpnlt_ps(maxs, _mm_set1_ps((float)b[j])));
         }
+        return _mm_movemask_ps(m);
     }
-    // Fallback to using che "choose least enlargment" algorithm.
-    int i = node_choose_least_enlargement(node, rect);
-#ifdef USE_PATHHINT
-    tr->path_hint[depth] = i;
 #endif
-    return i;
+    int mask = 0;
+    for (int k = 0; k < SOA_BLOCK; k++) {
+        int bits = 0;
+        for (int j = 0; j < DIMS; j++) {
+            bits |= node->mins[j][i+k] > a[j];
+            bits |= node->maxs[j][i+k] < b[j];
+        }
+        mask |= (bits == 0) << k;
+    }
+    return mask;
 }
 
-static struct rect node_rect_calc(const struct node *node) {
-    struct rect rect = node->rects[0];
-    for (int i = 1; i < node->count; i++) {
-        rect_expand(&rect, &node->rects[i]);
+// Returns the index of the first child, at or after index i, that matches the
+// condition described in node_block_mask, or the node count if none match.
+static int node_mask_next(const struct node *node, int i, const NUMTYPE *a,
+    const NUMTYPE *b)
+{
+    if (i >= node->count) {
+        return node->count;
     }
-    return rect;
+    int s = i - i%SOA_BLOCK;
+    int mask = node_block_mask(node, s, a, b) >> (i-s) << (i-s);
+    while (!mask) {
+        s += SOA_BLOCK;
+        if (s >= node->count) {
+            return node->count;
+        }
+        mask = node_block_mask(node, s, a, b);
+    }
+    int j = s;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        j++;
+    }
+    return j < node->count ? j : node->count;
 }
 
-// node_insert returns false if out of memory
-static bool node_insert(struct rtree *tr, struct rect *nr, struct node *node, 
-    struct rect *ir, struct item item, int depth, bool *split)
+// number of children that are checked by node_intersects_mask
+#define NODE_BLOCK SOA_BLOCK
+
+// Returns a bitmask for the block of children starting at index i, where each
+// bit is set when the child intersects the rect.
+static int node_intersects_mask(const struct node *node, int i, 
+    const struct rect *rect)
 {
-    if (node->kind == LEAF) {
-        if (node->count == MAXITEMS) {
-            *split = true;
-            return true;
-        }
-        int index = node->count;
-        node->rects[index] = *ir;
-        node->datas[index] = item;
-        node->count++;
-        *split = false;
-        return true;
+    int mask = node_block_mask(node, i, rect->max, rect->min);
+    if (node->count-i < SOA_BLOCK) {
+        mask &= (1<<(node->count-i))-1;
     }
-    // Choose a subtree for inserting the rectangle.
-    int i = node_choose(tr, node, ir, depth);
-    cow_node_or(node->nodes[i], return false);
-    if (!node_insert(tr, &node->rects[i], node->nodes[i], ir, item, depth+1, 
-        split))
-    {
-        return false;
+    return mask;
+}
+
+// Returns the index of the first child, at or after index i, that intersects
+// the rect, or the node count if none do.
+static int node_intersects_next(const struct node *node, int i, 
+    const struct rect *rect)
+{
+    return node_mask_next(node, i, rect->max, rect->min);
+}
+
+// Returns the index of the first child, at or after index i, that contains
+// the rect, or the node count if none do.
+static int node_contains_next(const struct node *node, int i, 
+    const struct rect *rect)
+{
+    return node_mask_next(node, i, rect->min, rect->max);
+}
+
+#elif defined(USE_FLOATBRANCH)
+
+static bool frect_contains(const struct frect *frect, const struct rect *other) 
+{
+    int bits = 0;
+    for (int i = 0; i < DIMS; i++) {
+        bits |= other->min[i] < frect->min[i];
+        bits |= other->max[i] > frect->max[i];
     }
-    if (!*split) {
-        rect_expand(&node->rects[i], ir);
-        *split = false;
-        return true;
+    return bits == 0;
+}
+
+static bool frect_intersects(const struct frect *frect, 
+    const struct rect *other)
+{
+    int bits = 0;
+    for (int i = 0; i < DIMS; i++) {
+        bits |= other->min[i] > frect->max[i];
+        bits |= other->max[i] < frect->min[i];
     }
-    // split the child node
-    if (node->count == MAXITEMS) {
-        *split = true;
-        return true;
+    return bits == 0;
+}
+
+static struct rect node_rect(const struct node *node, int i) {
+    if (node->kind == LEAF) {
+        return leaf_rect(node, i);
     }
-    struct node *right;
-    if (!node_split(tr, &node->rects[i], node->nodes[i], &right)) {
-        return false;
+    struct rect rect;
+    for (int j = 0; j < DIMS; j++) {
+        rect.min[j] = node->frects[i].min[j];
+        rect.max[j] = node->frects[i].max[j];
     }
-    node->rects[i] = node_rect_calc(node->nodes[i]);
-    node->rects[node->count] = node_rect_calc(right);
-    node->nodes[node->count] = right;
-    node->count++;
-    return node_insert(tr, nr, node, ir, item, depth, split);
+    return rect;
 }
 
-struct rtree *rtree_new_with_allocator(void *(*_malloc)(size_t), 
-    void (*_free)(void*)
-) {
-    _malloc = _malloc ? _malloc : malloc;
-    _free = _free ? _free : free;
-    struct rtree *tr = (struct rtree *)_malloc(sizeof(struct rtree));
-    if (!tr) return NULL;
-    memset(tr, 0, sizeof(struct rtree));
-    tr->malloc = _malloc;
-    tr->free = _free;
-    return tr;
+// The rect is rounded outwards when it's stored in a branch node.
+static void node_set_rect(struct node *node, int i, const struct rect *rect) {
+    if (node->kind == LEAF) {
+        leaf_set_rect(node, i, rect);
+        return;
+    }
+    for (int j = 0; j < DIMS; j++) {
+        node->frects[i].min[j] = float_down(rect->min[j]);
+        node->frects[i].max[j] = float_up(rect->max[j]);
+    }
 }
 
-struct rtree *rtree_new(void) {
-    return rtree_new_with_allocator(NULL, NULL);
+// return the min (index < DIMS) or max coordinate of a child rect
+static NUMTYPE node_coord(const struct node *node, int i, int index) {
+    if (node->kind == LEAF) {
+        return leaf_coord(node, i, index);
+    }
+    return index < DIMS ? node->frects[i].min[index] : 
+        node->frects[i].max[index-DIMS];
 }
 
-void rtree_set_item_callbacks(struct rtree *tr,
-    bool (*clone)(const DATATYPE item, DATATYPE *into, void *udata),
-    void (*free)(const DATATYPE item, void *udata))
+// Returns the index of the first child, at or after index i, that intersects
+// the rect, or the node count if none do.
+static int node_intersects_next(const struct node *node, int i, 
+    const struct rect *rect)
 {
-    tr->item_clone = clone;
-    tr->item_free = free;
+    if (node->kind == LEAF) {
+        while (i < node->count && !leaf_intersects(node, i, rect)) {
+            i++;
+        }
+    } else {
+        while (i < node->count && !frect_intersects(&node->frects[i], rect)) {
+            i++;
+        }
+    }
+    return i;
 }
 
-bool rtree_insert(struct rtree *tr, const NUMTYPE *min, 
-    const NUMTYPE *max, const DATATYPE data) 
+// Returns the index of the first child, at or after index i, that contains
+// the rect, or the node count if none do.
+static int node_contains_next(const struct node *node, int i, 
+    const struct rect *rect)
 {
-    // copy input rect
-    struct rect rect;
-    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
-    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
-    
-    // copy input data
-    struct item item;
-    if (tr->item_clone) {
-        if (!tr->item_clone(data, (DATATYPE*)&item.data, tr->udata)) {
-            return false;
+    if (node->kind == LEAF) {
+        while (i < node->count && !leaf_contains(node, i, rect)) {
+            i++;
         }
     } else {
-        memcpy(&item.data, &data, sizeof(DATATYPE));
+        while (i < node->count && !frect_contains(&node->frects[i], rect)) {
+            i++;
+        }
     }
+    return i;
+}
 
-    while (1) {
-        if (!tr->root) {
-            struct node *new_root = node_new(tr, LEAF);
-            if (!new_root) {
-                break;
+#elif defined(USE_QUANTBRANCH)
+
+static struct rect node_rect(const struct node *node, int i) {
+    if (node->kind == LEAF) {
+        return leaf_rect(node, i);
+    }
+    if (!node->quant) {
+        return node->rects[i];
+    }
+    struct rect rect;
+    for (int j = 0; j < DIMS; j++) {
+        rect.min[j] = quant_decode(node->frame.min[j], node->frame.max[j],
+            node->qrects[i].min[j]);
+        rect.max[j] = quant_decode(node->frame.min[j], node->frame.max[j],
+            node->qrects[i].max[j]);
+    }
+    return rect;
+}
+
+static void node_encode_rect(struct node *node, int i, 
+    const struct rect *rect)
+{
+    for (int j = 0; j < DIMS; j++) {
+        node->qrects[i].min[j] = quant_encode(node->frame.min[j], 
+            node->frame.max[j], rect->min[j], false);
+        node->qrects[i].max[j] = quant_encode(node->frame.min[j], 
+            node->frame.max[j], rect->max[j], true);
+    }
+}
+
+// Grows the frame of a branch node to include the rect of the child at the
+// index, and encodes all of the child rects again. The index may be the count,
+// when a rect is set before the count goes up.
+//
+// The rects of the children are taken from the children themselves, as with
+// node_reframe, so that they are not rounded out again each time the frame
+// grows, and an eighth of the frame size is added on each side that grows.
+// Only the rect of an empty or pending child is encoded as it's given.
+// When latched, in concurrent mode, the children may be changed by other
+// writers, so their rects are decoded as they are, and no slack is added,
+// see node_insert_latched.
+static void node_grow_frame(struct node *node, int index,
+    const struct rect *rect, bool latched)
+{
+    struct rect rects[BRANCH_MAXITEMS];
+    struct rect frame = node->frame;
+    rect_expand(&frame, rect);
+    for (int i = 0; i < BRANCH_MAXITEMS; i++) {
+        if (!latched && i < node->count && node->nodes[i]->count > 0) {
+            // Only the branch nodes of leaves are quantized. The leaf may
+            // already hold rects that are outside of the frame, such as when
+            // items are moved into it.
+            const struct node *leaf = node->nodes[i];
+            rects[i] = leaf_rect(leaf, 0);
+            for (int k = 1; k < leaf->count; k++) {
+                struct rect rect2 = leaf_rect(leaf, k);
+                rect_expand(&rects[i], &rect2);
             }
-            tr->root = new_root;
-            tr->rect = rect;
-            tr->height = 1;
+            rect_expand(&frame, &rects[i]);
+        } else if (i == index) {
+            rects[i] = *rect;
+        } else {
+            rects[i] = node_rect(node, i);
         }
-        bool split = false;
-        cow_node_or(tr->root, break);
-        if (!node_insert(tr, &tr->rect, tr->root, &rect, item, 0, &split)) {
-            break;
+    }
+    for (int j = 0; j < DIMS && !latched; j++) {
+        NUMTYPE slack = (frame.max[j] - frame.min[j]) / 8;
+        if (frame.min[j] < node->frame.min[j]) {
+            frame.min[j] -= slack;
         }
-        if (!split) {
-            rect_expand(&tr->rect, &rect);
-            tr->count++;
-            return true;
+        if (frame.max[j] > node->frame.max[j]) {
+            frame.max[j] += slack;
         }
-        struct node *new_root = node_new(tr, BRANCH);
-        if (!new_root) {
+    }
+    node->frame = frame;
+    for (int i = 0; i < BRANCH_MAXITEMS; i++) {
+        node_encode_rect(node, i, &rects[i]);
+    }
+}
+
+// The rect is rounded outwards to the steps of the frame when it's stored in
+// a quantized branch node. The frame starts as the first rect of an empty node.
+static void node_set_rect(struct node *node, int i, const struct rect *rect) {
+    if (node->kind == LEAF) {
+        leaf_set_rect(node, i, rect);
+        return;
+    }
+    if (!node->quant) {
+        node->rects[i] = *rect;
+        return;
+    }
+    if (i == 0 && node->count == 0) {
+        node->frame = *rect;
+    } else if (!rect_contains(&node->frame, rect)) {
+        node_grow_frame(node, i, rect, false);
+        return;
+    }
+    node_encode_rect(node, i, rect);
+}
+
+// return the min (index < DIMS) or max coordinate of a child rect
+static NUMTYPE node_coord(const struct node *node, int i, int index) {
+    if (node->kind == LEAF) {
+        return leaf_coord(node, i, index);
+    }
+    if (!node->quant) {
+        return index < DIMS ? node->rects[i].min[index] : 
+            node->rects[i].max[index-DIMS];
+    }
+    struct rect rect = node_rect(node, i);
+    return index < DIMS ? rect.min[index] : rect.max[index-DIMS];
+}
+
+// Returns the index of the first child, at or after index i, that intersects
+// the rect, or the node count if none do.
+static int node_intersects_next(const struct node *node, int i, 
+    const struct rect *rect)
+{
+    while (i < node->count) {
+        struct rect rect2 = node_rect(node, i);
+        if (rect_intersects(&rect2, rect)) {
             break;
         }
-        struct node *right;
-        if (!node_split(tr, &tr->rect, tr->root, &right)) {
-            tr->free(new_root);
+        i++;
+    }
+    return i;
+}
+
+// Returns the index of the first child, at or after index i, that contains
+// the rect, or the node count if none do.
+static int node_contains_next(const struct node *node, int i, 
+    const struct rect *rect)
+{
+    while (i < node->count) {
+        struct rect rect2 = node_rect(node, i);
+        if (rect_contains(&rect2, rect)) {
             break;
         }
-        new_root->rects[0] = node_rect_calc(tr->root);
-        new_root->rects[1] = node_rect_calc(right);
-        new_root->nodes[0] = tr->root;
-        new_root->nodes[1] = right;
-        tr->root = new_root;
-        tr->root->count = 2;
-        tr->height++;
-    }
-    // out of memory
-    if (tr->item_free) {
-        tr->item_free(item.data, tr->udata);
+        i++;
     }
-    return false;
+    return i;
 }
 
-void rtree_free(struct rtree *tr) {
-    if (tr->root) {
-        node_free(tr, tr->root);
+#else
+
+static struct rect node_rect(const struct node *node, int i) {
+#ifdef USE_POINTS
+    if (node->kind == LEAF) {
+        return leaf_rect(node, i);
     }
-    tr->free(tr);
+#endif
+    return node->rects[i];
 }
 
+static void node_set_rect(struct node *node, int i, const struct rect *rect) {
+#ifdef USE_POINTS
+    if (node->kind == LEAF) {
+        leaf_set_rect(node, i, rect);
+        return;
+    }
+#endif
+    node->rects[i] = *rect;
+}
+
+// return the min (index < DIMS) or max coordinate of a child rect
+static NUMTYPE node_coord(const struct node *node, int i, int index) {
+#ifdef USE_POINTS
+    if (node->kind == LEAF) {
+        return leaf_coord(node, i, index);
+    }
+#endif
+    return index < DIMS ? node->rects[i].min[index] : 
+        node->rects[i].max[index-DIMS];
+}
+
+// number of children that are checked by node_intersects_mask
+#define NODE_BLOCK 1
+
+// Returns 1 if the child at index i intersects the rect.
+static int node_intersects_mask(const struct node *node, int i, 
+    const struct rect *rect)
+{
+#ifdef USE_POINTS
+    if (node->kind == LEAF) {
+        return leaf_intersects(node, i, rect);
+    }
+#endif
+    return rect_intersects(&node->rects[i], rect);
+}
+
+// Returns the index of the first child, at or after index i, that intersects
+// the rect, or the node count if none do.
+static int node_intersects_next(const struct node *node, int i, 
+    const struct rect *rect)
+{
+#ifdef USE_POINTS
+    if (node->kind == LEAF) {
+        while (i < node->count && !leaf_intersects(node, i, rect)) {
+            i++;
+        }
+        return i;
+    }
+#endif
+    while (i < node->count && !rect_intersects(&node->rects[i], rect)) {
+        i++;
+    }
+    return i;
+}
+
+// Returns the index of the first child, at or after index i, that contains
+// the rect, or the node count if none do.
+static int node_contains_next(const struct node *node, int i, 
+    const struct rect *rect)
+{
+#ifdef USE_POINTS
+    if (node->kind == LEAF) {
+        while (i < node->count && !leaf_contains(node, i, rect)) {
+            i++;
+        }
+        return i;
+    }
+#endif
+    while (i < node->count && !rect_contains(&node->rects[i], rect)) {
+        i++;
+    }
+    return i;
+}
+
+#endif
+
+// swap two rectangles
+static void node_swap(struct node *node, int i, int j) {
+    struct rect tmp = node_rect(node, i);
+    struct rect rect = node_rect(node, j);
+    node_set_rect(node, i, &rect);
+    node_set_rect(node, j, &tmp);
+    if (node->kind == LEAF) {
+        struct item tmp = node->datas[i];
+        node->datas[i] = node->datas[j];
+        node->datas[j] = tmp;
+    } else {
+        struct node *tmp = node->nodes[i];
+        node->nodes[i] = node->nodes[j];
+        node->nodes[j] = tmp;
+    }
+}
+
+static void node_qsort(struct node *node, int s, int e, int index) { 
+    int nrects = e - s;
+    if (nrects < 2) {
+        return;
+    }
+    int left = 0;
+    int right = nrects-1;
+    int pivot = nrects / 2;
+    node_swap(node, s+pivot, s+right);
+    NUMTYPE pivot_coord = node_coord(node, s+right, index);
+    for (int i = 0; i < nrects; i++) {
+        if (pivot_coord < node_coord(node, s+i, index)) {
+            node_swap(node, s+i, s+left);
+            left++;
+        }
+    }
+    node_swap(node, s+left, s+right);
+    node_qsort(node, s, s+left, index);
+    node_qsort(node, s+left+1, e, index);
+}
+
+// sort the node rectangles by the axis. used during splits
+static void node_sort_by_axis(struct node *node, int axis, bool max) {
+    int by_index = max ? DIMS+axis : axis;
+    node_qsort(node, 0, node->count, by_index);
+}
+
+static struct rect node_rect_calc(const struct node *node) {
+    struct rect rect = node_rect(node, 0);
+    for (int i = 1; i < node->count; i++) {
+        struct rect rect2 = node_rect(node, i);
+        rect_expand(&rect, &rect2);
+    }
+    return rect;
+}
+
+static void node_move_rect_at_index_into(struct node *from, int index, 
+    struct node *into)
+{
+    struct rect rect = node_rect(from, index);
+#ifdef USE_QUANTBRANCH
+    if (into->quant) {
+        // The rect is rounded to the steps of the frame that it's moved from,
+        // and it would be rounded again to the steps of the other frame.
+        rect = node_rect_calc(from->nodes[index]);
+    }
+#endif
+    node_set_rect(into, into->count, &rect);
+    rect = node_rect(from, from->count-1);
+    node_set_rect(from, index, &rect);
+    if (from->kind == LEAF) {
+        into->datas[into->count] = from->datas[index];
+        from->datas[index] = from->datas[from->count-1];
+    } else {
+        into->nodes[into->count] = from->nodes[index];
+        from->nodes[index] = from->nodes[from->count-1];
+    }
+    from->count--;
+    into->count++;
+}
+
+static bool node_split_largest_axis_edge_snap(struct rtree *tr, 
+    struct rect *rect, struct node *node, struct node **right_out) 
+{
+    int axis = rect_largest_axis(rect);
+    struct node *right = node->kind == LEAF ? node_new(tr, LEAF) :
+        node_new_branch(tr, node->nodes[0]->kind);
+    if (!right) {
+        return false;
+    }
+    for (int i = 0; i < node->count; i++) {
+        NUMTYPE min_dist = node_coord(node, i, axis) - rect->min[axis];
+        NUMTYPE max_dist = rect->max[axis] - node_coord(node, i, DIMS+axis);
+        if (max_dist < min_dist) {
+            // move to right
+            node_move_rect_at_index_into(node, i, right);
+            i--;
+        }
+    }
+    // Make sure that both left and right nodes have at least
+    // MINITEMS by moving datas into underflowed nodes.
+    int minitems = MINITEMS(node_maxitems(node->kind));
+    if (node->count < minitems) {
+        // reverse sort by min axis
+        node_sort_by_axis(right, axis, false);
+        do { 
+            node_move_rect_at_index_into(right, right->count-1, node);
+        } while (node->count < minitems);
+    } else if (right->count < minitems) {
+        // reverse sort by max axis
+        node_sort_by_axis(node, axis, true);
+        do { 
+            node_move_rect_at_index_into(node, node->count-1, right);
+        } while (right->count < minitems);
+    }
+    if (node->kind == BRANCH) {
+        node_sort_by_axis(node, 0, false);
+        node_sort_by_axis(right, 0, false);
+    }
+    *right_out = right;
+    return true;
+}
+
+static NUMTYPE rect_margin(const struct rect *rect) {
+    NUMTYPE margin = 0;
+    for (int i = 0; i < DIMS; i++) {
+        margin += rect->max[i] - rect->min[i];
+    }
+    return margin;
+}
+
+static NUMTYPE rect_overlap(const struct rect *a, const struct rect *b) {
+    NUMTYPE overlap = 1;
+    for (int i = 0; i < DIMS; i++) {
+        NUMTYPE size = min0(a->max[i], b->max[i]) - max0(a->min[i], b->min[i]);
+        if (!(size > 0)) {
+            return 0;
+        }
+        overlap *= size;
+    }
+    return overlap;
+}
+
+// Fills the bounds of the rects before and including i (lo), and the bounds
+// of the rects from i to the end (hi), for each i.
+static void node_bounds(const struct node *node, struct rect *lo, 
+    struct rect *hi)
+{
+    lo[0] = node_rect(node, 0);
+    for (int i = 1; i < node->count; i++) {
+        struct rect rect = node_rect(node, i);
+        lo[i] = lo[i-1];
+        rect_expand(&lo[i], &rect);
+    }
+    hi[node->count-1] = node_rect(node, node->count-1);
+    for (int i = node->count-2; i >= 0; i--) {
+        struct rect rect = node_rect(node, i);
+        hi[i] = hi[i+1];
+        rect_expand(&hi[i], &rect);
+    }
+}
+
+// The R*-tree split sorts the rects by the min and max of each axis, and
+// picks the axis with the smallest total margin over all distributions of
+// the rects into two groups. The distribution along that axis with the least
+// overlap wins, with ties going to the least total area.
+static bool node_split_rstar(struct rtree *tr, struct node *node,
+    struct node **right_out)
+{
+    struct node *right = node->kind == LEAF ? node_new(tr, LEAF) :
+        node_new_branch(tr, node->nodes[0]->kind);
+    if (!right) {
+        return false;
+    }
+    int m = RSTAR_MINITEMS(node_maxitems(node->kind));
+    struct rect lo[MAXITEMS];
+    struct rect hi[MAXITEMS];
+    int axis = 0;
+    NUMTYPE axis_margin = INFINITY;
+    for (int i = 0; i < DIMS; i++) {
+        NUMTYPE margin = 0;
+        for (int j = 0; j < 2; j++) {
+            node_sort_by_axis(node, i, j == 1);
+            node_bounds(node, lo, hi);
+            for (int k = m; k <= node->count-m; k++) {
+                margin += rect_margin(&lo[k-1]) + rect_margin(&hi[k]);
+            }
+        }
+        if (margin < axis_margin) {
+            axis = i;
+            axis_margin = margin;
+        }
+    }
+    bool by_max = false;
+    int split = m;
+    NUMTYPE split_overlap = INFINITY;
+    NUMTYPE split_area = INFINITY;
+    for (int j = 0; j < 2; j++) {
+        node_sort_by_axis(node, axis, j == 1);
+        node_bounds(node, lo, hi);
+        for (int k = m; k <= node->count-m; k++) {
+            NUMTYPE overlap = rect_overlap(&lo[k-1], &hi[k]);
+            NUMTYPE area = rect_area(&lo[k-1]) + rect_area(&hi[k]);
+            if (overlap < split_overlap || 
+                (overlap == split_overlap && area < split_area))
+            {
+                by_max = j == 1;
+                split = k;
+                split_overlap = overlap;
+                split_area = area;
+            }
+        }
+    }
+    node_sort_by_axis(node, axis, by_max);
+    while (node->count > split) {
+        node_move_rect_at_index_into(node, node->count-1, right);
+    }
+    if (node->kind == BRANCH) {
+        node_sort_by_axis(node, 0, false);
+        node_sort_by_axis(right, 0, false);
+    }
+    *right_out = right;
+    return true;
+}
+
+#ifdef USE_QUANTBRANCH
+// Fits the frame of a branch node to the child rects, and encodes them again.
+static void node_fit_frame(struct node *node, const struct rect *rects) {
+    node->frame = rects[0];
+    for (int i = 1; i < node->count; i++) {
+        rect_expand(&node->frame, &rects[i]);
+    }
+    for (int i = 0; i < node->count; i++) {
+        node_encode_rect(node, i, &rects[i]);
+    }
+}
+
+// Fits the frame of a branch node to its children and encodes their rects
+// again, from the children themselves. The frame otherwise only grows, and a
+// node that was split would keep coarser steps than it needs.
+static void node_reframe(struct node *node) {
+    struct rect rects[MAXITEMS];
+    for (int i = 0; i < node->count; i++) {
+        rects[i] = node_rect_calc(node->nodes[i]);
+    }
+    node_fit_frame(node, rects);
+}
+
+// Fits the frame of a branch node to its child rects as they are, without
+// reading the children, which may be latched by other writers.
+static void node_refit(struct node *node) {
+    struct rect rects[MAXITEMS];
+    for (int i = 0; i < node->count; i++) {
+        rects[i] = node_rect(node, i);
+    }
+    node_fit_frame(node, rects);
+}
+
+// Fits the frame of a branch node to the rects that its children had in the
+// node that it was split from. In concurrent mode, the children may be
+// changing, and the rects moved by the split were rounded out again.
+static void node_reframe_from(struct node *node, struct node *const *nodes,
+    const struct rect *rects, int count)
+{
+    struct rect rects2[MAXITEMS];
+    for (int i = 0; i < node->count; i++) {
+        for (int j = 0; j < count; j++) {
+            if (nodes[j] == node->nodes[i]) {
+                rects2[i] = rects[j];
+                break;
+            }
+        }
+    }
+    node_fit_frame(node, rects2);
+}
+#endif
+
+static bool node_split(struct rtree *tr, struct rect *rect, struct node *node,
+    struct node **right) 
+{
+#ifdef USE_QUANTBRANCH
+    struct node *nodes[MAXITEMS];
+    struct rect rects[MAXITEMS];
+    int count = node->count;
+    bool from = node->kind == BRANCH && node->quant && tr->concurrent;
+    for (int i = 0; from && i < count; i++) {
+        nodes[i] = node->nodes[i];
+        rects[i] = node_rect(node, i);
+    }
+#endif
+    bool ok;
+    if (tr->rstar) {
+        ok = node_split_rstar(tr, node, right);
+    } else {
+        ok = node_split_largest_axis_edge_snap(tr, rect, node, right);
+    }
+#ifdef USE_QUANTBRANCH
+    if (ok && from) {
+        node_reframe_from(node, nodes, rects, count);
+        node_reframe_from(*right, nodes, rects, count);
+    } else if (ok && node->kind == BRANCH && node->quant) {
+        node_reframe(node);
+        node_reframe(*right);
+    }
+#endif
+    return ok;
+}
+
+// returns the area that the child rect would grow by to include the rect
+static NUMTYPE node_enlargement(const struct node *node, int i, 
+    const struct rect *ir)
+{
+    struct rect rect = node_rect(node, i);
+    return rect_unioned_area(&rect, ir) - rect_area(&rect);
+}
+
+static int node_choose_least_enlargement(const struct node *node, 
+    const struct rect *ir)
+{
+    int j = 0;
+    NUMTYPE jenlarge = INFINITY;
+    for (int i = 0; i < node->count; i++) {
+        NUMTYPE enlarge = node_enlargement(node, i, ir);
+        if (enlarge < jenlarge) {
+            j = i;
+            jenlarge = enlarge;
+        }
+    }
+    return j;
+}
+
+// The R*-tree chooses the leaf that would overlap the least with its siblings
+// after being enlarged, with ties going to the least enlargement.
+static int node_choose_least_overlap_enlargement(const struct node *node, 
+    const struct rect *ir)
+{
+    int j = 0;
+    NUMTYPE joverlap = INFINITY;
+    NUMTYPE jenlarge = INFINITY;
+    for (int i = 0; i < node->count; i++) {
+        struct rect rect = node_rect(node, i);
+        struct rect urect = rect;
+        rect_expand(&urect, ir);
+        NUMTYPE overlap = 0;
+        for (int k = 0; k < node->count; k++) {
+            if (k != i) {
+                struct rect krect = node_rect(node, k);
+                overlap += rect_overlap(&urect, &krect) - 
+                    rect_overlap(&rect, &krect);
+            }
+        }
+        NUMTYPE enlarge = rect_area(&urect) - rect_area(&rect);
+        if (overlap < joverlap || (overlap == joverlap && enlarge < jenlarge)) {
+            j = i;
+            joverlap = overlap;
+            jenlarge = enlarge;
+        }
+    }
+    return j;
+}
+
+// The hint is optional (set to NULL), and holds the index of the child that was
+// chosen at each depth. Levels below the depth of the hint are not hinted.
+static int node_choose(struct rtree *tr, const struct node *node, 
+    const struct rect *rect, struct rtree_hint *hint, int depth)
+{
+#ifdef USE_PATHHINT
+    if (depth >= HINT_DEPTH) {
+        hint = NULL;
+    }
+    int h = hint ? hint->path[depth] : node->count;
+    if (h < node->count) {
+        struct rect hrect = node_rect(node, h);
+        if (rect_contains(&hrect, rect)) {
+            return h;
+        }
+    }
+#endif
+    // Take a quick look for the first node that contain the rect.
+    int i = node_contains_next(node, 0, rect);
+    if (i < node->count) {
+#ifdef USE_PATHHINT
+        if (hint) hint->path[depth] = i;
+#endif
+        return i;
+    }
+    // Fallback to using che "choose least enlargment" algorithm.
+    if (tr->rstar && node->nodes[0]->kind == LEAF) {
+        i = node_choose_least_overlap_enlargement(node, rect);
+    } else {
+        i = node_choose_least_enlargement(node, rect);
+    }
+#ifdef USE_PATHHINT
+    if (hint) hint->path[depth] = i;
+#endif
+    return i;
+}
+
+struct rentry {
+    NUMTYPE dist;
+    int index;
+};
+
+static int rentry_compare(const void *a, const void *b) {
+    NUMTYPE da = ((const struct rentry *)a)->dist;
+    NUMTYPE db = ((const struct rentry *)b)->dist;
+    return da > db ? -1 : da < db ? 1 : 0;
+}
+
+// Forced reinsertion, as used by the R*-tree, takes the rects of a full leaf
+// that are farthest from its center and reinserts them, instead of splitting
+// right away. Each rect goes to whichever sibling leaf with room, or the leaf
+// itself, needs the least enlargement. Only the siblings are considered, which
+// allows for copying them before anything is moved, so running out of memory
+// never loses an item.
+static bool node_reinsert(struct rtree *tr, struct node *node, int index,
+    bool *moved)
+{
+    *moved = false;
+    struct node *leaf = node->nodes[index];
+    struct rect rect = node_rect(node, index);
+    struct rentry ents[MAXITEMS];
+    for (int i = 0; i < leaf->count; i++) {
+        NUMTYPE dist = 0;
+        for (int j = 0; j < DIMS; j++) {
+            NUMTYPE d = (node_coord(leaf, i, j) + node_coord(leaf, i, DIMS+j)) 
+                - (rect.min[j] + rect.max[j]);
+            dist += d * d;
+        }
+        ents[i].dist = dist;
+        ents[i].index = i;
+    }
+    qsort(ents, leaf->count, sizeof(struct rentry), rentry_compare);
+    int n = leaf->count * RSTAR_REINSERT_PERCENTAGE / 100;
+    n = n < 1 ? 1 : n;
+
+    // The bounds of the rects that stay in the leaf, and the sibling rects
+    // as they grow.
+    struct rect rects[MAXITEMS];
+    int counts[MAXITEMS];
+    for (int i = 0; i < node->count; i++) {
+        rects[i] = node_rect(node, i);
+        counts[i] = node->nodes[i]->count;
+    }
+    rects[index] = node_rect(leaf, ents[n].index);
+    for (int i = n+1; i < leaf->count; i++) {
+        struct rect rect = node_rect(leaf, ents[i].index);
+        rect_expand(&rects[index], &rect);
+    }
+    // closest first
+    int dests[MAXITEMS];
+    bool any = false;
+    for (int i = 0; i < leaf->count; i++) {
+        dests[i] = index;
+    }
+    for (int i = n-1; i >= 0; i--) {
+        struct rect rect = node_rect(leaf, ents[i].index);
+        int j = index;
+        NUMTYPE jenlarge = rect_unioned_area(&rects[index], &rect) - 
+            rect_area(&rects[index]);
+        for (int k = 0; k < node->count; k++) {
+            if (k == index || counts[k] == LEAF_MAXITEMS) {
+                continue;
+            }
+            NUMTYPE enlarge = rect_unioned_area(&rects[k], &rect) - 
+                rect_area(&rects[k]);
+            if (enlarge < jenlarge) {
+                j = k;
+                jenlarge = enlarge;
+            }
+        }
+        rect_expand(&rects[j], &rect);
+        if (j != index) {
+            counts[j]++;
+            any = true;
+        }
+        dests[ents[i].index] = j;
+    }
+    if (!any) {
+        return true;
+    }
+    for (int i = 0; i < leaf->count; i++) {
+        if (dests[i] != index) {
+            cow_node_or(node->nodes[dests[i]], return false);
+        }
+    }
+    // Move the rects starting with the highest index, because each move 
+    // fills the hole with the last rect in the leaf.
+    for (int i = leaf->count-1; i >= 0; i--) {
+        if (dests[i] != index) {
+            node_move_rect_at_index_into(leaf, i, node->nodes[dests[i]]);
+            node_set_rect(node, dests[i], &rects[dests[i]]);
+        }
+    }
+    rect = node_rect_calc(leaf);
+    node_set_rect(node, index, &rect);
+    *moved = true;
+    return true;
+}
+
+// Splits the child at the index in two, and adds the new half to the branch
+// node, which must not be full.
+//
+// Returns false if out of memory.
+static bool node_split_child(struct rtree *tr, struct node *node, int i) {
+    struct rect rect = node_rect(node, i);
+    struct node *right;
+    if (!node_split(tr, &rect, node->nodes[i], &right)) {
+        return false;
+    }
+    rect = node_rect_calc(node->nodes[i]);
+    node_set_rect(node, i, &rect);
+    rect = node_rect_calc(right);
+    node_set_rect(node, node->count, &rect);
+    node->nodes[node->count] = right;
+    node->count++;
+    return true;
+}
+
+// node_insert returns false if out of memory
+static bool node_insert(struct rtree *tr, struct node *node, struct rect *ir,
+    struct item item, struct rtree_hint *hint, int depth, bool *split)
+{
+    if (node->kind == LEAF) {
+        if (node->count == LEAF_MAXITEMS) {
+            *split = true;
+            return true;
+        }
+        int index = node->count;
+        node_set_rect(node, index, ir);
+        node->datas[index] = item;
+        node->count++;
+        *split = false;
+        return true;
+    }
+    // Choose a subtree for inserting the rectangle.
+    int i = node_choose(tr, node, ir, hint, depth);
+    cow_node_or(node->nodes[i], return false);
+    if (!node_insert(tr, node->nodes[i], ir, item, hint, depth+1, split)) {
+        return false;
+    }
+    struct rect rect = node_rect(node, i);
+    if (!*split) {
+        rect_expand(&rect, ir);
+#ifdef USE_QUANTBRANCH
+        if (node->nodes[i]->kind == BRANCH) {
+            // The child may have grown its frame, which rounds its own child
+            // rects out a little more.
+            struct rect crect = node_rect_calc(node->nodes[i]);
+            rect_expand(&rect, &crect);
+        }
+#endif
+        node_set_rect(node, i, &rect);
+        *split = false;
+        return true;
+    }
+    // make room in the child node, or split it
+    if (tr->rstar && !tr->reinserted && node->nodes[i]->kind == LEAF) {
+        tr->reinserted = true;
+        bool moved;
+        if (!node_reinsert(tr, node, i, &moved)) {
+            return false;
+        }
+        if (moved) {
+            return node_insert(tr, node, ir, item, hint, depth, split);
+        }
+    }
+    if (node->count == BRANCH_MAXITEMS) {
+        *split = true;
+        return true;
+    }
+    if (!node_split_child(tr, node, i)) {
+        return false;
+    }
+    return node_insert(tr, node, ir, item, hint, depth, split);
+}
+
+// Latches the node, which is the root or the child of a latched node, and 
+// copies it first if it's shared with a clone. The copy is latched too, as the 
+// latch is copied along with the rest of the node, and the shared node is 
+// unlatched.
+//
+// Returns false if out of memory, with the node unlatched.
+static bool node_latch_cow(struct rtree *tr, struct node **node) {
+    struct node *node1 = *node;
+    lock_acquire(&node1->lock);
+    if (rc_load(&node1->rc, tr->relaxed) > 0) {
+        struct node *node2 = node_copy(tr, node1);
+        lock_release(&node1->lock);
+        if (!node2) {
+            return false;
+        }
+        node_free(tr, node1);
+        *node = node2;
+    }
+    return true;
+}
+
+// Inserts the item in concurrent mode. The node is latched by the caller and
+// is not full, and it's unlatched before returning. On the way down, a full
+// child is split before it's entered, so a node is never needed again once
+// its child is latched, which allows for unlatching it right away, as in latch
+// crabbing. Writers in other subtrees go on at the same time. The hint is
+// optional (set to NULL), as it must not be shared with other writers.
+//
+// Returns false if out of memory.
+static bool node_insert_latched(struct rtree *tr, struct node *node, 
+    struct rect *ir, struct item item, struct rtree_hint *hint)
+{
+    bool ok = true;
+    for (int depth = 0; node->kind == BRANCH; depth++) {
+        int i = node_choose(tr, node, ir, hint, depth);
+        if (!node_latch_cow(tr, &node->nodes[i])) {
+            ok = false;
+            break;
+        }
+        struct node *child = node->nodes[i];
+        if (child->count == node_maxitems(child->kind)) {
+            ok = node_split_child(tr, node, i);
+            lock_release(&child->lock);
+            if (!ok) {
+                break;
+            }
+            // Choose from the two halves only, as the node may be full now.
+            if (node_enlargement(node, node->count-1, ir) < 
+                node_enlargement(node, i, ir))
+            {
+                i = node->count-1;
+#ifdef USE_PATHHINT
+                if (hint && depth < HINT_DEPTH) hint->path[depth] = i;
+#endif
+            }
+            child = node->nodes[i];
+            lock_acquire(&child->lock);
+        }
+        struct rect rect = node_rect(node, i);
+#ifdef USE_QUANTBRANCH
+        // The parent is gone by the time the child grows, so the frame of a
+        // quantized child is kept inside of its rect here, and grows with no
+        // slack, which keeps the child rects rounded inside of it too.
+        if (child->quant && !rect_contains(&rect, &child->frame)) {
+            node_refit(child);
+        }
+#endif
+        rect_expand(&rect, ir);
+#ifdef USE_QUANTBRANCH
+        if (node->quant && !rect_contains(&node->frame, &rect)) {
+            node_grow_frame(node, i, &rect, true);
+        }
+#endif
+        node_set_rect(node, i, &rect);
+        lock_release(&node->lock);
+        node = child;
+    }
+    if (ok) {
+        node_set_rect(node, node->count, ir);
+        node->datas[node->count] = item;
+        node->count++;
+    }
+    lock_release(&node->lock);
+    return ok;
+}
+
+struct rtree *rtree_new_with_allocator(void *(*_malloc)(size_t), 
+    void (*_free)(void*)
+) {
+    _malloc = _malloc ? _malloc : malloc;
+    _free = _free ? _free : free;
+    struct rtree *tr = (struct rtree *)_malloc(sizeof(struct rtree));
+    if (!tr) return NULL;
+    memset(tr, 0, sizeof(struct rtree));
+    tr->malloc = _malloc;
+    tr->free = _free;
+    return tr;
+}
+
+struct rtree *rtree_new(void) {
+    return rtree_new_with_allocator(NULL, NULL);
+}
+
+void rtree_set_item_callbacks(struct rtree *tr,
+    bool (*clone)(const DATATYPE item, DATATYPE *into, void *udata),
+    void (*free)(const DATATYPE item, void *udata))
+{
+    tr->item_clone = clone;
+    tr->item_free = free;
+}
+
+// returns false if out of memory
+static bool rtree_insert0(struct rtree *tr, struct rtree_hint *hint,
+    struct rect *rect, struct item item) 
+{
+    tr->reinserted = false;
+    while (1) {
+        if (!tr->root) {
+            struct node *new_root = node_new(tr, LEAF);
+            if (!new_root) {
+                return false;
+            }
+            tr->root = new_root;
+            tr->rect = *rect;
+            tr->height = 1;
+        }
+        bool split = false;
+        cow_node_or(tr->root, return false);
+        if (!node_insert(tr, tr->root, rect, item, hint, 0, &split)) {
+            return false;
+        }
+        if (!split) {
+            rect_expand(&tr->rect, rect);
+            tr->count++;
+            return true;
+        }
+        struct node *new_root = node_new_branch(tr, tr->root->kind);
+        if (!new_root) {
+            return false;
+        }
+        struct node *right;
+        if (!node_split(tr, &tr->rect, tr->root, &right)) {
+            node_dealloc(tr, new_root);
+            return false;
+        }
+        struct rect rect0 = node_rect_calc(tr->root);
+        struct rect rect1 = node_rect_calc(right);
+        node_set_rect(new_root, 0, &rect0);
+        node_set_rect(new_root, 1, &rect1);
+        new_root->nodes[0] = tr->root;
+        new_root->nodes[1] = right;
+        tr->root = new_root;
+        tr->root->count = 2;
+        tr->height++;
+    }
+}
+
+// Inserts in concurrent mode. The rtree is locked until the root is latched,
+// and is not full, and then the nodes are latched on the way down. Forced
+// reinserts are not used, as they would move items between siblings.
+//
+// Returns false if out of memory.
+static bool rtree_insert_latched(struct rtree *tr, struct rtree_hint *hint,
+    struct rect *rect, struct item item) 
+{
+    lock_acquire(&tr->lock);
+    if (!tr->root) {
+        struct node *new_root = node_new(tr, LEAF);
+        if (!new_root) {
+            lock_release(&tr->lock);
+            return false;
+        }
+        tr->root = new_root;
+        tr->rect = *rect;
+        tr->height = 1;
+    }
+    if (!node_latch_cow(tr, &tr->root)) {
+        lock_release(&tr->lock);
+        return false;
+    }
+    if (tr->root->count == node_maxitems(tr->root->kind)) {
+        struct node *new_root = node_new_branch(tr, tr->root->kind);
+        if (!new_root) {
+            lock_release(&tr->root->lock);
+            lock_release(&tr->lock);
+            return false;
+        }
+        new_root->nodes[0] = tr->root;
+        new_root->count = 1;
+        node_set_rect(new_root, 0, &tr->rect);
+        if (!node_split_child(tr, new_root, 0)) {
+            node_dealloc(tr, new_root);
+            lock_release(&tr->root->lock);
+            lock_release(&tr->lock);
+            return false;
+        }
+        lock_release(&tr->root->lock);
+        lock_acquire(&new_root->lock);
+        tr->root = new_root;
+        tr->height++;
+    }
+#ifdef USE_QUANTBRANCH
+    if (tr->root->quant && !rect_contains(&tr->rect, &tr->root->frame)) {
+        node_refit(tr->root);
+    }
+#endif
+    rect_expand(&tr->rect, rect);
+    struct node *root = tr->root;
+    lock_release(&tr->lock);
+    if (!node_insert_latched(tr, root, rect, item, hint)) {
+        return false;
+    }
+    lock_acquire(&tr->lock);
+    tr->count++;
+    lock_release(&tr->lock);
+    return true;
+}
+
+bool rtree_insert_hinted(struct rtree *tr, struct rtree_hint *hint,
+    const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data) 
+{
+#ifdef USE_PATHHINT
+    if (!hint && !tr->concurrent) {
+        hint = &tr->path_hint;
+    }
+#endif
+#ifdef USE_POINTS
+    assert(coords_ispoint(min, max));
+    max = NULL;
+#endif
+    // copy input rect
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    
+    if (!index_prepare(tr, 1)) {
+        return false;
+    }
+
+    // copy input data
+    struct item item;
+    if (tr->item_clone) {
+        if (!tr->item_clone(data, (DATATYPE*)&item.data, tr->udata)) {
+            return false;
+        }
+    } else {
+        memcpy(&item.data, &data, sizeof(DATATYPE));
+    }
+
+    bool ok = tr->concurrent ? rtree_insert_latched(tr, hint, &rect, item) : 
+        rtree_insert0(tr, hint, &rect, item);
+    if (!ok) {
+        // out of memory
+        if (tr->item_free) {
+            tr->item_free(item.data, tr->udata);
+        }
+        return false;
+    }
+    if (tr->index) {
+        index_set(tr, item, &rect);
+    }
+    return true;
+}
+
+bool rtree_insert(struct rtree *tr, const NUMTYPE *min, 
+    const NUMTYPE *max, const DATATYPE data) 
+{
+    return rtree_insert_hinted(tr, NULL, min, max, data);
+}
+
+// Bulk loading uses the Sort-Tile-Recursive (STR) algorithm. All entries of
+// a level are partitioned into slabs along the first axis, each slab is then
+// partitioned along the next axis, and so on. Consecutive entries are then
+// packed into full nodes, which become the entries of the level above.
+struct lentry {
+    struct rect rect;
+    union {
+        struct node *node;
+        struct item item;
+    };
+};
+
+static NUMTYPE lentry_center2(const struct lentry *entry, int axis) {
+    return entry->rect.min[axis] + entry->rect.max[axis];
+}
+
+static void lentry_swap(struct lentry *ents, size_t i, size_t j) {
+    struct lentry tmp = ents[i];
+    ents[i] = ents[j];
+    ents[j] = tmp;
+}
+
+// Partially sort the entries by the center of the axis so that every entry
+// before index k is less than or equal to every entry after k.
+static void lentry_select(struct lentry *ents, size_t n, size_t k, int axis) {
+    size_t s = 0;
+    size_t e = n;
+    while (e-s > 1) {
+        NUMTYPE pivot = lentry_center2(&ents[s+(e-s-1)/2], axis);
+        size_t i = s;
+        size_t j = e-1;
+        while (1) {
+            while (lentry_center2(&ents[i], axis) < pivot) i++;
+            while (lentry_center2(&ents[j], axis) > pivot) j--;
+            if (i >= j) break;
+            lentry_swap(ents, i, j);
+            i++;
+            j--;
+        }
+        if (k <= j) {
+            e = j+1;
+        } else {
+            s = j+1;
+        }
+    }
+}
+
+// Partition the entries into groups of size m, in order of the center of the
+// axis. The entries within each group are not sorted.
+static void lentry_group(struct lentry *ents, size_t n, size_t m, int axis) {
+    if (n <= m) {
+        return;
+    }
+    size_t k = (n/m+1)/2*m;
+    lentry_select(ents, n, k, axis);
+    lentry_group(ents, k, m, axis);
+    lentry_group(ents+k, n-k, m, axis);
+}
+
+// returns the smallest number whose k-th power is at least n
+static size_t lentry_root(size_t n, int k) {
+    size_t r = 1;
+    while (1) {
+        size_t p = 1;
+        for (int i = 0; i < k && p < n; i++) {
+            p *= r;
+        }
+        if (p >= n) {
+            return r;
+        }
+        r++;
+    }
+}
+
+// Tile the entries into groups of size m, which is the node size.
+static void lentry_tile(struct lentry *ents, size_t n, size_t m, int axis) {
+    if (n <= m) {
+        return;
+    }
+    if (axis == DIMS-1) {
+        lentry_group(ents, n, m, axis);
+        return;
+    }
+    // Split into slabs that are a multiple of the node size so that the
+    // final nodes never straddle two slabs.
+    size_t nnodes = (n+m-1)/m;
+    size_t nslabs = lentry_root(nnodes, DIMS-axis);
+    size_t slabsize = ((nnodes+nslabs-1)/nslabs)*m;
+    lentry_group(ents, n, slabsize, axis);
+    for (size_t i = 0; i < n; i += slabsize) {
+        size_t k = n-i < slabsize ? n-i : slabsize;
+        lentry_tile(ents+i, k, m, axis+1);
+    }
+}
+
+// Pack the entries into nodes. The new nodes are written to the front of the
+// entries array, and the number of new nodes is returned in nnodes.
+// Returns false if out of memory.
+static bool lentry_pack(struct rtree *tr, struct lentry *ents, size_t n, 
+    enum kind kind, size_t *nnodes)
+{
+    size_t maxitems = (size_t)node_maxitems(kind);
+    lentry_tile(ents, n, maxitems, 0);
+    size_t j = 0;
+    for (size_t i = 0; i < n; i += maxitems) {
+        struct node *node = kind == LEAF ? node_new(tr, LEAF) :
+            node_new_branch(tr, ents[i].node->kind);
+        if (!node) {
+            // Free the nodes from this level and the entries that have yet
+            // to be packed.
+            for (size_t k = 0; k < j; k++) {
+                node_free(tr, ents[k].node);
+            }
+            for (size_t k = i; k < n; k++) {
+                if (kind == BRANCH) {
+                    node_free(tr, ents[k].node);
+                } else if (tr->item_free) {
+                    tr->item_free(ents[k].item.data, tr->udata);
+                }
+            }
+            return false;
+        }
+        size_t m = n-i < maxitems ? n-i : maxitems;
+        for (size_t k = 0; k < m; k++) {
+            node_set_rect(node, k, &ents[i+k].rect);
+            if (kind == BRANCH) {
+                node->nodes[k] = ents[i+k].node;
+            } else {
+                node->datas[k] = ents[i+k].item;
+            }
+        }
+        node->count = (int)m;
+#ifdef USE_QUANTBRANCH
+        if (node->quant) {
+            node_reframe(node);
+        }
+#endif
+        ents[j].rect = node_rect_calc(node);
+        ents[j].node = node;
+        j++;
+    }
+    *nnodes = j;
+    return true;
+}
+
+// Adds the items below the node to the index, after index_prepare.
+static void index_add_node(struct rtree *tr, const struct node *node) {
+    if (node->kind == LEAF) {
+        for (int i = 0; i < node->count; i++) {
+            struct rect rect = node_rect(node, i);
+            index_set(tr, node->datas[i], &rect);
+        }
+    } else {
+        for (int i = 0; i < node->count; i++) {
+            index_add_node(tr, node->nodes[i]);
+        }
+    }
+}
+
+// Removes the items below the node from the index, after index_prepare.
+static void index_delete_node(struct rtree *tr, const struct node *node) {
+    if (node->kind == LEAF) {
+        for (int i = 0; i < node->count; i++) {
+            index_delete(tr, node->datas[i]);
+        }
+    } else {
+        for (int i = 0; i < node->count; i++) {
+            index_delete_node(tr, node->nodes[i]);
+        }
+    }
+}
+
+// Packs the leaves and then each branch level until there's one root, which
+// becomes the root of the rtree.
+// Returns false if out of memory, leaving the rtree as it was.
+static bool lentry_load(struct rtree *tr, struct lentry *ents, size_t count) {
+    size_t n = count;
+    size_t height = 0;
+    enum kind kind = LEAF;
+    do {
+        if (!lentry_pack(tr, ents, n, kind, &n)) {
+            return false;
+        }
+        kind = BRANCH;
+        height++;
+    } while (n > 1);
+    tr->root = ents[0].node;
+    tr->rect = ents[0].rect;
+    tr->count = count;
+    tr->height = height;
+    return true;
+}
+
+bool rtree_load(struct rtree *tr, const NUMTYPE *mins, const NUMTYPE *maxs, 
+    DATATYPE const *datas, size_t count)
+{
+#ifdef USE_POINTS
+    for (size_t i = 0; maxs && i < count; i++) {
+        assert(coords_ispoint(&mins[i*DIMS], &maxs[i*DIMS]));
+    }
+    maxs = NULL;
+#endif
+    if (tr->root) {
+        // The tree already has items. Fallback to inserting one at a time.
+        for (size_t i = 0; i < count; i++) {
+            if (!rtree_insert(tr, &mins[i*DIMS], maxs?&maxs[i*DIMS]:NULL, 
+                datas[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (count == 0) {
+        return true;
+    }
+    if (!index_prepare(tr, count)) {
+        return false;
+    }
+    struct lentry *ents = (struct lentry *)tr->malloc(sizeof(struct lentry)*
+        count);
+    if (!ents) {
+        return false;
+    }
+    // copy input rects and datas
+    for (size_t i = 0; i < count; i++) {
+        memcpy(&ents[i].rect.min[0], &mins[i*DIMS], sizeof(NUMTYPE)*DIMS);
+        memcpy(&ents[i].rect.max[0], maxs?&maxs[i*DIMS]:&mins[i*DIMS], 
+            sizeof(NUMTYPE)*DIMS);
+        if (tr->item_clone) {
+            if (!tr->item_clone(datas[i], (DATATYPE*)&ents[i].item.data, 
+                tr->udata))
+            {
+                if (tr->item_free) {
+                    for (size_t j = 0; j < i; j++) {
+                        tr->item_free(ents[j].item.data, tr->udata);
+                    }
+                }
+                tr->free(ents);
+                return false;
+            }
+        } else {
+            memcpy(&ents[i].item.data, &datas[i], sizeof(DATATYPE));
+        }
+    }
+    bool ok = lentry_load(tr, ents, count);
+    if (ok && tr->index) {
+        index_add_node(tr, tr->root);
+    }
+    tr->free(ents);
+    return ok;
+}
+
+// Moves the items below the node into the entries. Every node on the way that
+// is shared with a clone is copied first, so that all of the nodes and items
+// belong to this rtree.
+//
+// Returns false if out of memory.
+static bool node_gather(struct rtree *tr, struct node **node, 
+    struct lentry *ents, size_t *n)
+{
+    cow_node_or(*node, return false);
+    if ((*node)->kind == LEAF) {
+        for (int i = 0; i < (*node)->count; i++) {
+            ents[*n].rect = node_rect(*node, i);
+            ents[*n].item = (*node)->datas[i];
+            (*n)++;
+        }
+        return true;
+    }
+    for (int i = 0; i < (*node)->count; i++) {
+        if (!node_gather(tr, &(*node)->nodes[i], ents, n)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool rtree_compact(struct rtree *tr) {
+    if (!tr->root) {
+        return true;
+    }
+    struct lentry *ents = (struct lentry *)tr->malloc(sizeof(struct lentry)*
+        tr->count);
+    if (!ents) {
+        return false;
+    }
+    size_t n = 0;
+    if (!node_gather(tr, &tr->root, ents, &n)) {
+        tr->free(ents);
+        return false;
+    }
+    // The items are moved into the new nodes, so they are not freed along
+    // with the old nodes, or with the new nodes when out of memory.
+    void (*item_free)(const DATATYPE item, void *udata) = tr->item_free;
+    tr->item_free = NULL;
+    struct node *root = tr->root;
+    bool ok = lentry_load(tr, ents, n);
+    if (ok) {
+        node_free(tr, root);
+    }
+    tr->item_free = item_free;
+    tr->free(ents);
+    return ok;
+}
+
+// The binary format used by rtree_save and rtree_restore. All values are in
+// the native byte order of the machine, which is checked when restoring.
+// The header is followed by the nodes in depth-first order, starting with the
+// root. Each node is a uint32_t count followed by the child rects, and then
+// either the items (leaf) or the child nodes (branch).
+#define SAVE_MAGIC "RTREE"
+#define SAVE_VERSION 1
+#define SAVE_BOM 0x01020304
+
+struct save_header {
+    char magic[6];      // "RTREE"
+    uint8_t version;    // SAVE_VERSION
+    uint8_t dims;       // DIMS
+    uint32_t bom;       // SAVE_BOM, for detecting the byte order
+    uint32_t numsize;   // sizeof(NUMTYPE)
+    uint32_t datasize;  // sizeof(DATATYPE) or zero for custom item data
+    uint32_t maxitems;  // MAXITEMS, the most children of any node
+    uint32_t reserved;
+    uint64_t count;     // number of items
+    uint64_t height;    // height of the tree, zero when empty
+};
+
+struct save_context {
+    bool (*write)(const void *data, size_t size, void *udata);
+    bool (*item_write)(const DATATYPE item, void *udata);
+    void *udata;
+};
+
+static bool node_save(const struct node *node, struct save_context *ctx) {
+    uint32_t count = node->count;
+    struct rect rects[MAXITEMS];
+    for (int i = 0; i < node->count; i++) {
+        rects[i] = node_rect(node, i);
+    }
+    if (!ctx->write(&count, sizeof(uint32_t), ctx->udata) ||
+        !ctx->write(rects, sizeof(struct rect)*count, ctx->udata))
+    {
+        return false;
+    }
+    if (node->kind == BRANCH) {
+        for (int i = 0; i < node->count; i++) {
+            if (!node_save(node->nodes[i], ctx)) {
+                return false;
+            }
+        }
+    } else if (ctx->item_write) {
+        for (int i = 0; i < node->count; i++) {
+            if (!ctx->item_write(node->datas[i].data, ctx->udata)) {
+                return false;
+            }
+        }
+    } else {
+        if (!ctx->write(node->datas, sizeof(struct item)*count, ctx->udata)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool rtree_save(const struct rtree *tr,
+    bool (*write)(const void *data, size_t size, void *udata),
+    bool (*item_write)(const DATATYPE item, void *udata),
+    void *udata)
+{
+    struct save_header hdr;
+    memset(&hdr, 0, sizeof(struct save_header));
+    memcpy(hdr.magic, SAVE_MAGIC, sizeof(hdr.magic));
+    hdr.version = SAVE_VERSION;
+    hdr.dims = DIMS;
+    hdr.bom = SAVE_BOM;
+    hdr.numsize = sizeof(NUMTYPE);
+    hdr.datasize = item_write ? 0 : sizeof(DATATYPE);
+    hdr.maxitems = MAXITEMS;
+    hdr.count = tr->count;
+    hdr.height = tr->count ? tr->height : 0;
+    if (!write(&hdr, sizeof(struct save_header), udata)) {
+        return false;
+    }
+    if (hdr.height == 0) {
+        return true;
+    }
+    struct save_context ctx = {
+        .write = write,
+        .item_write = item_write,
+        .udata = udata,
+    };
+    return node_save(tr->root, &ctx);
+}
+
+struct restore_context {
+    struct rtree *tr;
+    bool (*read)(void *data, size_t size, void *udata);
+    bool (*item_read)(DATATYPE *item, void *udata);
+    void *udata;
+    uint32_t maxitems;  // max number of children in the saved nodes
+    size_t count;       // number of items restored
+};
+
+static struct node *node_restore(struct restore_context *ctx, size_t height,
+    struct rect *rect)
+{
+    struct rtree *tr = ctx->tr;
+    uint32_t count;
+    if (!ctx->read(&count, sizeof(uint32_t), ctx->udata) || count == 0 || 
+        count > ctx->maxitems || 
+        count > (uint32_t)node_maxitems(height == 1 ? LEAF : BRANCH))
+    {
+        return NULL;
+    }
+    struct rect rects[MAXITEMS];
+    if (!ctx->read(rects, sizeof(struct rect)*count, ctx->udata)) {
+        return NULL;
+    }
+#ifdef USE_POINTS
+    // The leaves can only hold points, so only the min corners are kept.
+    for (uint32_t i = 0; height == 1 && i < count; i++) {
+        memcpy(rects[i].max, rects[i].min, sizeof(NUMTYPE)*DIMS);
+    }
+#endif
+    struct node *node = height == 1 ? node_new(tr, LEAF) :
+        node_new_branch(tr, height == 2 ? LEAF : BRANCH);
+    if (!node) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        node_set_rect(node, i, &rects[i]);
+    }
+    if (node->kind == BRANCH) {
+        while (node->count < (int)count) {
+            struct rect crect;
+            struct node *child = node_restore(ctx, height-1, &crect);
+            if (!child) {
+                goto fail;
+            }
+            node->nodes[node->count++] = child;
+            if (!rect_contains(&rects[node->count-1], &crect)) {
+                goto fail;
+            }
+#ifdef USE_POINTS
+            // The child may have shrunk to the min corners of its items.
+            rects[node->count-1] = crect;
+            node_set_rect(node, node->count-1, &crect);
+#endif
+#ifdef USE_QUANTBRANCH
+            // The child rects are rounded again in the frame of the child,
+            // which may take them out a little past the rect as read.
+            struct rect rect2 = node_rect(node, node->count-1);
+            crect = node_rect_calc(child);
+            rect_expand(&rect2, &crect);
+            node_set_rect(node, node->count-1, &rect2);
+#endif
+        }
+#ifdef USE_QUANTBRANCH
+        if (node->quant) {
+            // The rects as read were rounded in the frame that was saved, so
+            // they are encoded from the leaves instead.
+            node_reframe(node);
+        }
+#endif
+    } else if (ctx->item_read) {
+        while (node->count < (int)count) {
+            if (!ctx->item_read((DATATYPE*)&node->datas[node->count].data,
+                ctx->udata))
+            {
+                goto fail;
+            }
+            node->count++;
+        }
+        ctx->count += count;
+    } else {
+        if (!ctx->read(node->datas, sizeof(struct item)*count, ctx->udata)) {
+            goto fail;
+        }
+        node->count = count;
+        ctx->count += count;
+    }
+    // The rects as read, because the rects of a branch node may be rounded
+    *rect = rects[0];
+    for (uint32_t i = 1; i < count; i++) {
+        rect_expand(rect, &rects[i]);
+    }
+    return node;
+fail:
+    node_free(tr, node);
+    return NULL;
+}
+
+bool rtree_restore(struct rtree *tr,
+    bool (*read)(void *data, size_t size, void *udata),
+    bool (*item_read)(DATATYPE *item, void *udata),
+    void *udata)
+{
+    if (tr->root) {
+        return false;
+    }
+    struct save_header hdr;
+    if (!read(&hdr, sizeof(struct save_header), udata) ||
+        memcmp(hdr.magic, SAVE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != SAVE_VERSION || hdr.dims != DIMS ||
+        hdr.bom != SAVE_BOM || hdr.numsize != sizeof(NUMTYPE) ||
+        hdr.datasize != (item_read ? 0 : sizeof(DATATYPE)) ||
+        hdr.maxitems < 2 || hdr.maxitems > MAXITEMS || hdr.height > 64 ||
+        (hdr.height == 0) != (hdr.count == 0))
+    {
+        return false;
+    }
+    if (hdr.height == 0) {
+        return true;
+    }
+    struct restore_context ctx = {
+        .tr = tr,
+        .read = read,
+        .item_read = item_read,
+        .udata = udata,
+        .maxitems = hdr.maxitems,
+    };
+    struct rect rect;
+    struct node *root = node_restore(&ctx, hdr.height, &rect);
+    if (!root) {
+        return false;
+    }
+    if (ctx.count != hdr.count || !index_prepare(tr, ctx.count)) {
+        node_free(tr, root);
+        return false;
+    }
+    tr->root = root;
+    tr->rect = rect;
+    tr->count = ctx.count;
+    tr->height = hdr.height;
+    if (tr->index) {
+        index_add_node(tr, root);
+    }
+    return true;
+}
+
+// A packed image is a read-only rtree that is searched in place, such as from
+// a memory-mapped file. The nodes are stored level by level, starting with
+// the root, and each branch refers to its children using byte offsets from
+// the start of the image. Children always follow their parents, which keeps
+// a corrupt image from sending a search into a loop.
+#define PACK_MAGIC "RTPACK"
+#define PACK_VERSION 1
+#define PACK_MAXHEIGHT 64
+#define PACK_ALIGN(size) (((size)+7)&~(size_t)7)
+
+struct rtree_packed {
+    char magic[6];      // "RTPACK"
+    uint8_t version;    // PACK_VERSION
+    uint8_t dims;       // DIMS
+    uint32_t bom;       // SAVE_BOM, for detecting the byte order
+    uint32_t numsize;   // sizeof(NUMTYPE)
+    uint32_t datasize;  // sizeof(DATATYPE)
+    uint32_t reserved;
+    uint64_t size;      // size of the image in bytes
+    uint64_t count;     // number of items
+    uint64_t height;    // height of the tree, zero when empty
+    uint64_t root;      // offset of the root node
+    struct rect rect;
+};
+
+// Each packed node is followed by its rects, padded to 8 bytes, and then
+// either the uint64_t offsets of the child nodes (branch) or the items (leaf).
+struct pnode {
+    uint32_t kind;
+    uint32_t count;
+};
+
+static size_t pnode_size(enum kind kind, size_t count) {
+    return sizeof(struct pnode) + PACK_ALIGN(sizeof(struct rect)*count) + 
+        PACK_ALIGN((kind == BRANCH ? sizeof(uint64_t) : sizeof(DATATYPE))*
+            count);
+}
+
+struct pack_context {
+    bool (*write)(const void *data, size_t size, void *udata);
+    void *udata;
+    uint64_t next[PACK_MAXHEIGHT];  // offset of the next node at each depth
+};
+
+static void node_pack_sizes(const struct node *node, size_t depth,
+    uint64_t *sizes)
+{
+    sizes[depth] += pnode_size(node->kind, node->count);
+    if (node->kind == BRANCH) {
+        for (int i = 0; i < node->count; i++) {
+            node_pack_sizes(node->nodes[i], depth+1, sizes);
+        }
+    }
+}
+
+static bool node_pack(const struct node *node, size_t depth, size_t level,
+    struct pack_context *ctx)
+{
+    if (depth < level) {
+        for (int i = 0; i < node->count; i++) {
+            if (!node_pack(node->nodes[i], depth+1, level, ctx)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    uint64_t buf[(sizeof(struct pnode)+(sizeof(struct rect)+
+        sizeof(uint64_t)+sizeof(DATATYPE))*MAXITEMS)/sizeof(uint64_t)+2];
+    size_t size = pnode_size(node->kind, node->count);
+    memset(buf, 0, size);
+    struct pnode *pn = (struct pnode *)buf;
+    pn->kind = node->kind;
+    pn->count = node->count;
+    struct rect *rects = (struct rect *)(pn+1);
+    char *tail = (char *)rects + PACK_ALIGN(sizeof(struct rect)*node->count);
+    for (int i = 0; i < node->count; i++) {
+        rects[i] = node_rect(node, i);
+    }
+    if (node->kind == BRANCH) {
+        uint64_t *offsets = (uint64_t *)tail;
+        for (int i = 0; i < node->count; i++) {
+            offsets[i] = ctx->next[depth+1];
+            ctx->next[depth+1] += pnode_size(node->nodes[i]->kind,
+                node->nodes[i]->count);
+        }
+    } else {
+        memcpy(tail, node->datas, sizeof(DATATYPE)*node->count);
+    }
+    return ctx->write(buf, size, ctx->udata);
+}
+
+bool rtree_pack(const struct rtree *tr,
+    bool (*write)(const void *data, size_t size, void *udata),
+    void *udata)
+{
+    struct rtree_packed hdr;
+    memset(&hdr, 0, sizeof(struct rtree_packed));
+    memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+    hdr.version = PACK_VERSION;
+    hdr.dims = DIMS;
+    hdr.bom = SAVE_BOM;
+    hdr.numsize = sizeof(NUMTYPE);
+    hdr.datasize = sizeof(DATATYPE);
+    hdr.count = tr->count;
+    hdr.height = tr->count ? tr->height : 0;
+    if (hdr.height > PACK_MAXHEIGHT) {
+        return false;
+    }
+    // The offset of the first node at each level follows all of the nodes
+    // in the levels above.
+    struct pack_context ctx = { .write = write, .udata = udata };
+    uint64_t sizes[PACK_MAXHEIGHT] = { 0 };
+    if (hdr.height > 0) {
+        node_pack_sizes(tr->root, 0, sizes);
+        hdr.rect = tr->rect;
+    }
+    uint64_t offset = PACK_ALIGN(sizeof(struct rtree_packed));
+    for (size_t i = 0; i < hdr.height; i++) {
+        ctx.next[i] = offset;
+        offset += sizes[i];
+    }
+    hdr.root = ctx.next[0];
+    hdr.size = offset;
+    if (!write(&hdr, PACK_ALIGN(sizeof(struct rtree_packed)), udata)) {
+        return false;
+    }
+    for (size_t i = 0; i < hdr.height; i++) {
+        if (!node_pack(tr->root, 0, i, &ctx)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const struct rtree_packed *rtree_packed_open(const void *data, size_t size) {
+    const struct rtree_packed *pk = (const struct rtree_packed *)data;
+    if (((uintptr_t)data)%8 != 0 || size < sizeof(struct rtree_packed) ||
+        memcmp(pk->magic, PACK_MAGIC, sizeof(pk->magic)) != 0 ||
+        pk->version != PACK_VERSION || pk->dims != DIMS ||
+        pk->bom != SAVE_BOM || pk->numsize != sizeof(NUMTYPE) ||
+        pk->datasize != sizeof(DATATYPE) || pk->size > size ||
+        pk->size < sizeof(struct rtree_packed) ||
+        pk->height > PACK_MAXHEIGHT || (pk->height == 0) != (pk->count == 0))
+    {
+        return NULL;
+    }
+    return pk;
+}
+
+// Returns the node at offset, or NULL if the node does not follow its parent
+// or does not fit in the image.
+static const struct pnode *pnode_at(const struct rtree_packed *pk, 
+    uint64_t offset, uint64_t parent, enum kind kind)
+{
+    if (offset <= parent || offset%8 != 0 || 
+        offset > pk->size-sizeof(struct pnode))
+    {
+        return NULL;
+    }
+    const struct pnode *pn = (const struct pnode *)((const char *)pk+offset);
+    if (pn->kind != (uint32_t)kind || pn->count == 0 || 
+        pnode_size(kind, pn->count) > pk->size-offset)
+    {
+        return NULL;
+    }
+    return pn;
+}
+
+static bool pnode_search(const struct rtree_packed *pk, uint64_t offset,
+    uint64_t parent, size_t height, const struct rect *rect,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata)
+{
+    const struct pnode *pn = pnode_at(pk, offset, parent, 
+        height == 1 ? LEAF : BRANCH);
+    if (!pn) {
+        // corrupt node, skip it
+        return true;
+    }
+    const struct rect *rects = (const struct rect *)(pn+1);
+    const char *tail = (const char *)rects + 
+        PACK_ALIGN(sizeof(struct rect)*pn->count);
+    if (height == 1) {
+        for (uint32_t i = 0; i < pn->count; i++) {
+            if (!rect || rect_intersects(&rects[i], rect)) {
+                DATATYPE data;
+                memcpy(&data, tail+sizeof(DATATYPE)*i, sizeof(DATATYPE));
+                if (!iter(rects[i].min, rects[i].max, data, udata)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    const uint64_t *offsets = (const uint64_t *)tail;
+    for (uint32_t i = 0; i < pn->count; i++) {
+        if (!rect || rect_intersects(&rects[i], rect)) {
+            if (!pnode_search(pk, offsets[i], offset, height-1, rect, iter,
+                udata))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void rtree_packed_search(const struct rtree_packed *pk, const NUMTYPE *min,
+    const NUMTYPE *max,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata)
+{
+    // copy input rect
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+
+    if (pk->height > 0 && rect_intersects(&pk->rect, &rect)) {
+        pnode_search(pk, pk->root, 0, pk->height, &rect, iter, udata);
+    }
+}
+
+void rtree_packed_scan(const struct rtree_packed *pk,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata)
+{
+    if (pk->height > 0) {
+        pnode_search(pk, pk->root, 0, pk->height, NULL, iter, udata);
+    }
+}
+
+size_t rtree_packed_count(const struct rtree_packed *pk) {
+    return pk->count;
+}
+
+// Releases the nodes, the slab, and the index of the rtree, but not the rtree
+// itself.
+static void rtree_release(struct rtree *tr) {
+    if (tr->root) {
+        if (tr->slab && !tr->item_free && rc_load(&tr->slab->rc, false) == 0) {
+            // No clones share the slab and there are no items to free, so
+            // the nodes are released in bulk along with the slab chunks.
+        } else {
+            node_free(tr, tr->root);
+        }
+    }
+    if (tr->slab) {
+        slab_release(tr->slab);
+    }
+    if (tr->index) {
+        index_release(tr->index, tr->free);
+    }
+}
+
+void rtree_free(struct rtree *tr) {
+    rtree_release(tr);
+    tr->free(tr);
+}
+
+// Starts loading the start of a node, and the start of its rects, which are
+// the first things that a search reads from it. Prefetches do not fault, so
+// lines past the end of a smaller node are harmless.
+static void node_prefetch(const struct node *node) {
+#ifdef USE_PREFETCH
+    __builtin_prefetch(node);
+    for (int i = 0; i < PREFETCH_LINES; i++) {
+#ifdef USE_SOA
+        for (int j = 0; j < DIMS; j++) {
+            __builtin_prefetch((const char*)&node->mins[j][0]+i*64);
+            __builtin_prefetch((const char*)&node->maxs[j][0]+i*64);
+        }
+#else
+        __builtin_prefetch((const char*)&node->rects[0]+i*64);
+#endif
+    }
+#else
+    (void)node;
+#endif
+}
+
+#ifdef USE_FLOATBRANCH
+
+// Searching with float branch rects compares them to the search rect after
+// it's rounded outwards to floats, once for each node rather than converting
+// every child rect. The rects of leaves are accessed directly.
+static bool node_search(struct node *node, struct rect *rect,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata) 
+{
+    if (node->kind == LEAF) {
+        return leaf_search(node, rect, iter, udata);
+    }
+    struct frect frect;
+    for (int i = 0; i < DIMS; i++) {
+        frect.min[i] = float_down(rect->min[i]);
+        frect.max[i] = float_up(rect->max[i]);
+    }
+    int hits[BRANCH_MAXITEMS];
+    int nhits = 0;
+    for (int i = 0; i < node->count; i++) {
+        int bits = 0;
+        for (int j = 0; j < DIMS; j++) {
+            bits |= frect.min[j] > node->frects[i].max[j];
+            bits |= frect.max[j] < node->frects[i].min[j];
+        }
+        if (bits == 0) {
+            hits[nhits++] = i;
+            node_prefetch(node->nodes[i]);
+        }
+    }
+    for (int i = 0; i < nhits; i++) {
+        if (!node_search(node->nodes[hits[i]], rect, iter, udata)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#elif defined(USE_QUANTBRANCH)
+
+// Searching with quantized branch rects compares their steps to the search 
+// rect after it's rounded to the steps of the frame, once for each node 
+// rather than decoding every child rect.
+static bool node_search(struct node *node, struct rect *rect,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata) 
+{
+    if (node->kind == LEAF) {
+        return leaf_search(node, rect, iter, udata);
+    }
+    int hits[BRANCH_MAXITEMS];
+    int nhits = 0;
+    if (!node->quant) {
+        for (int i = 0; i < node->count; i++) {
+            if (rect_intersects(&node->rects[i], rect)) {
+                hits[nhits++] = i;
+                node_prefetch(node->nodes[i]);
+            }
+        }
+        for (int i = 0; i < nhits; i++) {
+            if (!node_search(node->nodes[hits[i]], rect, iter, udata)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (!rect_intersects(&node->frame, rect)) {
+        return true;
+    }
+    // The search rect is rounded inwards, which is the same way that the
+    // coordinates it's compared to are rounded. For example, a child max is
+    // rounded up to the least step, so the search min is too.
+    struct qrect qrect;
+    for (int i = 0; i < DIMS; i++) {
+        qrect.min[i] = quant_encode(node->frame.min[i], node->frame.max[i], 
+            rect->min[i], true);
+        qrect.max[i] = quant_encode(node->frame.min[i], node->frame.max[i], 
+            rect->max[i], false);
+    }
+    for (int i = 0; i < node->count; i++) {
+        int bits = 0;
+        for (int j = 0; j < DIMS; j++) {
+            bits |= qrect.min[j] > node->qrects[i].max[j];
+            bits |= qrect.max[j] < node->qrects[i].min[j];
+        }
+        if (bits == 0) {
+            hits[nhits++] = i;
+            node_prefetch(node->nodes[i]);
+        }
+    }
+    for (int i = 0; i < nhits; i++) {
+        if (!node_search(node->nodes[hits[i]], rect, iter, udata)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#else
+
 static bool node_search(struct node *node, struct rect *rect,
     bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
         void *udata), 
     void *udata) 
 {
-    if (node->kind == LEAF) {
+    if (node->kind == LEAF) {
+#ifndef USE_SOA
+        return leaf_search(node, rect, iter, udata);
+#else
+        for (int i = 0; i < node->count; i += NODE_BLOCK) {
+            int mask = node_intersects_mask(node, i, rect);
+            for (int j = i; mask; j++, mask >>= 1) {
+                if (!(mask&1)) {
+                    continue;
+                }
+                struct rect rect2 = node_rect(node, j);
+                if (!iter(rect2.min, rect2.max, node->datas[j].data, udata)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+#endif
+    }
+    // All of the matching children are found, and prefetched, before any of
+    // them are searched.
+    int hits[BRANCH_MAXITEMS];
+    int nhits = 0;
+    for (int i = 0; i < node->count; i += NODE_BLOCK) {
+        int mask = node_intersects_mask(node, i, rect);
+        for (int j = i; mask; j++, mask >>= 1) {
+            if (mask&1) {
+                hits[nhits++] = j;
+                node_prefetch(node->nodes[j]);
+            }
+        }
+    }
+    for (int i = 0; i < nhits; i++) {
+        if (!node_search(node->nodes[hits[i]], rect, iter, udata)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
+
+void rtree_search(const struct rtree *tr, const NUMTYPE min[], 
+    const NUMTYPE max[],
+    bool (*iter)(const NUMTYPE min[], const NUMTYPE max[], const DATATYPE data, 
+        void *udata), 
+    void *udata)
+{
+    // copy input rect
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+
+    if (tr->root && rect_intersects(&tr->rect, &rect)) {
+        node_search(tr->root, &rect, iter, udata);
+    }
+}
+
+// Batch searching processes the queries in chunks of up to 64, where each
+// node is visited once for all queries in the chunk that intersect it. The
+// queries are tracked using a bitmask.
+#define BATCH_SIZE 64
+
+struct batch {
+    int count;
+    struct rect rects[BATCH_SIZE];
+    size_t indexes[BATCH_SIZE];
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        size_t index, void *udata);
+    void *udata;
+};
+
+static int ctz64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static bool node_search_batch(const struct node *node, 
+    const struct batch *batch, uint64_t mask)
+{
+    // Only the children that intersect the union of the queries need to be
+    // checked against each query.
+    struct rect urect = batch->rects[ctz64(mask)];
+    for (uint64_t m = mask & (mask-1); m; m &= m-1) {
+        rect_expand(&urect, &batch->rects[ctz64(m)]);
+    }
+    for (int i = node_intersects_next(node, 0, &urect); i < node->count;
+        i = node_intersects_next(node, i+1, &urect))
+    {
+        struct rect rect = node_rect(node, i);
+        uint64_t cmask = 0;
+        for (uint64_t m = mask; m; m &= m-1) {
+            int j = ctz64(m);
+            if (rect_intersects(&rect, &batch->rects[j])) {
+                cmask |= (uint64_t)1 << j;
+            }
+        }
+        if (!cmask) {
+            continue;
+        }
+        if (node->kind == BRANCH) {
+            if (!node_search_batch(node->nodes[i], batch, cmask)) {
+                return false;
+            }
+            continue;
+        }
+        for (; cmask; cmask &= cmask-1) {
+            int j = ctz64(cmask);
+            if (!batch->iter(rect.min, rect.max, node->datas[i].data, 
+                batch->indexes[j], batch->udata))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Sort key for the batch queries. The key is the position of the center of 
+// the query on a Z-order curve that spans the rtree rect.
+struct qkey {
+    uint32_t key;
+    uint32_t index;
+};
+
+static uint32_t zorder_key(const struct rect *bounds, const NUMTYPE *min, 
+    const NUMTYPE *max)
+{
+    const int bits = 32/DIMS;
+    uint32_t coords[DIMS];
+    for (int i = 0; i < DIMS; i++) {
+        double size = (double)bounds->max[i] - (double)bounds->min[i];
+        double c = ((double)min[i] + (double)max[i]) / 2;
+        double n = size > 0 ? (c - (double)bounds->min[i]) / size : 0;
+        n = n < 0 ? 0 : n > 1 ? 1 : n;
+        coords[i] = (uint32_t)(n * (double)((1u << bits) - 1));
+    }
+    uint32_t key = 0;
+    for (int b = bits-1; b >= 0; b--) {
+        for (int i = 0; i < DIMS; i++) {
+            key = (key << 1) | ((coords[i] >> b) & 1);
+        }
+    }
+    return key;
+}
+
+// Sort the keys using a radix sort, one byte at a time.
+static void qkey_sort(struct qkey *keys, struct qkey *tmp, size_t count) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        size_t offsets[256] = { 0 };
+        for (size_t i = 0; i < count; i++) {
+            offsets[(keys[i].key >> shift) & 0xFF]++;
+        }
+        size_t offset = 0;
+        for (int i = 0; i < 256; i++) {
+            size_t n = offsets[i];
+            offsets[i] = offset;
+            offset += n;
+        }
+        for (size_t i = 0; i < count; i++) {
+            tmp[offsets[(keys[i].key >> shift) & 0xFF]++] = keys[i];
+        }
+        struct qkey *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+}
+
+void rtree_search_batch(const struct rtree *tr, const NUMTYPE *mins, 
+    const NUMTYPE *maxs, size_t count,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        size_t index, void *udata),
+    void *udata)
+{
+    if (!tr->root || count == 0) {
+        return;
+    }
+    // Sort the queries so that the queries in each chunk are near each other,
+    // which keeps the chunk masks dense. This step is skipped if there is 
+    // only one chunk, or when out of memory.
+    struct qkey *keys = NULL;
+    if (count > BATCH_SIZE && count <= UINT32_MAX) {
+        keys = (struct qkey *)tr->malloc(sizeof(struct qkey)*count*2);
+        if (keys) {
+            for (size_t i = 0; i < count; i++) {
+                keys[i].key = zorder_key(&tr->rect, &mins[i*DIMS], 
+                    maxs?&maxs[i*DIMS]:&mins[i*DIMS]);
+                keys[i].index = (uint32_t)i;
+            }
+            // An even number of passes leaves the result in keys.
+            qkey_sort(keys, keys+count, count);
+        }
+    }
+    struct batch batch;
+    batch.iter = iter;
+    batch.udata = udata;
+    batch.count = 0;
+    bool stopped = false;
+    for (size_t i = 0; i < count && !stopped; i++) {
+        size_t index = keys ? keys[i].index : i;
+        struct rect *rect = &batch.rects[batch.count];
+        memcpy(&rect->min[0], &mins[index*DIMS], sizeof(NUMTYPE)*DIMS);
+        memcpy(&rect->max[0], maxs?&maxs[index*DIMS]:&mins[index*DIMS], 
+            sizeof(NUMTYPE)*DIMS);
+        if (!rect_intersects(&tr->rect, rect)) {
+            continue;
+        }
+        batch.indexes[batch.count] = index;
+        batch.count++;
+        if (batch.count == BATCH_SIZE) {
+            stopped = !node_search_batch(tr->root, &batch, ~(uint64_t)0);
+            batch.count = 0;
+        }
+    }
+    if (!stopped && batch.count > 0) {
+        node_search_batch(tr->root, &batch, ((uint64_t)1 << batch.count) - 1);
+    }
+    if (keys) {
+        tr->free(keys);
+    }
+}
+
+// Parallel searching splits the matching part of the tree into many subtrees,
+// which are then searched by a pool of threads. Each thread takes the next
+// unclaimed subtree until there are none left, so that threads that finish
+// early keep taking more work.
+#define PSEARCH_TASKS_PER_THREAD 4
+
+struct psearch {
+    struct rect rect;
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        int thread, void *udata);
+    void *udata;
+#ifdef USE_THREADS
+    struct node **tasks;
+    size_t ntasks;
+    atomic_size_t next;
+    atomic_bool stop;
+#endif
+};
+
+// a worker thread of a parallel search or self join
+struct pworker {
+    void *ctx;
+    int thread;
+};
+
+static bool psearch_iter(const NUMTYPE *min, const NUMTYPE *max, 
+    const DATATYPE data, void *udata)
+{
+    struct pworker *worker = (struct pworker *)udata;
+    struct psearch *ps = (struct psearch *)worker->ctx;
+#ifdef USE_THREADS
+    if (atomic_load_explicit(&ps->stop, memory_order_relaxed)) {
+        return false;
+    }
+#endif
+    if (!ps->iter(min, max, data, worker->thread, ps->udata)) {
+#ifdef USE_THREADS
+        atomic_store(&ps->stop, true);
+#endif
+        return false;
+    }
+    return true;
+}
+
+#ifdef USE_THREADS
+
+static void *psearch_worker(void *arg) {
+    struct pworker *worker = (struct pworker *)arg;
+    struct psearch *ps = (struct psearch *)worker->ctx;
+    while (!atomic_load(&ps->stop)) {
+        size_t i = atomic_fetch_add(&ps->next, 1);
+        if (i >= ps->ntasks) {
+            break;
+        }
+        node_search(ps->tasks[i], &ps->rect, psearch_iter, worker);
+    }
+    return NULL;
+}
+
+// Collect the subtrees that intersect the rect, level by level, until there 
+// are at least the target number of subtrees or the leaves are reached.
+// Returns false if out of memory.
+static bool psearch_tasks(const struct rtree *tr, struct psearch *ps, 
+    size_t target)
+{
+    ps->tasks = (struct node **)tr->malloc(sizeof(struct node*));
+    if (!ps->tasks) {
+        return false;
+    }
+    ps->tasks[0] = tr->root;
+    ps->ntasks = 1;
+    while (ps->ntasks < target && ps->tasks[0]->kind == BRANCH) {
+        struct node **tasks = (struct node **)tr->malloc(
+            sizeof(struct node*)*ps->ntasks*MAXITEMS);
+        if (!tasks) {
+            // Use the tasks that were already collected.
+            break;
+        }
+        size_t ntasks = 0;
+        for (size_t i = 0; i < ps->ntasks; i++) {
+            struct node *node = ps->tasks[i];
+            for (int j = node_intersects_next(node, 0, &ps->rect); 
+                j < node->count; j = node_intersects_next(node, j+1, &ps->rect))
+            {
+                tasks[ntasks++] = node->nodes[j];
+            }
+        }
+        tr->free(ps->tasks);
+        ps->tasks = tasks;
+        ps->ntasks = ntasks;
+        if (ntasks == 0) {
+            break;
+        }
+    }
+    return true;
+}
+
+// Run the work using the calling thread as worker zero, and nthreads-1 new
+// threads. When a thread cannot be started, the other workers take on its
+// share.
+static void parallel_run(const struct rtree *tr, int nthreads, 
+    void *(*work)(void *arg), void *ctx)
+{
+    struct pworker worker0 = { .ctx = ctx, .thread = 0 };
+    struct pworker *workers = (struct pworker *)tr->malloc(
+        (sizeof(struct pworker)+sizeof(pthread_t))*(size_t)nthreads);
+    int nstarted = 1;
+    if (workers) {
+        pthread_t *threads = (pthread_t *)(workers+nthreads);
+        for (int i = 1; i < nthreads; i++) {
+            workers[i].ctx = ctx;
+            workers[i].thread = i;
+            if (pthread_create(&threads[i], NULL, work, &workers[i]) != 0)
+            {
+                break;
+            }
+            nstarted++;
+        }
+        work(&worker0);
+        for (int i = 1; i < nstarted; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        tr->free(workers);
+    } else {
+        work(&worker0);
+    }
+}
+
+#endif
+
+void rtree_search_parallel(const struct rtree *tr, const NUMTYPE *min, 
+    const NUMTYPE *max, int nthreads,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        int thread, void *udata),
+    void *udata)
+{
+    struct psearch ps;
+    memset(&ps, 0, sizeof(struct psearch));
+    memcpy(&ps.rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&ps.rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    ps.iter = iter;
+    ps.udata = udata;
+    if (!tr->root || !rect_intersects(&tr->rect, &ps.rect)) {
+        return;
+    }
+#ifdef USE_THREADS
+    if (nthreads <= 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? (int)ncpus : 1;
+    }
+    if (nthreads > 1 && psearch_tasks(tr, &ps, 
+        (size_t)nthreads*PSEARCH_TASKS_PER_THREAD))
+    {
+        parallel_run(tr, nthreads, psearch_worker, &ps);
+        tr->free(ps.tasks);
+        return;
+    }
+#else
+    (void)nthreads;
+#endif
+    // Search on the calling thread only.
+    struct pworker worker0 = { .ctx = &ps, .thread = 0 };
+    node_search(tr->root, &ps.rect, psearch_iter, &worker0);
+}
+
+static bool node_scan(struct node *node,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata) 
+{
+    if (node->kind == LEAF) {
+        for (int i = 0; i < node->count; i++) {
+            struct rect rect = node_rect(node, i);
+            if (!iter(rect.min, rect.max, node->datas[i].data, udata)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    for (int i = 0; i < node->count; i++) {
+        if (!node_scan(node->nodes[i], iter, udata)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void rtree_scan(const struct rtree *tr, 
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
+        void *udata), 
+    void *udata)
+{
+    if (tr->root) {
+        node_scan(tr->root, iter, udata);
+    }
+}
+
+// Joining two rtrees descends both of them together, and only the children
+// of two nodes whose rects intersect are paired. The taller rtree is descended
+// alone until both sides are at the same level. At each pair of nodes, the
+// children of one that intersect the rect of the other are collected, and the
+// two lists are paired using a plane sweep along the first axis. Both lists
+// are sorted by their min, and each child is only compared to the children of
+// the other list that start before it ends.
+struct jentry {
+    struct rect rect;
+    int index;
+};
+
+struct join {
+    bool (*iter)(const NUMTYPE *min1, const NUMTYPE *max1, 
+        const DATATYPE data1, const NUMTYPE *min2, const NUMTYPE *max2, 
+        const DATATYPE data2, void *udata);
+    void *udata;
+};
+
+// Adds the child to the entries, which are sorted by the min of the first
+// axis, and returns the new number of them.
+static int jentry_add(struct jentry *ents, int n, const struct node *node, 
+    int i)
+{
+    struct jentry ent = { .rect = node_rect(node, i), .index = i };
+    // insertion sort, as there are only a few children
+    int j = n;
+    while (j > 0 && ents[j-1].rect.min[0] > ent.rect.min[0]) {
+        ents[j] = ents[j-1];
+        j--;
+    }
+    ents[j] = ent;
+    return n+1;
+}
+
+// Collects the children that intersect the rect, sorted by the min of the
+// first axis, and returns the number of them.
+static int node_join_entries(const struct node *node, const struct rect *rect,
+    struct jentry *ents)
+{
+    int n = 0;
+    for (int i = node_intersects_next(node, 0, rect); i < node->count; 
+        i = node_intersects_next(node, i+1, rect))
+    {
+        n = jentry_add(ents, n, node, i);
+    }
+    return n;
+}
+
+// Passes each pair of entries, one from each list, whose rects intersect to
+// the pair function. When the second list is NULL, the pairs are from the
+// first list only, and each pair is passed once.
+//
+// Returning false from the pair function stops the sweep.
+static bool jentry_sweep(const struct jentry *ents1, int n1, 
+    const struct jentry *ents2, int n2,
+    bool (*pair)(const struct jentry *ent1, const struct jentry *ent2, 
+        void *udata),
+    void *udata)
+{
+    if (!ents2) {
+        for (int i = 0; i < n1; i++) {
+            for (int k = i+1; k < n1 && 
+                ents1[k].rect.min[0] <= ents1[i].rect.max[0]; k++)
+            {
+                if (rect_intersects(&ents1[i].rect, &ents1[k].rect) &&
+                    !pair(&ents1[i], &ents1[k], udata))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    int i = 0;
+    int j = 0;
+    while (i < n1 && j < n2) {
+        if (ents1[i].rect.min[0] <= ents2[j].rect.min[0]) {
+            for (int k = j; k < n2 && 
+                ents2[k].rect.min[0] <= ents1[i].rect.max[0]; k++)
+            {
+                if (rect_intersects(&ents1[i].rect, &ents2[k].rect) &&
+                    !pair(&ents1[i], &ents2[k], udata))
+                {
+                    return false;
+                }
+            }
+            i++;
+        } else {
+            for (int k = i; k < n1 && 
+                ents1[k].rect.min[0] <= ents2[j].rect.max[0]; k++)
+            {
+                if (rect_intersects(&ents1[k].rect, &ents2[j].rect) &&
+                    !pair(&ents1[k], &ents2[j], udata))
+                {
+                    return false;
+                }
+            }
+            j++;
+        }
+    }
+    return true;
+}
+
+static bool node_join(const struct node *node1, size_t height1, 
+    const struct rect *rect1, const struct node *node2, size_t height2, 
+    const struct rect *rect2, const struct join *join);
+
+// the nodes whose children are being paired, which are at the same level
+struct jnodes {
+    const struct node *node1;
+    const struct node *node2;
+    size_t height;
+    const struct join *join;
+};
+
+// Pairs two children, which are items when the nodes are leaves.
+static bool node_join_pair(const struct jentry *ent1, const struct jentry *ent2,
+    void *udata)
+{
+    const struct jnodes *jn = (const struct jnodes *)udata;
+    if (jn->node1->kind == LEAF) {
+        return jn->join->iter(ent1->rect.min, ent1->rect.max, 
+            jn->node1->datas[ent1->index].data, ent2->rect.min, 
+            ent2->rect.max, jn->node2->datas[ent2->index].data, 
+            jn->join->udata);
+    }
+    return node_join(jn->node1->nodes[ent1->index], jn->height-1, &ent1->rect,
+        jn->node2->nodes[ent2->index], jn->height-1, &ent2->rect, jn->join);
+}
+
+static bool node_join(const struct node *node1, size_t height1, 
+    const struct rect *rect1, const struct node *node2, size_t height2, 
+    const struct rect *rect2, const struct join *join)
+{
+    // The taller side is descended alone.
+    if (height1 > height2) {
+        for (int i = node_intersects_next(node1, 0, rect2); i < node1->count; 
+            i = node_intersects_next(node1, i+1, rect2))
+        {
+            struct rect crect = node_rect(node1, i);
+            if (!node_join(node1->nodes[i], height1-1, &crect, node2, height2,
+                rect2, join))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (height2 > height1) {
+        for (int i = node_intersects_next(node2, 0, rect1); i < node2->count; 
+            i = node_intersects_next(node2, i+1, rect1))
+        {
+            struct rect crect = node_rect(node2, i);
+            if (!node_join(node1, height1, rect1, node2->nodes[i], height2-1,
+                &crect, join))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    struct jentry ents1[MAXITEMS];
+    struct jentry ents2[MAXITEMS];
+    int n1 = node_join_entries(node1, rect2, ents1);
+    int n2 = node_join_entries(node2, rect1, ents2);
+    struct jnodes jn = { node1, node2, height1, join };
+    return jentry_sweep(ents1, n1, ents2, n2, node_join_pair, &jn);
+}
+
+void rtree_join(const struct rtree *tr1, const struct rtree *tr2,
+    bool (*iter)(const NUMTYPE *min1, const NUMTYPE *max1, 
+        const DATATYPE data1, const NUMTYPE *min2, const NUMTYPE *max2, 
+        const DATATYPE data2, void *udata),
+    void *udata)
+{
+    if (!tr1->root || !tr2->root || !rect_intersects(&tr1->rect, &tr2->rect)) {
+        return;
+    }
+    struct join join = { .iter = iter, .udata = udata };
+    node_join(tr1->root, tr1->height, &tr1->rect, tr2->root, tr2->height, 
+        &tr2->rect, &join);
+}
+
+// A self join pairs the children of each node with each other, and then
+// joins the subtrees of each pair that intersect, and then self joins each
+// child. Every pair of items is under exactly one node where their paths
+// split, so that each pair is found once.
+static bool node_self_join(const struct node *node, size_t height, 
+    const struct join *join)
+{
+    struct jentry ents[MAXITEMS];
+    int n = 0;
+    for (int i = 0; i < node->count; i++) {
+        n = jentry_add(ents, n, node, i);
+    }
+    struct jnodes jn = { node, node, height, join };
+    if (!jentry_sweep(ents, n, NULL, 0, node_join_pair, &jn)) {
+        return false;
+    }
+    if (node->kind == BRANCH) {
+        for (int i = 0; i < node->count; i++) {
+            if (!node_self_join(node->nodes[i], height-1, join)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void rtree_self_join(const struct rtree *tr,
+    bool (*iter)(const NUMTYPE *min1, const NUMTYPE *max1, 
+        const DATATYPE data1, const NUMTYPE *min2, const NUMTYPE *max2, 
+        const DATATYPE data2, void *udata),
+    void *udata)
+{
+    if (tr->root) {
+        struct join join = { .iter = iter, .udata = udata };
+        node_self_join(tr->root, tr->height, &join);
+    }
+}
+
+// Parallel self joins split the work into many tasks, level by level, as with
+// parallel searching. Each task is either the self join of a subtree or the
+// join of two subtrees at the same level.
+struct jtask {
+    const struct node *node1;
+    const struct node *node2;   // NULL for the self join of node1
+    struct rect rect1;          // the rects of the nodes, for a join
+    struct rect rect2;
+};
+
+struct pjoin {
+    bool (*iter)(const NUMTYPE *min1, const NUMTYPE *max1, 
+        const DATATYPE data1, const NUMTYPE *min2, const NUMTYPE *max2, 
+        const DATATYPE data2, int thread, void *udata);
+    void *udata;
+#ifdef USE_THREADS
+    struct jtask *tasks;
+    size_t ntasks;
+    size_t height;              // the level of the nodes of the tasks
+    atomic_size_t next;
+    atomic_bool stop;
+#endif
+};
+
+static bool pjoin_iter(const NUMTYPE *min1, const NUMTYPE *max1, 
+    const DATATYPE data1, const NUMTYPE *min2, const NUMTYPE *max2, 
+    const DATATYPE data2, void *udata)
+{
+    struct pworker *worker = (struct pworker *)udata;
+    struct pjoin *pj = (struct pjoin *)worker->ctx;
+#ifdef USE_THREADS
+    if (atomic_load_explicit(&pj->stop, memory_order_relaxed)) {
+        return false;
+    }
+#endif
+    if (!pj->iter(min1, max1, data1, min2, max2, data2, worker->thread, 
+        pj->udata))
+    {
+#ifdef USE_THREADS
+        atomic_store(&pj->stop, true);
+#endif
+        return false;
+    }
+    return true;
+}
+
+#ifdef USE_THREADS
+
+static void *pjoin_worker(void *arg) {
+    struct pworker *worker = (struct pworker *)arg;
+    struct pjoin *pj = (struct pjoin *)worker->ctx;
+    struct join join = { .iter = pjoin_iter, .udata = worker };
+    while (!atomic_load(&pj->stop)) {
+        size_t i = atomic_fetch_add(&pj->next, 1);
+        if (i >= pj->ntasks) {
+            break;
+        }
+        struct jtask *task = &pj->tasks[i];
+        if (task->node2) {
+            node_join(task->node1, pj->height, &task->rect1, task->node2, 
+                pj->height, &task->rect2, &join);
+        } else {
+            node_self_join(task->node1, pj->height, &join);
+        }
+    }
+    return NULL;
+}
+
+// the tasks of the next level, which are only counted when there's no room
+struct jtasks {
+    struct jtask *tasks;
+    size_t ntasks;
+    const struct node *node1;
+    const struct node *node2;
+};
+
+static bool jtasks_add(const struct jentry *ent1, const struct jentry *ent2,
+    void *udata)
+{
+    struct jtasks *jt = (struct jtasks *)udata;
+    if (jt->tasks) {
+        jt->tasks[jt->ntasks] = (struct jtask) {
+            .node1 = jt->node1->nodes[ent1->index],
+            .node2 = jt->node2->nodes[ent2->index],
+            .rect1 = ent1->rect,
+            .rect2 = ent2->rect,
+        };
+    }
+    jt->ntasks++;
+    return true;
+}
+
+// Adds the tasks of the next level for the task.
+static void jtask_split(const struct jtask *task, struct jtasks *jt) {
+    struct jentry ents1[MAXITEMS];
+    struct jentry ents2[MAXITEMS];
+    jt->node1 = task->node1;
+    jt->node2 = task->node2 ? task->node2 : task->node1;
+    if (task->node2) {
+        int n1 = node_join_entries(task->node1, &task->rect2, ents1);
+        int n2 = node_join_entries(task->node2, &task->rect1, ents2);
+        jentry_sweep(ents1, n1, ents2, n2, jtasks_add, jt);
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < task->node1->count; i++) {
+        n = jentry_add(ents1, n, task->node1, i);
+        if (jt->tasks) {
+            jt->tasks[jt->ntasks] = (struct jtask) {
+                .node1 = task->node1->nodes[i],
+            };
+        }
+        jt->ntasks++;
+    }
+    jentry_sweep(ents1, n, NULL, 0, jtasks_add, jt);
+}
+
+// Split the tasks level by level, until there are at least the target number 
+// of tasks or the leaves are reached.
+// Returns false if out of memory.
+static bool pjoin_tasks(const struct rtree *tr, struct pjoin *pj, 
+    size_t target)
+{
+    pj->tasks = (struct jtask *)tr->malloc(sizeof(struct jtask));
+    if (!pj->tasks) {
+        return false;
+    }
+    pj->tasks[0] = (struct jtask) { .node1 = tr->root };
+    pj->ntasks = 1;
+    pj->height = tr->height;
+    while (pj->ntasks > 0 && pj->ntasks < target && pj->height > 1) {
+        struct jtasks jt = { 0 };
+        for (size_t i = 0; i < pj->ntasks; i++) {
+            jtask_split(&pj->tasks[i], &jt);
+        }
+        jt.tasks = (struct jtask *)tr->malloc(
+            sizeof(struct jtask)*(jt.ntasks > 0 ? jt.ntasks : 1));
+        if (!jt.tasks) {
+            // Use the tasks that were already collected.
+            break;
+        }
+        jt.ntasks = 0;
+        for (size_t i = 0; i < pj->ntasks; i++) {
+            jtask_split(&pj->tasks[i], &jt);
+        }
+        tr->free(pj->tasks);
+        pj->tasks = jt.tasks;
+        pj->ntasks = jt.ntasks;
+        pj->height--;
+    }
+    return true;
+}
+
+#endif
+
+void rtree_self_join_parallel(const struct rtree *tr, int nthreads,
+    bool (*iter)(const NUMTYPE *min1, const NUMTYPE *max1, 
+        const DATATYPE data1, const NUMTYPE *min2, const NUMTYPE *max2, 
+        const DATATYPE data2, int thread, void *udata),
+    void *udata)
+{
+    struct pjoin pj;
+    memset(&pj, 0, sizeof(struct pjoin));
+    pj.iter = iter;
+    pj.udata = udata;
+    if (!tr->root) {
+        return;
+    }
+#ifdef USE_THREADS
+    if (nthreads <= 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? (int)ncpus : 1;
+    }
+    if (nthreads > 1 && pjoin_tasks(tr, &pj, 
+        (size_t)nthreads*PSEARCH_TASKS_PER_THREAD))
+    {
+        parallel_run(tr, nthreads, pjoin_worker, &pj);
+        tr->free(pj.tasks);
+        return;
+    }
+#else
+    (void)nthreads;
+#endif
+    // Join on the calling thread only.
+    struct pworker worker0 = { .ctx = &pj, .thread = 0 };
+    struct join join = { .iter = pjoin_iter, .udata = &worker0 };
+    node_self_join(tr->root, tr->height, &join);
+}
+
+// The iterator walks the tree using an explicit stack of nodes, one for each
+// level, where each entry holds the index of the next child to visit.
+struct iter_entry {
+    struct node *node;
+    int index;
+};
+
+struct rtree_iter {
+    struct rtree *tr;       // copy-on-write snapshot of the rtree
+    struct rect rect;       // search rect
+    bool all;               // produce every item, ignoring the search rect
+    struct rect item_rect;  // rect of the current item
+    size_t depth;           // number of entries in the stack
+    struct iter_entry stack[];
+};
+
+struct rtree_iter *rtree_iter_init(struct rtree *tr, const NUMTYPE *min, 
+    const NUMTYPE *max)
+{
+    struct rtree_iter *iter = (struct rtree_iter *)tr->malloc(
+        sizeof(struct rtree_iter)+sizeof(struct iter_entry)*tr->height);
+    if (!iter) {
+        return NULL;
+    }
+    memset(iter, 0, sizeof(struct rtree_iter));
+    iter->tr = rtree_clone(tr);
+    if (!iter->tr) {
+        tr->free(iter);
+        return NULL;
+    }
+    if (min) {
+        memcpy(&iter->rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+        memcpy(&iter->rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    } else {
+        iter->all = true;
+    }
+    if (tr->root && (iter->all || rect_intersects(&tr->rect, &iter->rect))) {
+        iter->stack[0].node = iter->tr->root;
+        iter->stack[0].index = 0;
+        iter->depth = 1;
+    }
+    return iter;
+}
+
+bool rtree_iter_next(struct rtree_iter *iter, const NUMTYPE **min, 
+    const NUMTYPE **max, const DATATYPE *data)
+{
+    while (iter->depth > 0) {
+        struct iter_entry *entry = &iter->stack[iter->depth-1];
+        struct node *node = entry->node;
+        int i = iter->all ? entry->index : 
+            node_intersects_next(node, entry->index, &iter->rect);
+        if (i >= node->count) {
+            iter->depth--;
+            continue;
+        }
+        entry->index = i+1;
+        if (node->kind == BRANCH) {
+            iter->stack[iter->depth].node = node->nodes[i];
+            iter->stack[iter->depth].index = 0;
+            iter->depth++;
+            continue;
+        }
+        iter->item_rect = node_rect(node, i);
+        if (min) {
+            *min = iter->item_rect.min;
+        }
+        if (max) {
+            *max = iter->item_rect.max;
+        }
+        if (data) {
+            memcpy((void*)data, &node->datas[i].data, sizeof(DATATYPE));
+        }
+        return true;
+    }
+    return false;
+}
+
+void rtree_iter_free(struct rtree_iter *iter) {
+    void (*_free)(void *) = iter->tr->free;
+    rtree_free(iter->tr);
+    _free(iter);
+}
+
+size_t rtree_count(const struct rtree *tr) {
+    return tr->count;
+}
+
+// Nearby searching uses a best-first traversal. The candidate nodes and items
+// are kept in a binary min-heap ordered by distance, and the closest one is
+// always expanded next. Items are yielded as they are popped from the heap,
+// which guarantees that they are in order of distance.
+//
+// Each heap entry refers to a child slot of a node, rather than copying its
+// rect and data, to keep the entries small.
+struct nentry {
+    double dist;
+    struct node *node;  // parent node, or NULL for the root
+    int index;          // child slot in the parent node
+};
+
+struct nheap {
+    struct nentry *ents;
+    size_t len;
+    size_t cap;
+    struct nentry *stack;
+};
+
+static bool nentry_less(const struct nentry *a, const struct nentry *b) {
+    if (a->dist < b->dist) {
+        return true;
+    }
+    // items go before nodes at the same distance
+    return a->dist == b->dist && 
+        (a->node && a->node->kind == LEAF) > (b->node && b->node->kind == LEAF);
+}
+
+// Returns false if out of memory.
+static bool nheap_push(const struct rtree *tr, struct nheap *heap,
+    const struct nentry *ent)
+{
+    if (heap->len == heap->cap) {
+        size_t cap = heap->cap*2;
+        struct nentry *ents = (struct nentry *)tr->malloc(
+            sizeof(struct nentry)*cap);
+        if (!ents) {
+            return false;
+        }
+        memcpy(ents, heap->ents, sizeof(struct nentry)*heap->len);
+        if (heap->ents != heap->stack) {
+            tr->free(heap->ents);
+        }
+        heap->ents = ents;
+        heap->cap = cap;
+    }
+    size_t i = heap->len++;
+    while (i > 0) {
+        size_t parent = (i-1)/2;
+        if (!nentry_less(ent, &heap->ents[parent])) {
+            break;
+        }
+        heap->ents[i] = heap->ents[parent];
+        i = parent;
+    }
+    heap->ents[i] = *ent;
+    return true;
+}
+
+static void nheap_pop(struct nheap *heap, struct nentry *ent) {
+    *ent = heap->ents[0];
+    struct nentry *last = &heap->ents[--heap->len];
+    size_t i = 0;
+    while (1) {
+        size_t child = i*2+1;
+        if (child >= heap->len) {
+            break;
+        }
+        if (child+1 < heap->len &&
+            nentry_less(&heap->ents[child+1], &heap->ents[child]))
+        {
+            child++;
+        }
+        if (!nentry_less(&heap->ents[child], last)) {
+            break;
+        }
+        heap->ents[i] = heap->ents[child];
+        i = child;
+    }
+    heap->ents[i] = *last;
+}
+
+bool rtree_nearby(const struct rtree *tr,
+    double (*dist)(const NUMTYPE *min, const NUMTYPE *max,
+        const DATATYPE data, bool item, void *udata),
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        double dist, void *udata),
+    void *udata)
+{
+    if (!tr->root) {
+        return true;
+    }
+    struct item noitem;
+    memset(&noitem, 0, sizeof(struct item));
+    struct nentry stack[128];
+    struct nheap heap = { .ents = stack, .cap = 128, .stack = stack };
+    struct nentry ent = { 0 };
+    ent.dist = dist(tr->rect.min, tr->rect.max, noitem.data, false, udata);
+    bool ok = nheap_push(tr, &heap, &ent);
+    while (ok && heap.len > 0) {
+        nheap_pop(&heap, &ent);
+        struct node *node;
+        if (!ent.node) {
+            node = tr->root;
+        } else if (ent.node->kind == LEAF) {
+            struct rect rect = node_rect(ent.node, ent.index);
+            if (!iter(rect.min, rect.max, ent.node->datas[ent.index].data,
+                ent.dist, udata))
+            {
+                break;
+            }
+            continue;
+        } else {
+            node = ent.node->nodes[ent.index];
+        }
+        bool leaf = node->kind == LEAF;
+        ent.node = node;
         for (int i = 0; i < node->count; i++) {
-            if (rect_intersects(&node->rects[i], rect)) {
-                if (!iter(node->rects[i].min, node->rects[i].max, 
-                    node->datas[i].data, udata))
-                {
-                    return false;
-                }
+            ent.index = i;
+            struct rect rect = node_rect(node, i);
+            ent.dist = dist(rect.min, rect.max, 
+                leaf ? node->datas[i].data : noitem.data, leaf, udata);
+            if (!nheap_push(tr, &heap, &ent)) {
+                ok = false;
+                break;
+            }
+        }
+    }
+    if (heap.ents != heap.stack) {
+        tr->free(heap.ents);
+    }
+    return ok;
+}
+
+struct knn_context {
+    struct rect rect;
+    size_t k;
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        double dist, void *udata);
+    void *udata;
+};
+
+static double knn_dist(const NUMTYPE *min, const NUMTYPE *max,
+    const DATATYPE data, bool item, void *udata)
+{
+    (void)data, (void)item;
+    struct knn_context *ctx = (struct knn_context *)udata;
+    double dist = 0;
+    for (int i = 0; i < DIMS; i++) {
+        double d = 0;
+        if (min[i] > ctx->rect.max[i]) {
+            d = (double)min[i] - (double)ctx->rect.max[i];
+        } else if (max[i] < ctx->rect.min[i]) {
+            d = (double)ctx->rect.min[i] - (double)max[i];
+        }
+        dist += d*d;
+    }
+    return dist;
+}
+
+static bool knn_iter(const NUMTYPE *min, const NUMTYPE *max,
+    const DATATYPE data, double dist, void *udata)
+{
+    struct knn_context *ctx = (struct knn_context *)udata;
+    if (!ctx->iter(min, max, data, sqrt(dist), ctx->udata)) {
+        return false;
+    }
+    return --ctx->k > 0;
+}
+
+bool rtree_knn(const struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max,
+    size_t k,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        double dist, void *udata),
+    void *udata)
+{
+    if (k == 0) {
+        return true;
+    }
+    struct knn_context ctx = { .k = k, .iter = iter, .udata = udata };
+    memcpy(&ctx.rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&ctx.rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    return rtree_nearby(tr, knn_dist, knn_iter, &ctx);
+}
+
+// Returns the index of the item in the leaf, or the leaf count if it's not 
+// there.
+static int node_find_item(const struct node *node, const struct rect *ir,
+    struct item item, 
+    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
+    void *udata)
+{
+    for (int i = 0; i < node->count; i++) {
+        struct rect rect = node_rect(node, i);
+        if (!rect_equals_bin(ir, &rect)) {
+            // Must be exactly the same, binary comparison.
+            continue;
+        }
+        int cmp = compare ?
+            compare(node->datas[i].data, item.data, udata) :
+            memcmp(&node->datas[i].data, &item.data, sizeof(DATATYPE));
+        if (cmp == 0) {
+            return i;
+        }
+    }
+    return node->count;
+}
+
+// Removes the item at the index from the leaf, without freeing it, filling 
+// the hole with the last item.
+static void node_take_item(struct node *node, int i) {
+    struct rect rect = node_rect(node, node->count-1);
+    node_set_rect(node, i, &rect);
+    node->datas[i] = node->datas[node->count-1];
+    node->count--;
+}
+
+// Removes the item at the index from the leaf, filling the hole with the last
+// item.
+static void node_remove_item(struct rtree *tr, struct node *node, int i) {
+    if (tr->index) {
+        index_delete(tr, node->datas[i]);
+    }
+    if (tr->item_free) {
+        tr->item_free(node->datas[i].data, tr->udata);
+    }
+    node_take_item(node, i);
+}
+
+// Returns true if the child at the index has fewer than MINITEMS children,
+// and has siblings that it could be merged into.
+static bool node_underflow(const struct node *node, int index) {
+    const struct node *child = node->nodes[index];
+    return node->count > 1 && child->count > 0 &&
+        child->count < MINITEMS(node_maxitems(child->kind));
+}
+
+// Merges an underflowed child into its siblings. Each rect of the child is
+// moved to whichever sibling with room needs the least enlargement, in the
+// same way as node_reinsert, and then the child is removed. Nothing is moved
+// when the siblings lack the room for all of the rects, or when out of memory,
+// which leaves the child as it is.
+//
+// Returns true if the child was merged.
+static bool node_merge_child(struct rtree *tr, struct node *node, int index) {
+    struct node *child = node->nodes[index];
+    if (rc_load(&child->rc, tr->relaxed) > 0) {
+        // shared with a clone
+        return false;
+    }
+    int maxitems = node_maxitems(child->kind);
+    struct rect rects[MAXITEMS];
+    int counts[MAXITEMS];
+    for (int i = 0; i < node->count; i++) {
+        rects[i] = node_rect(node, i);
+        counts[i] = node->nodes[i]->count;
+    }
+    int dests[MAXITEMS];
+    for (int i = 0; i < child->count; i++) {
+        struct rect rect = node_rect(child, i);
+        int j = -1;
+        NUMTYPE jenlarge = 0;
+        for (int k = 0; k < node->count; k++) {
+            if (k == index || counts[k] == maxitems) {
+                continue;
+            }
+            NUMTYPE enlarge = rect_unioned_area(&rects[k], &rect) -
+                rect_area(&rects[k]);
+            if (j == -1 || enlarge < jenlarge) {
+                j = k;
+                jenlarge = enlarge;
+            }
+        }
+        if (j == -1) {
+            return false;
+        }
+        rect_expand(&rects[j], &rect);
+        counts[j]++;
+        dests[i] = j;
+    }
+    for (int i = 0; i < child->count; i++) {
+        cow_node_or(node->nodes[dests[i]], return false);
+    }
+    // Move the rects starting with the highest index, because each move
+    // fills the hole with the last rect in the child.
+    int n = child->count;
+    for (int i = n-1; i >= 0; i--) {
+        node_move_rect_at_index_into(child, i, node->nodes[dests[i]]);
+    }
+    // The rects of the siblings are calculated from the rects as they are
+    // stored, which may be rounded outwards again.
+    for (int i = 0; i < n; i++) {
+        struct rect rect = node_rect_calc(node->nodes[dests[i]]);
+        node_set_rect(node, dests[i], &rect);
+    }
+    node_free(tr, child);
+    struct rect rect = node_rect(node, node->count-1);
+    node_set_rect(node, index, &rect);
+    node->nodes[index] = node->nodes[node->count-1];
+    node->count--;
+    return true;
+}
+
+// Returns true if the item rect is on the edge of the rect of its node, 
+// which then needs to be calculated again when the item is removed.
+static bool node_onedge(const struct rect *ir, const struct rect *nr) {
+#ifdef USE_QUANTBRANCH
+    // The node rect may have been rounded outwards by any number of 
+    // steps, so it's always calculated again.
+    (void)ir, (void)nr;
+    return true;
+#else
+    bool onedge = rect_onedge(ir, nr);
+#ifdef USE_FLOATBRANCH
+    if (!onedge) {
+        // The node rect may have been rounded outwards.
+        struct rect rect = *ir;
+        rect_round(&rect);
+        onedge = rect_onedge(&rect, nr);
+    }
+#endif
+    return onedge;
+#endif
+}
+
+// Deletes the item. When keep is true, the item is being moved elsewhere, so
+// it's not freed, and only the nodes that are not shared with a clone are
+// searched, as the item was already found in those, see rtree_update.
+static bool node_delete(struct rtree *tr, struct rect *nr, struct node *node, 
+    struct rect *ir, struct item item, bool keep, struct rtree_hint *hint,
+    int depth, bool *removed, bool *shrunk,
+    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
+    void *udata)
+{
+    *removed = false;
+    *shrunk = false;
+    if (node->kind == LEAF) {
+        int i = node_find_item(node, ir, item, compare, udata);
+        if (i == node->count) {
+            return true;
+        }
+        if (keep) {
+            node_take_item(node, i);
+        } else {
+            node_remove_item(tr, node, i);
+        }
+#ifdef USE_QUANTBRANCH
+        // The node rect is rounded out by the parent, so the item may be on
+        // the edge of the leaf without being on the edge of the node rect.
+        bool onedge = true;
+#else
+        bool onedge = node_onedge(ir, nr);
+#endif
+        if (onedge) {
+            // The item rect was on the edge of the node rect.
+            // We need to recalculate the node rect.
+            *nr = node_rect_calc(node);
+            // Notify the caller that we shrunk the rect.
+            *shrunk = true; 
+        }
+        *removed = true;
+        return true;
+    }
+    int h = 0;
+    int tried = -1; // the hinted child, which is not searched again
+    struct rect crect;
+    struct rect rect;
+#ifdef USE_PATHHINT
+    h = hint && depth < HINT_DEPTH ? hint->path[depth] : node->count;
+    if (h < node->count) {
+        crect = node_rect(node, h);
+    }
+    if (h < node->count && rect_contains(&crect, ir) && 
+        !(keep && rc_load(&node->nodes[h]->rc, tr->relaxed) > 0))
+    {
+        rect = crect;
+        cow_node_or(node->nodes[h], return false);
+        if (!node_delete(tr, &rect, node->nodes[h], ir, item, keep, hint,
+            depth+1, removed, shrunk, compare, udata))
+        {
+            return false;
+        }
+        if (*removed) {
+            goto removed;
+        }
+        tried = h;
+    }
+    h = 0;
+#endif
+    for (h = node_contains_next(node, h, ir); h < node->count; 
+        h = node_contains_next(node, h+1, ir))
+    {
+        if (h == tried ||
+            (keep && rc_load(&node->nodes[h]->rc, tr->relaxed) > 0))
+        {
+            continue;
+        }
+        crect = node_rect(node, h);
+        rect = crect;
+        cow_node_or(node->nodes[h], return false);
+        if (!node_delete(tr, &rect, node->nodes[h], ir, item, keep, hint,
+            depth+1, removed, shrunk, compare, udata))
+        {
+            return false;
+        }
+        if (!*removed) {
+            continue;
+        }
+    removed:
+        if (node->nodes[h]->count == 0) {
+            // underflow
+            node_free(tr, node->nodes[h]);
+            rect = node_rect(node, node->count-1);
+            node_set_rect(node, h, &rect);
+            node->nodes[h] = node->nodes[node->count-1];
+            node->count--;
+            *nr = node_rect_calc(node);
+            *shrunk = true;
+            return true;
+        }
+        if (node_underflow(node, h) && node_merge_child(tr, node, h)) {
+            *nr = node_rect_calc(node);
+            *shrunk = true;
+            return true;
+        }
+#ifdef USE_PATHHINT
+        if (hint && depth < HINT_DEPTH) hint->path[depth] = h;
+#endif
+        if (*shrunk) {
+            node_set_rect(node, h, &rect);
+            rect = node_rect(node, h); // as stored, which may be rounded
+            *shrunk = !rect_equals(&rect, &crect);
+            if (*shrunk) {
+                *nr = node_rect_calc(node);
+            }
+        }
+        return true;
+    }
+    return true;
+}
+
+// Deletes the item in concurrent mode. The node is latched by the caller, and
+// it's unlatched before returning. Each child that may hold the item is 
+// latched before the node is unlatched, and the node is only kept while
+// another child may still hold the item, or the child may become empty. The 
+// rects of the nodes above are not shrunk, which leaves them a little larger
+// than needed. With keep, the item is taken out of its leaf without being
+// freed.
+//
+// Returns false if out of memory.
+static bool node_delete_latched(struct rtree *tr, struct node *node, 
+    struct rect *ir, struct item item, bool keep, bool *removed,
+    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
+    void *udata)
+{
+    *removed = false;
+    if (node->kind == LEAF) {
+        int i = node_find_item(node, ir, item, compare, udata);
+        if (i < node->count) {
+            if (keep) {
+                node_take_item(node, i);
+            } else {
+                node_remove_item(tr, node, i);
+            }
+            *removed = true;
+        }
+        lock_release(&node->lock);
+        return true;
+    }
+    bool ok = true;
+    int h = node_contains_next(node, 0, ir);
+    while (h < node->count) {
+        if (!node_latch_cow(tr, &node->nodes[h])) {
+            ok = false;
+            break;
+        }
+        struct node *child = node->nodes[h];
+        int next = node_contains_next(node, h+1, ir);
+        if (next == node->count && child->count > 1) {
+            lock_release(&node->lock);
+            return node_delete_latched(tr, child, ir, item, keep, removed,
+                compare, udata);
+        }
+        if (!node_delete_latched(tr, child, ir, item, keep, removed, compare,
+            udata))
+        {
+            ok = false;
+            break;
+        }
+        if (*removed) {
+            // The child can't be reached by other writers, as the node is 
+            // still latched.
+            if (child->count == 0) {
+                node_free(tr, child);
+                struct rect rect = node_rect(node, node->count-1);
+                node_set_rect(node, h, &rect);
+                node->nodes[h] = node->nodes[node->count-1];
+                node->count--;
+            }
+            break;
+        }
+        h = next;
+    }
+    lock_release(&node->lock);
+    return ok;
+}
+
+// Deletes in concurrent mode. The rtree is kept locked when the root may 
+// become empty, otherwise it's unlocked once the root is latched. With keep,
+// the item is not freed, see node_delete_latched.
+//
+// Returns false if out of memory.
+static bool rtree_delete_latched(struct rtree *tr, struct rect *rect, 
+    struct item item, bool keep, bool *removed,
+    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
+    void *udata)
+{
+    *removed = false;
+    lock_acquire(&tr->lock);
+    if (!tr->root) {
+        lock_release(&tr->lock);
+        return true;
+    }
+    if (!node_latch_cow(tr, &tr->root)) {
+        lock_release(&tr->lock);
+        return false;
+    }
+    bool locked = tr->root->count == 1;
+    struct node *root = tr->root;
+    if (!locked) {
+        lock_release(&tr->lock);
+    }
+    bool ok = node_delete_latched(tr, root, rect, item, keep, removed, compare,
+        udata);
+    if (!locked) {
+        lock_acquire(&tr->lock);
+    }
+    if (*removed) {
+        tr->count--;
+    }
+    if (locked && *removed) {
+        if (tr->count == 0) {
+            node_free(tr, tr->root);
+            tr->root = NULL;
+            memset(&tr->rect, 0, sizeof(struct rect));
+            tr->height = 0;
+        } else {
+            while (tr->root->kind == BRANCH && tr->root->count == 1) {
+                struct node *prev = tr->root;
+                tr->root = tr->root->nodes[0];
+                prev->count = 0;
+                node_free(tr, prev);
+                tr->height--;
             }
         }
-        return true;
-    }
-    for (int i = 0; i < node->count; i++) {
-        if (rect_intersects(&node->rects[i], rect)) {
-            if (!node_search(node->nodes[i], rect, iter, udata)) {
-                return false;
-            }
+    }
+    lock_release(&tr->lock);
+    return ok;
+}
+
+// Called after items were removed. Frees the root when the rtree is empty, 
+// and replaces the root with its child for as long as it only has one.
+static void rtree_condense(struct rtree *tr, size_t removed, bool shrunk) {
+    tr->count -= removed;
+    if (tr->count == 0) {
+        node_free(tr, tr->root);
+        tr->root = NULL;
+        memset(&tr->rect, 0, sizeof(struct rect));
+        tr->height = 0;
+    } else {
+        while (tr->root->kind == BRANCH && tr->root->count == 1) {
+            struct node *prev = tr->root;
+            tr->root = tr->root->nodes[0];
+            prev->count = 0;
+            node_free(tr, prev);
+            tr->height--;
+        }
+        if (shrunk) {
+            tr->rect = node_rect_calc(tr->root);
         }
     }
-    return true;
 }
 
-void rtree_search(const struct rtree *tr, const NUMTYPE min[], 
-    const NUMTYPE max[],
-    bool (*iter)(const NUMTYPE min[], const NUMTYPE max[], const DATATYPE data, 
-        void *udata), 
+// returns false if out of memory
+static bool rtree_delete0(struct rtree *tr, struct rtree_hint *hint,
+    const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
     void *udata)
 {
+#ifdef USE_POINTS
+    assert(coords_ispoint(min, max));
+    max = NULL;
+#endif
     // copy input rect
     struct rect rect;
     memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
     memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
 
-    if (tr->root) {
-        node_search(tr->root, &rect, iter, udata);
-    }
-}
+    // copy input data
+    struct item item;
+    memcpy(&item.data, &data, sizeof(DATATYPE));
 
-static bool node_scan(struct node *node,
-    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
-        void *udata), 
-    void *udata) 
-{
-    if (node->kind == LEAF) {
-        for (int i = 0; i < node->count; i++) {
-            if (!iter(node->rects[i].min, node->rects[i].max, 
-                node->datas[i].data, udata))
-            {
-                return false;
-            }
-        }
+    if (tr->concurrent) {
+        bool removed;
+        return rtree_delete_latched(tr, &rect, item, false, &removed, compare,
+            udata);
+    }
+    if (!tr->root) {
         return true;
     }
-    for (int i = 0; i < node->count; i++) {
-        if (!node_scan(node->nodes[i], iter, udata)) {
-            return false;
-        }
+    bool removed = false;
+    bool shrunk = false;
+    if (!index_prepare(tr, 0)) {
+        return false;
+    }
+    cow_node_or(tr->root, return false);
+#ifdef USE_PATHHINT
+    if (!hint) {
+        hint = &tr->path_hint;
+    }
+#endif
+    if (!node_delete(tr, &tr->rect, tr->root, &rect, item, false, hint, 0, 
+        &removed, &shrunk, compare, udata))
+    {
+        return false;
+    }
+    if (removed) {
+        rtree_condense(tr, 1, shrunk);
     }
     return true;
 }
 
-void rtree_scan(const struct rtree *tr, 
-    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data, 
-        void *udata), 
-    void *udata)
+bool rtree_delete(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, 
+    const DATATYPE data)
 {
-    if (tr->root) {
-        node_scan(tr->root, iter, udata);
-    }
+    return rtree_delete0(tr, NULL, min, max, data, NULL, NULL);
 }
 
-size_t rtree_count(const struct rtree *tr) {
-    return tr->count;
+bool rtree_delete_hinted(struct rtree *tr, struct rtree_hint *hint,
+    const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data)
+{
+    return rtree_delete0(tr, hint, min, max, data, NULL, NULL);
 }
 
-static bool node_delete(struct rtree *tr, struct rect *nr, struct node *node, 
-    struct rect *ir, struct item item, int depth, bool *removed, bool *shrunk,
+bool rtree_delete_with_comparator(struct rtree *tr, const NUMTYPE *min, 
+    const NUMTYPE *max, const DATATYPE data,
     int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
     void *udata)
 {
-    *removed = false;
-    *shrunk = false;
+    return rtree_delete0(tr, NULL, min, max, data, compare, udata);
+}
+
+// returns the number of items below the node
+static size_t node_count_items(const struct node *node) {
     if (node->kind == LEAF) {
-        for (int i = 0; i < node->count; i++) {
-            if (!rect_equals_bin(ir, &node->rects[i])) {
-                // Must be exactly the same, binary comparison.
-                continue;
+        return node->count;
+    }
+    size_t count = 0;
+    for (int i = 0; i < node->count; i++) {
+        count += node_count_items(node->nodes[i]);
+    }
+    return count;
+}
+
+// Deletes every item below the node that intersects the rect and is accepted
+// by the iter. Children that are inside of the rect are freed whole when there
+// is no iter, children that become empty are removed, and children that are
+// left underflowed are merged into their siblings. The node rect is calculated
+// again, once, if any items were deleted.
+//
+// Returns false if out of memory, after fixing up the rects of the items that
+// were deleted before then.
+static bool node_delete_area(struct rtree *tr, struct rect *nr,
+    struct node *node, const struct rect *rect,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        void *udata),
+    void *udata, size_t *deleted)
+{
+    size_t ndeleted = *deleted;
+    bool ok = true;
+    if (node->kind == LEAF) {
+        int i = node_intersects_next(node, 0, rect);
+        while (i < node->count) {
+            struct rect rect2 = node_rect(node, i);
+            if (!iter || iter(rect2.min, rect2.max, node->datas[i].data,
+                udata))
+            {
+                // The last item is moved into the hole, and is checked next.
+                node_remove_item(tr, node, i);
+                (*deleted)++;
+                i = node_intersects_next(node, i, rect);
+            } else {
+                i = node_intersects_next(node, i+1, rect);
             }
-            int cmp = compare ?
-                compare(node->datas[i].data, item.data, udata) :
-                memcmp(&node->datas[i].data, &item.data, sizeof(DATATYPE));
-            if (cmp != 0) {
-                continue;
+        }
+    } else {
+        int h = node_intersects_next(node, 0, rect);
+        while (h < node->count) {
+            struct rect crect = node_rect(node, h);
+            size_t n = *deleted;
+            bool drop = false;
+            if (!iter && rect_contains(rect, &crect)) {
+                *deleted += node_count_items(node->nodes[h]);
+                if (tr->index) {
+                    index_delete_node(tr, node->nodes[h]);
+                }
+                drop = true;
+            } else {
+                cow_node_or(node->nodes[h], ok = false; break);
+                ok = node_delete_area(tr, &crect, node->nodes[h], rect, iter,
+                    udata, deleted);
+                drop = node->nodes[h]->count == 0;
             }
-            // Found the target item to delete.
-            if (tr->item_free) {
-                tr->item_free(node->datas[i].data, tr->udata);
+            if (*deleted > n) {
+                if (drop) {
+                    node_free(tr, node->nodes[h]);
+                    crect = node_rect(node, node->count-1);
+                    node_set_rect(node, h, &crect);
+                    node->nodes[h] = node->nodes[node->count-1];
+                    node->count--;
+                    h--;
+                } else {
+                    node_set_rect(node, h, &crect);
+                }
             }
-            node->rects[i] = node->rects[node->count-1];
-            node->datas[i] = node->datas[node->count-1];
-            node->count--;
-            if (rect_onedge(ir, nr)) {
-                // The item rect was on the edge of the node rect.
-                // We need to recalculate the node rect.
-                *nr = node_rect_calc(node);
-                // Notify the caller that we shrunk the rect.
-                *shrunk = true; 
+            if (!ok) {
+                break;
+            }
+            h = node_intersects_next(node, h+1, rect);
+        }
+        // The children that were left with too few items are merged into
+        // their siblings, after all of them have been visited.
+        for (h = 0; ok && *deleted > ndeleted && h < node->count; h++) {
+            if (node_underflow(node, h) && node_merge_child(tr, node, h)) {
+                h--;
             }
-            *removed = true;
-            return true;
         }
+    }
+    if (*deleted > ndeleted && node->count > 0) {
+        *nr = node_rect_calc(node);
+    }
+    return ok;
+}
+
+bool rtree_delete_area(struct rtree *tr, const NUMTYPE *min,
+    const NUMTYPE *max,
+    bool (*iter)(const NUMTYPE *min, const NUMTYPE *max, const DATATYPE data,
+        void *udata),
+    void *udata)
+{
+    // copy input rect
+    struct rect rect;
+    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+
+    if (!tr->root || !rect_intersects(&tr->rect, &rect)) {
         return true;
     }
-    int h = 0;
-#ifdef USE_PATHHINT
-    h = tr->path_hint[depth];
-    if (h < node->count) {
-        if (rect_contains(&node->rects[h], ir)) {
-            cow_node_or(node->nodes[h], return false);
-            if (!node_delete(tr, &node->rects[h], node->nodes[h], ir, item, 
-                depth+1,removed, shrunk, compare, udata))
-            {
-                return false;
-            }
-            if (*removed) {
-                goto removed;
-            }
+    if (!index_prepare(tr, 0)) {
+        return false;
+    }
+    bool ok = true;
+    size_t deleted = 0;
+    if (!iter && rect_contains(&rect, &tr->rect)) {
+        deleted = tr->count;
+        if (tr->index) {
+            index_delete_node(tr, tr->root);
         }
+    } else {
+        cow_node_or(tr->root, return false);
+        ok = node_delete_area(tr, &tr->rect, tr->root, &rect, iter, udata,
+            &deleted);
     }
-    h = 0;
-#endif
-    for (; h < node->count; h++) {
-        if (!rect_contains(&node->rects[h], ir)) {
-            continue;
+    if (deleted > 0) {
+        rtree_condense(tr, deleted, true);
+    }
+    return ok;
+}
+
+// Updates the rect of the item in place, when the new rect (ir2) is inside of
+// the parent rect (pr) of the leaf that holds the item, or when the leaf is
+// the root. Otherwise the item is left as it is, and moved is set, for the 
+// caller to move it. The rects of the nodes above are changed only as needed.
+// The path to the item is stored in the hint.
+//
+// Returns false if out of memory.
+static bool node_update(struct rtree *tr, struct rect *nr, 
+    const struct rect *pr, struct node *node, struct rect *ir, 
+    struct rect *ir2, struct item item, struct rtree_hint *hint, int depth,
+    bool *found, bool *moved, bool *changed)
+{
+    *found = false;
+    *moved = false;
+    *changed = false;
+    if (node->kind == LEAF) {
+        int i = node_find_item(node, ir, item, NULL, NULL);
+        if (i == node->count) {
+            return true;
+        }
+        *found = true;
+        if (pr && !rect_contains(pr, ir2)) {
+            *moved = true;
+            return true;
+        }
+        node_set_rect(node, i, ir2);
+        if (!rect_contains(nr, ir2) || node_onedge(ir, nr)) {
+            *nr = node_rect_calc(node);
+            *changed = true;
         }
-        struct rect crect = node->rects[h];
+        return true;
+    }
+    for (int h = node_contains_next(node, 0, ir); h < node->count; 
+        h = node_contains_next(node, h+1, ir))
+    {
+        struct rect crect = node_rect(node, h);
+        struct rect rect = crect;
         cow_node_or(node->nodes[h], return false);
-        if (!node_delete(tr, &node->rects[h], node->nodes[h], ir, item, depth+1,
-            removed, shrunk, compare, udata))
+        if (!node_update(tr, &rect, nr, node->nodes[h], ir, ir2, item, hint,
+            depth+1, found, moved, changed))
         {
             return false;
         }
-        if (!*removed) {
+        if (!*found) {
             continue;
         }
-    removed:
-        if (node->nodes[h]->count == 0) {
-            // underflow
-            node_free(tr, node->nodes[h]);
-            node->rects[h] = node->rects[node->count-1];
-            node->nodes[h] = node->nodes[node->count-1];
-            node->count--;
-            *nr = node_rect_calc(node);
-            *shrunk = true;
-            return true;
-        }
-#ifdef USE_PATHHINT
-        tr->path_hint[depth] = h;
-#endif
-        if (*shrunk) {
-            *shrunk = !rect_equals(&node->rects[h], &crect);
-            if (*shrunk) {
+        if (depth < HINT_DEPTH) hint->path[depth] = h;
+        if (*changed) {
+            node_set_rect(node, h, &rect);
+            rect = node_rect(node, h); // as stored, which may be rounded
+            *changed = !rect_equals(&rect, &crect);
+            if (*changed) {
                 *nr = node_rect_calc(node);
             }
         }
@@ -758,68 +5047,133 @@ static bool node_delete(struct rtree *tr, struct rect *nr, struct node *node,
     return true;
 }
 
-// returns false if out of memory
-static bool rtree_delete0(struct rtree *tr, const NUMTYPE *min, 
-    const NUMTYPE *max, const DATATYPE data,
-    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
-    void *udata)
+bool rtree_update(struct rtree *tr, const NUMTYPE *oldmin, 
+    const NUMTYPE *oldmax, const NUMTYPE *newmin, const NUMTYPE *newmax,
+    const DATATYPE data)
 {
-    // copy input rect
+#ifdef USE_POINTS
+    assert(coords_ispoint(oldmin, oldmax));
+    assert(coords_ispoint(newmin, newmax));
+    oldmax = NULL;
+    newmax = NULL;
+#endif
+    // copy input rects
     struct rect rect;
-    memcpy(&rect.min[0], min, sizeof(NUMTYPE)*DIMS);
-    memcpy(&rect.max[0], max?max:min, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.min[0], oldmin, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect.max[0], oldmax?oldmax:oldmin, sizeof(NUMTYPE)*DIMS);
+    struct rect rect2;
+    memcpy(&rect2.min[0], newmin, sizeof(NUMTYPE)*DIMS);
+    memcpy(&rect2.max[0], newmax?newmax:newmin, sizeof(NUMTYPE)*DIMS);
 
     // copy input data
     struct item item;
     memcpy(&item.data, &data, sizeof(DATATYPE));
 
+    if (tr->concurrent) {
+        // The item is taken out of its leaf first, without being freed, so
+        // that nothing is changed when it's not found. When the insert runs
+        // out of memory, it's put back at the old rect. That rarely needs
+        // memory, as its leaf was left with room, and it's retried until it
+        // works, rather than losing the item.
+        bool removed;
+        if (!rtree_delete_latched(tr, &rect, item, true, &removed, NULL, 
+            NULL))
+        {
+            return false;
+        }
+        if (!removed) {
+            return true;
+        }
+        if (rtree_insert_latched(tr, NULL, &rect2, item)) {
+            return true;
+        }
+        while (!rtree_insert_latched(tr, NULL, &rect, item)) {}
+        return false;
+    }
     if (!tr->root) {
         return true;
     }
-    bool removed = false;
-    bool shrunk = false;
+    if (!index_prepare(tr, 0)) {
+        return false;
+    }
+    struct rtree_hint path = { 0 };
+    bool found = false;
+    bool moved = false;
+    bool changed = false;
     cow_node_or(tr->root, return false);
-    if (!node_delete(tr, &tr->rect, tr->root, &rect, item, 0, &removed, &shrunk, 
-        compare, udata))
+    if (!node_update(tr, &tr->rect, NULL, tr->root, &rect, &rect2, item,
+        &path, 0, &found, &moved, &changed))
     {
         return false;
     }
-    if (!removed) {
+    if (!found) {
         return true;
     }
-    tr->count--;
-    if (tr->count == 0) {
-        node_free(tr, tr->root);
-        tr->root = NULL;
-        memset(&tr->rect, 0, sizeof(struct rect));
-        tr->height = 0;
-    } else {
-        while (tr->root->kind == BRANCH && tr->root->count == 1) {
-            struct node *prev = tr->root;
-            tr->root = tr->root->nodes[0];
-            prev->count = 0;
-            node_free(tr, prev);
-            tr->height--;
-        }
-        if (shrunk) {
-            tr->rect = node_rect_calc(tr->root);
+    if (!moved) {
+#ifdef USE_QUANTBRANCH
+        // The rect of the rtree is only kept around the items, rather than
+        // the rounded rects of the nodes, so it may not have changed above.
+        rect_expand(&tr->rect, &rect2);
+#endif
+        if (tr->index) {
+            index_set(tr, item, &rect2);
         }
+        return true;
+    }
+    // The item is inserted again from the root, and then it's removed from 
+    // its leaf, without being cloned or freed. The nodes on the way to the 
+    // leaf are no longer shared, so removing it never runs out of memory.
+    struct rtree_hint *hint = NULL;
+#ifdef USE_PATHHINT
+    hint = &tr->path_hint;
+#endif
+    size_t height = tr->height;
+    if (!rtree_insert0(tr, hint, &rect2, item)) {
+        return false;
+    }
+    if (tr->index) {
+        index_set(tr, item, &rect2);
+    }
+    // The path is tried first, which is still correct unless a node on the 
+    // way was split by the insert. When the root was split the path is one
+    // level off, so it's not used at all.
+    bool removed = false;
+    bool shrunk = false;
+    node_delete(tr, &tr->rect, tr->root, &rect, item, true, 
+        tr->height == height ? &path : NULL, 0, &removed, &shrunk, NULL, NULL);
+    if (removed) {
+        rtree_condense(tr, 1, shrunk);
     }
     return true;
 }
 
-bool rtree_delete(struct rtree *tr, const NUMTYPE *min, const NUMTYPE *max, 
-    const DATATYPE data)
-{
-    return rtree_delete0(tr, min, max, data, NULL, NULL);
+bool rtree_delete_indexed(struct rtree *tr, const DATATYPE data) {
+    struct item item;
+    memcpy(&item.data, &data, sizeof(DATATYPE));
+    const struct index_entry *entry = index_get(tr, item);
+    if (!entry) {
+        return true;
+    }
+    // The entry is copied, as the index may be copied or changed.
+    struct rect rect = entry->rect;
+    item = entry->item;
+    return rtree_delete0(tr, NULL, &rect.min[0], &rect.max[0], item.data,
+        NULL, NULL);
 }
 
-bool rtree_delete_with_comparator(struct rtree *tr, const NUMTYPE *min, 
-    const NUMTYPE *max, const DATATYPE data,
-    int (*compare)(const DATATYPE a, const DATATYPE b, void *udata),
-    void *udata)
+bool rtree_update_indexed(struct rtree *tr, const NUMTYPE *min, 
+    const NUMTYPE *max, const DATATYPE data)
 {
-    return rtree_delete0(tr, min, max, data, compare, udata);
+    struct item item;
+    memcpy(&item.data, &data, sizeof(DATATYPE));
+    const struct index_entry *entry = index_get(tr, item);
+    if (!entry) {
+        return true;
+    }
+    // The entry is copied, as the index may be copied or changed.
+    struct rect rect = entry->rect;
+    item = entry->item;
+    return rtree_update(tr, &rect.min[0], &rect.max[0], min, max, item.data);
 }
 
 struct rtree *rtree_clone(struct rtree *tr) {
@@ -828,13 +5182,158 @@ struct rtree *rtree_clone(struct rtree *tr) {
     if (!tr2) return NULL;
     memcpy(tr2, tr, sizeof(struct rtree));
     if (tr2->root) rc_fetch_add(&tr2->root->rc, 1);
+    if (tr2->slab) rc_fetch_add(&tr2->slab->rc, 1);
+    if (tr2->index) rc_fetch_add(&tr2->index->rc, 1);
     return tr2;
 } 
 
+// A published snapshot, which is a copy-on-write clone of the writer rtree
+// that is kept in the same allocation as its reference counter.
+struct shared_snap {
+    rc_t rc;            // readers that hold the snapshot, plus the handle
+    struct rtree tr;
+};
+
+struct rtree_shared {
+    ptr_t snap;         // the latest published snapshot
+    rc_t epoch;         // incremented by each publish
+    rc_t readers[2];    // readers that are taking a snapshot, by epoch
+    struct rtree *writer;
+};
+
+static struct shared_snap *shared_snap_new(struct rtree *tr) {
+    struct shared_snap *snap = tr->malloc(sizeof(struct shared_snap));
+    if (!snap) return NULL;
+    memset(snap, 0, sizeof(struct shared_snap));
+    memcpy(&snap->tr, tr, sizeof(struct rtree));
+    if (snap->tr.root) rc_fetch_add(&snap->tr.root->rc, 1);
+    if (snap->tr.slab) rc_fetch_add(&snap->tr.slab->rc, 1);
+    if (snap->tr.index) rc_fetch_add(&snap->tr.index->rc, 1);
+    return snap;
+}
+
+static void shared_snap_release(struct shared_snap *snap) {
+    if (rc_fetch_sub(&snap->rc, 1) > 0) return;
+    rtree_release(&snap->tr);
+    snap->tr.free(snap);
+}
+
+struct rtree_shared *rtree_shared_new(struct rtree *tr) {
+    struct rtree_shared *sh = tr->malloc(sizeof(struct rtree_shared));
+    if (!sh) return NULL;
+    memset(sh, 0, sizeof(struct rtree_shared));
+    struct shared_snap *snap = shared_snap_new(tr);
+    if (!snap) {
+        tr->free(sh);
+        return NULL;
+    }
+    ptr_store(&sh->snap, snap);
+    sh->writer = tr;
+    return sh;
+}
+
+void rtree_shared_free(struct rtree_shared *sh) {
+    struct rtree *tr = sh->writer;
+    shared_snap_release(ptr_load(&sh->snap));
+    tr->free(sh);
+    rtree_free(tr);
+}
+
+struct rtree *rtree_shared_writer(struct rtree_shared *sh) {
+    return sh->writer;
+}
+
+bool rtree_shared_publish(struct rtree_shared *sh) {
+    struct shared_snap *snap = shared_snap_new(sh->writer);
+    if (!snap) return false;
+    struct shared_snap *prev = ptr_load(&sh->snap);
+    ptr_store(&sh->snap, snap);
+    // Readers that entered the previous epoch may have loaded prev without
+    // holding it yet. Readers that enter the new epoch will only see snap.
+    // Once the previous epoch is empty, prev is released by the last reader
+    // that holds it, which may be this one.
+    int epoch = rc_fetch_add(&sh->epoch, 1);
+    while (rc_load(&sh->readers[epoch&1], false) > 0) {}
+    shared_snap_release(prev);
+    return true;
+}
+
+const struct rtree *rtree_shared_acquire(struct rtree_shared *sh) {
+    // Enter the current epoch, trying again if a publish started a new one
+    // in the meantime, as the writer may no longer be waiting on this one.
+    int epoch;
+    while (1) {
+        epoch = rc_load(&sh->epoch, false);
+        rc_fetch_add(&sh->readers[epoch&1], 1);
+        if (rc_load(&sh->epoch, false) == epoch) break;
+        rc_fetch_sub(&sh->readers[epoch&1], 1);
+    }
+    struct shared_snap *snap = ptr_load(&sh->snap);
+    rc_fetch_add(&snap->rc, 1);
+    rc_fetch_sub(&sh->readers[epoch&1], 1);
+    return &snap->tr;
+}
+
+void rtree_shared_release(struct rtree_shared *sh, const struct rtree *tr) {
+    (void)sh;
+    shared_snap_release((struct shared_snap *)((char *)tr - 
+        offsetof(struct shared_snap, tr)));
+}
+
 void rtree_opt_relaxed_atomics(struct rtree *tr) {
     tr->relaxed = true;
 }
 
+void rtree_opt_rstar(struct rtree *tr) {
+    tr->rstar = true;
+}
+
+bool rtree_opt_concurrent(struct rtree *tr) {
+    if (tr->index) return false;
+    tr->concurrent = true;
+    return true;
+}
+
+bool rtree_opt_slab_allocator(struct rtree *tr) {
+    if (tr->slab) return true;
+    if (tr->root) return false;
+    struct slab *slab = (struct slab *)tr->malloc(sizeof(struct slab));
+    if (!slab) return false;
+    memset(slab, 0, sizeof(struct slab));
+    slab->malloc = tr->malloc;
+    slab->free = tr->free;
+    tr->slab = slab;
+    return true;
+}
+
+bool rtree_opt_index(struct rtree *tr, 
+    uint64_t (*hash)(const DATATYPE data, void *udata),
+    bool (*equal)(const DATATYPE a, const DATATYPE b, void *udata))
+{
+    if (tr->index) return true;
+    if (tr->concurrent) return false;
+    struct index *index = (struct index *)tr->malloc(sizeof(struct index));
+    if (!index) return false;
+    memset(index, 0, sizeof(struct index));
+    index->hash = hash;
+    index->equal = equal;
+    tr->index = index;
+    if (!index_prepare(tr, tr->count)) {
+        tr->index = NULL;
+        tr->free(index);
+        return false;
+    }
+    if (tr->root) {
+        index_add_node(tr, tr->root);
+    }
+    return true;
+}
+
 #ifdef TEST_PRIVATE_FUNCTIONS
+#ifdef RTREE_PREFIX
+#define rtree_check RTREE_CAT(RTREE_PREFIX, _check)
+#define rtree_write_svg RTREE_CAT(RTREE_PREFIX, _write_svg)
+#define rtree_node_sizes RTREE_CAT(RTREE_PREFIX, _node_sizes)
+#endif
 #include "tests/priv_funcs.h"
 #endif
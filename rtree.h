@@ -2,11 +2,89 @@
 // Use of this source code is governed by an MIT-style
 // license that can be found in the LICENSE file.
 
-#ifndef RTREE_H
+#if !defined(RTREE_H) || defined(RTREE_PREFIX)
+#ifndef RTREE_PREFIX
 #define RTREE_H
+#endif
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+// The coordinate and item types, which must match the build of rtree.c.
+// Optionally, define RTREE_NUMTYPE and RTREE_DATATYPE to change them.
+#ifdef RTREE_NUMTYPE
+#define RTREE_NUM RTREE_NUMTYPE
+#else
+#define RTREE_NUM double
+#endif
+#ifdef RTREE_DATATYPE
+#define RTREE_DATA RTREE_DATATYPE
+#else
+#define RTREE_DATA void *
+#endif
+
+// Optionally, define RTREE_PREFIX to use a different prefix for all of the
+// symbols, such as rtree3d_new() and struct rtree3d. This allows for multiple
+// specializations in one program. This file may be included once for each
+// specialization, and the settings are undefined at the end of it.
+#ifdef RTREE_PREFIX
+#define RTREE_CAT0(a, b) a##b
+#define RTREE_CAT(a, b) RTREE_CAT0(a, b)
+#define rtree RTREE_PREFIX
+#define rtree_iter RTREE_CAT(RTREE_PREFIX, _iter)
+#define rtree_packed RTREE_CAT(RTREE_PREFIX, _packed)
+#define rtree_new RTREE_CAT(RTREE_PREFIX, _new)
+#define rtree_new_with_allocator RTREE_CAT(RTREE_PREFIX, _new_with_allocator)
+#define rtree_free RTREE_CAT(RTREE_PREFIX, _free)
+#define rtree_clone RTREE_CAT(RTREE_PREFIX, _clone)
+#define rtree_shared RTREE_CAT(RTREE_PREFIX, _shared)
+#define rtree_shared_new RTREE_CAT(RTREE_PREFIX, _shared_new)
+#define rtree_shared_free RTREE_CAT(RTREE_PREFIX, _shared_free)
+#define rtree_shared_writer RTREE_CAT(RTREE_PREFIX, _shared_writer)
+#define rtree_shared_publish RTREE_CAT(RTREE_PREFIX, _shared_publish)
+#define rtree_shared_acquire RTREE_CAT(RTREE_PREFIX, _shared_acquire)
+#define rtree_shared_release RTREE_CAT(RTREE_PREFIX, _shared_release)
+#define rtree_set_item_callbacks RTREE_CAT(RTREE_PREFIX, _set_item_callbacks)
+#define rtree_set_udata RTREE_CAT(RTREE_PREFIX, _set_udata)
+#define rtree_insert RTREE_CAT(RTREE_PREFIX, _insert)
+#define rtree_insert_hinted RTREE_CAT(RTREE_PREFIX, _insert_hinted)
+#define rtree_hint RTREE_CAT(RTREE_PREFIX, _hint)
+#define rtree_load RTREE_CAT(RTREE_PREFIX, _load)
+#define rtree_compact RTREE_CAT(RTREE_PREFIX, _compact)
+#define rtree_save RTREE_CAT(RTREE_PREFIX, _save)
+#define rtree_restore RTREE_CAT(RTREE_PREFIX, _restore)
+#define rtree_pack RTREE_CAT(RTREE_PREFIX, _pack)
+#define rtree_packed_open RTREE_CAT(RTREE_PREFIX, _packed_open)
+#define rtree_packed_search RTREE_CAT(RTREE_PREFIX, _packed_search)
+#define rtree_packed_scan RTREE_CAT(RTREE_PREFIX, _packed_scan)
+#define rtree_packed_count RTREE_CAT(RTREE_PREFIX, _packed_count)
+#define rtree_search RTREE_CAT(RTREE_PREFIX, _search)
+#define rtree_search_batch RTREE_CAT(RTREE_PREFIX, _search_batch)
+#define rtree_search_parallel RTREE_CAT(RTREE_PREFIX, _search_parallel)
+#define rtree_scan RTREE_CAT(RTREE_PREFIX, _scan)
+#define rtree_join RTREE_CAT(RTREE_PREFIX, _join)
+#define rtree_self_join RTREE_CAT(RTREE_PREFIX, _self_join)
+#define rtree_self_join_parallel RTREE_CAT(RTREE_PREFIX, _self_join_parallel)
+#define rtree_iter_init RTREE_CAT(RTREE_PREFIX, _iter_init)
+#define rtree_iter_next RTREE_CAT(RTREE_PREFIX, _iter_next)
+#define rtree_iter_free RTREE_CAT(RTREE_PREFIX, _iter_free)
+#define rtree_nearby RTREE_CAT(RTREE_PREFIX, _nearby)
+#define rtree_knn RTREE_CAT(RTREE_PREFIX, _knn)
+#define rtree_count RTREE_CAT(RTREE_PREFIX, _count)
+#define rtree_delete RTREE_CAT(RTREE_PREFIX, _delete)
+#define rtree_delete_with_comparator RTREE_CAT(RTREE_PREFIX, _delete_with_comparator)
+#define rtree_delete_hinted RTREE_CAT(RTREE_PREFIX, _delete_hinted)
+#define rtree_delete_area RTREE_CAT(RTREE_PREFIX, _delete_area)
+#define rtree_update RTREE_CAT(RTREE_PREFIX, _update)
+#define rtree_delete_indexed RTREE_CAT(RTREE_PREFIX, _delete_indexed)
+#define rtree_update_indexed RTREE_CAT(RTREE_PREFIX, _update_indexed)
+#define rtree_opt_relaxed_atomics RTREE_CAT(RTREE_PREFIX, _opt_relaxed_atomics)
+#define rtree_opt_rstar RTREE_CAT(RTREE_PREFIX, _opt_rstar)
+#define rtree_opt_concurrent RTREE_CAT(RTREE_PREFIX, _opt_concurrent)
+#define rtree_opt_slab_allocator RTREE_CAT(RTREE_PREFIX, _opt_slab_allocator)
+#define rtree_opt_index RTREE_CAT(RTREE_PREFIX, _opt_index)
+#endif
 
 // rtree_new returns a new rtree
 //
@@ -27,6 +105,42 @@ void rtree_free(struct rtree *tr);
 // This operation uses shadowing / copy-on-write.
 struct rtree *rtree_clone(struct rtree *tr);
 
+// rtree_shared_new returns a handle for sharing the rtree between a single
+// writer thread and many reader threads. The handle takes ownership of the
+// rtree, which becomes the writer rtree, and publishes a snapshot of it.
+// Sharing between threads requires atomics, see RTREE_NOATOMICS.
+//
+// Returns NULL if the system is out of memory, and the rtree is not owned by
+// the handle.
+struct rtree_shared *rtree_shared_new(struct rtree *tr);
+
+// rtree_shared_free frees the handle, its writer rtree, and the latest
+// snapshot, unless readers still hold it. Snapshots that are still held are
+// freed by rtree_shared_release.
+void rtree_shared_free(struct rtree_shared *sh);
+
+// rtree_shared_writer returns the writer rtree, which may be changed by the
+// writer thread using the usual functions. Readers do not see the changes
+// until they are published.
+struct rtree *rtree_shared_writer(struct rtree_shared *sh);
+
+// rtree_shared_publish makes the current state of the writer rtree the latest
+// snapshot. This operation uses copy-on-write, and waits only for readers
+// that are in the middle of rtree_shared_acquire. The previous snapshot is
+// freed once no reader holds it.
+//
+// Returns false if the system is out of memory.
+bool rtree_shared_publish(struct rtree_shared *sh);
+
+// rtree_shared_acquire returns the latest snapshot, without locking, which
+// may be searched by the calling thread until it's released. A snapshot
+// never changes, so it must not be modified.
+const struct rtree *rtree_shared_acquire(struct rtree_shared *sh);
+
+// rtree_shared_release releases a snapshot that was returned by
+// rtree_shared_acquire.
+void rtree_shared_release(struct rtree_shared *sh, const struct rtree *tr);
+
 // rtree_set_item_callbacks sets the item clone and free callbacks that will be
 // called internally by the rtree when items are inserted and removed.
 //
@@ -36,8 +150,8 @@ struct rtree *rtree_clone(struct rtree *tr);
 // The clone function should return true if the clone succeeded or false if the
 // system is out of memory.
 void rtree_set_item_callbacks(struct rtree *tr,
-    bool (*clone)(const void *item, void **into, void *udata), 
-    void (*free)(const void *item, void *udata));
+    bool (*clone)(const RTREE_DATA item, RTREE_DATA *into, void *udata), 
+    void (*free)(const RTREE_DATA item, void *udata));
 
 // rtree_set_udata sets the user-defined data. 
 //
@@ -53,25 +167,275 @@ void rtree_set_udata(struct rtree *tr, void *udata);
 // N values as the maximum corner of the rect, where N is the number of
 // dimensions.
 //
-// When inserting points, the max coordinates is optional (set to NULL).
+// When inserting points, the max coordinates is optional (set to NULL). When
+// built with RTREE_POINTS, the max coordinates must be NULL or the same as the
+// min coordinates, for this and the other functions that change the rtree,
+// which is asserted. Otherwise only the min coordinates are used.
+//
+// Returns false if the system is out of memory.
+bool rtree_insert(struct rtree *tr, const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data);
+
+// rtree_hint is a path hint that is owned by the caller, such as one for each
+// stream of inserts with its own locality. It holds the child that was chosen
+// at each level of the last insert or delete that used it, which is tried
+// first by the next one. It must be zeroed before its first use, and may be
+// used with any rtree of the same kind, as a stale hint is only slower.
+struct rtree_hint {
+    int path[32];
+};
+
+// rtree_insert_hinted inserts an item into the rtree, using the hint rather
+// than the path hint of the rtree, which is shared by all callers. In 
+// concurrent mode, see rtree_opt_concurrent, each thread may use its own 
+// hint. The hint is optional (set to NULL).
 //
 // Returns false if the system is out of memory.
-bool rtree_insert(struct rtree *tr, const double *min, const double *max, const void *data);
+bool rtree_insert_hinted(struct rtree *tr, struct rtree_hint *hint, const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data);
+
+// rtree_load bulk loads many items into the rtree at once.
+//
+// The mins and maxs arrays each contain count*N doubles, where N is the
+// number of dimensions. The maxs array is optional (set to NULL) when loading
+// points. The datas array contains count items.
+//
+// When the rtree is empty, the items are packed bottom-up into full nodes
+// using the Sort-Tile-Recursive algorithm, which is much faster than
+// inserting one item at a time and produces tighter nodes. Otherwise the
+// items are inserted one at a time.
+//
+// Returns false if the system is out of memory.
+bool rtree_load(struct rtree *tr, const RTREE_NUM *mins, const RTREE_NUM *maxs, 
+    RTREE_DATA const *datas, size_t count);
+
+// rtree_compact repacks all of the items in the rtree into full nodes, using
+// the same Sort-Tile-Recursive algorithm as rtree_load. This restores the
+// search speed of an rtree that has become sparse after many deletes. The
+// items are moved to the new nodes without being cloned, except for the items
+// in nodes that are shared with clones, see rtree_clone.
+//
+// Returns false if the system is out of memory, leaving the rtree unchanged.
+bool rtree_compact(struct rtree *tr);
+
+
+// rtree_save writes the rtree to a stream in a compact binary format, which
+// can be read back using rtree_restore.
+//
+// The write function is called many times with chunks of the data, and should
+// return false if the data could not be written. The item_write function is
+// optional (set to NULL) and should write the data for a single item, such as
+// by calling the same stream. When item_write is NULL, the raw bytes of each
+// item are written, which is only useful for items that are not pointers.
+//
+// Returns false if the write or item_write function failed.
+bool rtree_save(const struct rtree *tr,
+    bool (*write)(const void *data, size_t size, void *udata),
+    bool (*item_write)(const RTREE_DATA item, void *udata),
+    void *udata);
+
+// rtree_restore reads an rtree that was written by rtree_save into an empty
+// rtree. The nodes are rebuilt directly, without reinserting any items.
+//
+// The read function should fill the data with exactly size bytes, or return
+// false if it cannot. The item_read function should read the data for a
+// single item that was written by item_write, and must be set when
+// rtree_save used an item_write function. The restored items are owned by
+// the rtree, as if they had been cloned.
+//
+// Returns false if the rtree is not empty, the system is out of memory, the
+// read or item_read function failed, or the data is not valid.
+bool rtree_restore(struct rtree *tr,
+    bool (*read)(void *data, size_t size, void *udata),
+    bool (*item_read)(RTREE_DATA *item, void *udata),
+    void *udata);
+
+// rtree_pack writes the rtree to a stream as a packed image, which is a
+// read-only rtree that can be searched in place using rtree_packed_search.
+// The image may be stored in a file and memory-mapped by many processes.
+//
+// The raw bytes of each item are written, which is only useful for items that
+// are not pointers, such as ids.
+//
+// Returns false if the write function failed.
+bool rtree_pack(const struct rtree *tr,
+    bool (*write)(const void *data, size_t size, void *udata),
+    void *udata);
 
+// rtree_packed_open returns a packed image that was written by rtree_pack,
+// without copying any data. The data must be aligned to 8 bytes, such as the
+// start of a memory-mapped file, and must remain valid while the image is in
+// use. There is nothing to free.
+//
+// Only the header is checked, which makes this operation instant. Any nodes
+// that turn out to be corrupt are skipped while searching.
+//
+// Returns NULL if the data is not a valid packed image.
+const struct rtree_packed *rtree_packed_open(const void *data, size_t size);
+
+// rtree_packed_search searches a packed image and iterates over each item
+// that intersect the provided rectangle.
+//
+// Returning false from the iter will stop the search.
+void rtree_packed_search(const struct rtree_packed *pk, const RTREE_NUM *min,
+    const RTREE_NUM *max,
+    bool (*iter)(const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data, void *udata), 
+    void *udata);
+
+// rtree_packed_scan iterates over every item in a packed image.
+//
+// Returning false from the iter will stop the scan.
+void rtree_packed_scan(const struct rtree_packed *pk,
+    bool (*iter)(const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data, void *udata), 
+    void *udata);
+
+// rtree_packed_count returns the number of items in a packed image.
+size_t rtree_packed_count(const struct rtree_packed *pk);
 
 // rtree_search searches the rtree and iterates over each item that intersect
 // the provided rectangle.
 //
 // Returning false from the iter will stop the search.
-void rtree_search(const struct rtree *tr, const double *min, const double *max,
-    bool (*iter)(const double *min, const double *max, const void *data, void *udata), 
+void rtree_search(const struct rtree *tr, const RTREE_NUM *min, const RTREE_NUM *max,
+    bool (*iter)(const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data, void *udata), 
+    void *udata);
+
+// rtree_search_batch searches the rtree using many rectangles at once and
+// iterates over each item that intersects any of them. The index param of
+// the iter is the position of the matching rectangle in the batch.
+//
+// The mins and maxs arrays each contain count*N doubles, where N is the
+// number of dimensions. The maxs array is optional (set to NULL) when
+// searching for points.
+//
+// Each node is visited once for all of the rectangles in the batch that
+// intersect it, which is faster than calling rtree_search for each one.
+// The order of the items is not defined.
+//
+// Returning false from the iter will stop the search.
+void rtree_search_batch(const struct rtree *tr, const RTREE_NUM *mins,
+    const RTREE_NUM *maxs, size_t count,
+    bool (*iter)(const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data,
+        size_t index, void *udata),
+    void *udata);
+
+// rtree_search_parallel searches the rtree using multiple threads and iterates
+// over each item that intersect the provided rectangle.
+//
+// The matching subtrees are shared among nthreads threads, including the
+// calling thread. When nthreads is zero, the number of online CPUs is used.
+// The iter is called concurrently from different threads, where the thread
+// param is a number from zero to nthreads-1 that can be used for storing
+// results in per-thread buffers. The function returns after all threads are
+// done.
+//
+// Returning false from the iter will stop the search, though other threads
+// may still deliver a few more items.
+//
+// Optionally, define RTREE_NOTHREADS to always search on the calling thread.
+void rtree_search_parallel(const struct rtree *tr, const RTREE_NUM *min,
+    const RTREE_NUM *max, int nthreads,
+    bool (*iter)(const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data,
+        int thread, void *udata),
     void *udata);
 
 // rtree_scan iterates over every item in the rtree.
 //
 // Returning false from the iter will stop the scan.
 void rtree_scan(const struct rtree *tr,
-    bool (*iter)(const double *min, const double *max, const void *data, void *udata), 
+    bool (*iter)(const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data, void *udata), 
+    void *udata);
+
+// rtree_join iterates over every pair of items, one from each rtree, whose
+// rectangles intersect. Both rtrees are descended together, and only the
+// nodes that intersect each other are visited, which is much faster than
+// searching one rtree for each item of the other.
+//
+// Returning false from the iter will stop the join.
+void rtree_join(const struct rtree *tr1, const struct rtree *tr2,
+    bool (*iter)(const RTREE_NUM *min1, const RTREE_NUM *max1, const RTREE_DATA data1,
+        const RTREE_NUM *min2, const RTREE_NUM *max2, const RTREE_DATA data2,
+        void *udata),
+    void *udata);
+
+// rtree_self_join iterates over every pair of items in the rtree whose 
+// rectangles intersect, such as for finding collisions or duplicates. Each 
+// pair is passed once, in either order, and an item is not paired with
+// itself.
+//
+// Returning false from the iter will stop the join.
+void rtree_self_join(const struct rtree *tr,
+    bool (*iter)(const RTREE_NUM *min1, const RTREE_NUM *max1, const RTREE_DATA data1,
+        const RTREE_NUM *min2, const RTREE_NUM *max2, const RTREE_DATA data2,
+        void *udata),
+    void *udata);
+
+// rtree_self_join_parallel is rtree_self_join using multiple threads, in the
+// same way as rtree_search_parallel. When nthreads is zero, the number of
+// online CPUs is used. The iter is called concurrently from different
+// threads, where the thread param is a number from zero to nthreads-1.
+//
+// Returning false from the iter will stop the join, though other threads may
+// still deliver a few more pairs.
+//
+// Optionally, define RTREE_NOTHREADS to always join on the calling thread.
+void rtree_self_join_parallel(const struct rtree *tr, int nthreads,
+    bool (*iter)(const RTREE_NUM *min1, const RTREE_NUM *max1, const RTREE_DATA data1,
+        const RTREE_NUM *min2, const RTREE_NUM *max2, const RTREE_DATA data2,
+        int thread, void *udata),
+    void *udata);
+
+// rtree_iter_init returns a new iterator over each item that intersects the
+// provided rectangle. When min is NULL, the iterator will produce every item
+// in the rtree.
+//
+// The iterator operates on a copy-on-write snapshot of the rtree, which means
+// that the rtree may be modified or freed while the iterator is in use.
+//
+// Returns NULL if the system is out of memory.
+struct rtree_iter *rtree_iter_init(struct rtree *tr, const RTREE_NUM *min,
+    const RTREE_NUM *max);
+
+// rtree_iter_next moves the iterator to the next item. The rect and data of the
+// item are placed into min, max, and data, each of which is optional (set to
+// NULL). The min and max pointers are valid until the next call to
+// rtree_iter_next or rtree_iter_free.
+//
+// Returns false when there are no more items.
+bool rtree_iter_next(struct rtree_iter *iter, const RTREE_NUM **min,
+    const RTREE_NUM **max, const RTREE_DATA *data);
+
+// rtree_iter_free frees an iterator.
+void rtree_iter_free(struct rtree_iter *iter);
+
+// rtree_nearby iterates over the items in the rtree in order of distance,
+// closest first, as determined by the provided dist function.
+//
+// The dist function is called for both items and branch rectangles. When the
+// item param is false the data param is unused and the function must return
+// the smallest distance that any item contained by the rectangle could have.
+// This allows for custom metrics, such as geodesic distances.
+//
+// Returning false from the iter will stop the search.
+//
+// Returns false if the system is out of memory.
+bool rtree_nearby(const struct rtree *tr,
+    double (*dist)(const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data,
+        bool item, void *udata),
+    bool (*iter)(const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data,
+        double dist, void *udata),
+    void *udata);
+
+// rtree_knn iterates over the k nearest items to the provided rectangle, in
+// order of Euclidean distance, closest first.
+//
+// When searching for a point, the max coordinates is optional (set to NULL).
+//
+// Returning false from the iter will stop the search.
+//
+// Returns false if the system is out of memory.
+bool rtree_knn(const struct rtree *tr, const RTREE_NUM *min, const RTREE_NUM *max,
+    size_t k,
+    bool (*iter)(const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data,
+        double dist, void *udata),
     void *udata);
 
 // rtree_count returns the number of items in the rtree.
@@ -84,7 +448,7 @@ size_t rtree_count(const struct rtree *tr);
 // data. The first item that is found is deleted.
 //
 // Returns false if the system is out of memory.
-bool rtree_delete(struct rtree *tr, const double *min, const double *max, const void *data);
+bool rtree_delete(struct rtree *tr, const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data);
 
 // rtree_delete_with_comparator deletes an item from the rtree.
 // This searches the tree for an item that is contained within the provided
@@ -92,14 +456,200 @@ bool rtree_delete(struct rtree *tr, const double *min, const double *max, const
 // a compare function. The first item that is found is deleted.
 //
 // Returns false if the system is out of memory.
-bool rtree_delete_with_comparator(struct rtree *tr, const double *min, 
-    const double *max, const void *data,
-    int (*compare)(const void *a, const void *b, void *udata),
+bool rtree_delete_with_comparator(struct rtree *tr, const RTREE_NUM *min, 
+    const RTREE_NUM *max, const RTREE_DATA data,
+    int (*compare)(const RTREE_DATA a, const RTREE_DATA b, void *udata),
+    void *udata);
+
+// rtree_delete_hinted deletes an item from the rtree, as with rtree_delete,
+// using the hint rather than the path hint of the rtree, see
+// rtree_insert_hinted. The hint is not used in concurrent mode.
+//
+// Returns false if the system is out of memory.
+bool rtree_delete_hinted(struct rtree *tr, struct rtree_hint *hint, const RTREE_NUM *min, const RTREE_NUM *max, const RTREE_DATA data);
+
+// rtree_delete_area deletes every item that intersects the provided rectangle
+// and is accepted by the iter, which returns true to delete the item. All of
+// the items are deleted in a single traversal of the tree. When the iter is 
+// NULL, every item that intersects the rectangle is deleted, and the nodes
+// that are inside of the rectangle are freed without visiting their items.
+// The iter must not change the rtree.
+//
+// Returns false if the system is out of memory, in which case only some of
+// the items may have been deleted.
+bool rtree_delete_area(struct rtree *tr, const RTREE_NUM *min,
+    const RTREE_NUM *max,
+    bool (*iter)(const RTREE_NUM *min, const RTREE_NUM *max, 
+        const RTREE_DATA data, void *udata),
     void *udata);
 
+// rtree_update moves an item from its old rectangle to a new rectangle. The
+// item is found using its old rectangle and data, like with rtree_delete.
+// When the new rectangle is inside of the parent of the leaf that holds the
+// item, the item is updated in place, and only the rects of the nodes above
+// it are changed. Otherwise it's inserted again from the root and removed from
+// its old leaf, without being cloned or freed. Nothing is changed when the 
+// item is not found.
+//
+// In concurrent mode, see rtree_opt_concurrent, the item is taken out of its
+// leaf first, and then inserted at the new rectangle, or put back at the old
+// rectangle when the system is out of memory.
+//
+// Returns false if the system is out of memory, in which case the rtree is
+// unchanged.
+bool rtree_update(struct rtree *tr, const RTREE_NUM *oldmin,
+    const RTREE_NUM *oldmax, const RTREE_NUM *newmin, const RTREE_NUM *newmax,
+    const RTREE_DATA data);
+
+// rtree_delete_indexed deletes the item with the data, which is looked up
+// in the index to find its rectangle, see rtree_opt_index. Nothing is deleted
+// when the index is not active, or has no item with the data.
+//
+// Returns false if the system is out of memory.
+bool rtree_delete_indexed(struct rtree *tr, const RTREE_DATA data);
+
+// rtree_update_indexed moves the item with the data to a new rectangle, like
+// rtree_update, using the index to find its old rectangle, see
+// rtree_opt_index. Nothing is changed when the index is not active, or has no
+// item with the data.
+//
+// Returns false if the system is out of memory, in which case the rtree is
+// unchanged.
+bool rtree_update_indexed(struct rtree *tr, const RTREE_NUM *min,
+    const RTREE_NUM *max, const RTREE_DATA data);
+
 // rtree_opt_relaxed_atomics activates memory_order_relaxed for all atomic
 // loads. This may increase performance for single-threaded programs.
 // Optionally, define RTREE_NOATOMICS to disbale all atomics.
 void rtree_opt_relaxed_atomics(struct rtree *tr);
 
+// rtree_opt_rstar activates the R*-tree insertion strategy. Full nodes are
+// split along the axis and at the position that produces the least overlap,
+// and some of the items in a full leaf may be reinserted into its siblings
+// before splitting. Inserts become slower, but the nodes overlap less, which
+// speeds up searches.
+//
+// This should be called once after rtree_new() and before inserting any items.
+void rtree_opt_rstar(struct rtree *tr);
+
+// rtree_opt_concurrent activates the concurrent mode, where rtree_insert,
+// rtree_delete, rtree_delete_with_comparator, and rtree_update may be called
+// by many threads at once. Each node is latched while it's changed, and
+// unlatched as soon as the nodes below it are latched, so writers in 
+// different parts of the rtree do not wait for each other. Other functions,
+// including searches, must not be called at the same time, see rtree_shared
+// for concurrent readers.
+//
+// The path hint of the rtree and the R*-tree forced reinserts are not used,
+// and the rects of the branches are not always shrunk by deletes, which makes
+// searches a little slower. Each thread may use its own hint with
+// rtree_insert_hinted.
+//
+// This should be called once after rtree_new() and before inserting any items.
+// Requires atomics, see RTREE_NOATOMICS.
+//
+// Returns false if the rtree has an index, see rtree_opt_index.
+bool rtree_opt_concurrent(struct rtree *tr);
+
+// rtree_opt_slab_allocator activates a built-in slab allocator for the nodes
+// of the rtree. Nodes are carved out of large chunks of memory that are
+// allocated using the rtree allocator, and freed nodes are reused. Leaves and
+// branches are carved out of separate chunks, each at the size of its kind of
+// node. The slab is shared by the rtree and all of its clones, and the chunks
+// are released in bulk when the last of them is freed. This may increase
+// performance for programs that perform many inserts and deletes.
+//
+// This should be called once after rtree_new() and before inserting any items.
+//
+// Returns false if the rtree is not empty or the system is out of memory.
+bool rtree_opt_slab_allocator(struct rtree *tr);
+
+// rtree_opt_index activates an index of the items by their data, which keeps
+// the rectangle of each item, for rtree_delete_indexed and 
+// rtree_update_indexed. The items already in the rtree are added to it, and 
+// it's kept up to date by every function that adds or deletes items. Each
+// item must have a different data. The index is shared with clones until one
+// of them changes, which then copies it.
+//
+// The data is hashed and compared byte for byte, unless hash and equal are
+// provided, such as for looking up items by an id that their data points to.
+// Then equal is called with the data that was passed to the function, and
+// the data of an item in the rtree, along with the udata of the rtree, see
+// rtree_set_udata.
+//
+// Returns false if the rtree is in concurrent mode, see rtree_opt_concurrent,
+// or the system is out of memory.
+bool rtree_opt_index(struct rtree *tr,
+    uint64_t (*hash)(const RTREE_DATA data, void *udata),
+    bool (*equal)(const RTREE_DATA a, const RTREE_DATA b, void *udata));
+
+// Undefine the settings, unless this is rtree.c, which allows for including
+// this file again for another specialization.
+#ifndef RTREE_IMPLEMENTATION
+#undef RTREE_NUM
+#undef RTREE_DATA
+#ifdef RTREE_PREFIX
+#undef rtree
+#undef rtree_iter
+#undef rtree_packed
+#undef rtree_new
+#undef rtree_new_with_allocator
+#undef rtree_free
+#undef rtree_clone
+#undef rtree_shared
+#undef rtree_shared_new
+#undef rtree_shared_free
+#undef rtree_shared_writer
+#undef rtree_shared_publish
+#undef rtree_shared_acquire
+#undef rtree_shared_release
+#undef rtree_set_item_callbacks
+#undef rtree_set_udata
+#undef rtree_insert
+#undef rtree_insert_hinted
+#undef rtree_hint
+#undef rtree_load
+#undef rtree_compact
+#undef rtree_save
+#undef rtree_restore
+#undef rtree_pack
+#undef rtree_packed_open
+#undef rtree_packed_search
+#undef rtree_packed_scan
+#undef rtree_packed_count
+#undef rtree_search
+#undef rtree_search_batch
+#undef rtree_search_parallel
+#undef rtree_scan
+#undef rtree_join
+#undef rtree_self_join
+#undef rtree_self_join_parallel
+#undef rtree_iter_init
+#undef rtree_iter_next
+#undef rtree_iter_free
+#undef rtree_nearby
+#undef rtree_knn
+#undef rtree_count
+#undef rtree_delete
+#undef rtree_delete_with_comparator
+#undef rtree_delete_hinted
+#undef rtree_delete_area
+#undef rtree_update
+#undef rtree_delete_indexed
+#undef rtree_update_indexed
+#undef rtree_opt_relaxed_atomics
+#undef rtree_opt_rstar
+#undef rtree_opt_concurrent
+#undef rtree_opt_slab_allocator
+#undef rtree_opt_index
+#undef RTREE_PREFIX
+#undef RTREE_DIMS
+#undef RTREE_NUMTYPE
+#undef RTREE_DATATYPE
+#undef RTREE_MAXITEMS
+#undef RTREE_LEAFITEMS
+#undef RTREE_BRANCHITEMS
+#endif
+#endif
+
 #endif // RTREE_H
@@ -185,6 +185,55 @@ struct search_iter_one_context {
     int count;
 };
 
+static bool knn_iter(const double *min, const double *max, const void *item, double dist, void *udata) {
+    (*(int*)udata)++;
+    return true;
+}
+
+static bool search_batch_iter(const double *min, const double *max, const void *item, size_t index, void *udata) {
+    (*(int*)udata)++;
+    return true;
+}
+
+static bool search_parallel_iter(const double *min, const double *max, const void *item, int thread, void *udata) {
+    atomic_fetch_add((atomic_int*)udata, 1);
+    return true;
+}
+
+struct bench_stream {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t pos;
+};
+
+static bool bench_write(const void *data, size_t size, void *udata) {
+    struct bench_stream *bs = (struct bench_stream *)udata;
+    if (bs->len+size > bs->cap) {
+        size_t cap = bs->cap == 0 ? 4096 : bs->cap*2;
+        while (bs->len+size > cap) cap *= 2;
+        char *data2 = (char *)xmalloc(cap);
+        if (!data2) return false;
+        if (bs->data) {
+            memcpy(data2, bs->data, bs->len);
+            xfree(bs->data);
+        }
+        bs->data = data2;
+        bs->cap = cap;
+    }
+    memcpy(bs->data+bs->len, data, size);
+    bs->len += size;
+    return true;
+}
+
+static bool bench_read(void *data, size_t size, void *udata) {
+    struct bench_stream *bs = (struct bench_stream *)udata;
+    if (bs->pos+size > bs->len) return false;
+    memcpy(data, bs->data+bs->pos, size);
+    bs->pos += size;
+    return true;
+}
+
 static bool search_iter_one(const double *min, const double *max, const void *data, void *udata) {
     struct search_iter_one_context *ctx = (struct search_iter_one_context *)udata;
     if (data == ctx->data) {
@@ -238,18 +287,21 @@ void sort_points(double *points, int N) {
     qsort(points, N, sizeof(double)*2, point_compare);
 } 
 
-void test_rand_bench(bool hilbert_ordered, int N) {
-    if (hilbert_ordered) {
-        printf("-- HILBERT ORDER --\n");
-    } else {
-        printf("-- RANDOM ORDER --\n");
-    }
+void test_rand_bench(bool hilbert_ordered, bool slab, bool rstar, int N) {
+    printf("-- %s ORDER%s%s --\n", hilbert_ordered ? "HILBERT" : "RANDOM",
+        slab ? " (SLAB)" : "", rstar ? " (R*)" : "");
     double *points = make_random_points(N);
     if (hilbert_ordered) {
         sort_points(points, N);
     }
 
     struct rtree *tr = rtree_new_with_allocator(xmalloc, xfree);
+    if (slab) {
+        rtree_opt_slab_allocator(tr);
+    }
+    if (rstar) {
+        rtree_opt_rstar(tr);
+    }
     bench("insert", N, {
         double *point = &points[i*2];
         rtree_insert(tr, point, point, (void *)(uintptr_t)(i));
@@ -258,6 +310,42 @@ void test_rand_bench(bool hilbert_ordered, int N) {
 
     rtree_check(tr);
 
+    // Bulk load the same points into a second tree. The entire load happens
+    // on the first iteration, so the reported ns/op is per item.
+    void **datas = (void **)xmalloc(N*sizeof(void*));
+    for (int i = 0; i < N; i++) {
+        datas[i] = (void *)(uintptr_t)(i);
+    }
+    struct rtree *tr2 = rtree_new_with_allocator(xmalloc, xfree);
+    bench("load", N, {
+        if (i == 0) {
+            rtree_load(tr2, points, NULL, datas, N);
+        }
+    });
+    assert(rtree_count(tr2) == (size_t)N);
+    rtree_check(tr2);
+    rtree_free(tr2);
+    xfree(datas);
+
+    // Save the first tree to memory and restore it into a third tree, also
+    // on the first iteration.
+    struct bench_stream bs = { 0 };
+    bench("save", N, {
+        if (i == 0) {
+            rtree_save(tr, bench_write, NULL, &bs);
+        }
+    });
+    struct rtree *tr3 = rtree_new_with_allocator(xmalloc, xfree);
+    bench("restore", N, {
+        if (i == 0) {
+            rtree_restore(tr3, bench_read, NULL, &bs);
+        }
+    });
+    assert(rtree_count(tr3) == (size_t)N);
+    rtree_check(tr3);
+    rtree_free(tr3);
+    xfree(bs.data);
+
 
     // sort_points(points, N);
     bench("search-item", N, {
@@ -269,6 +357,31 @@ void test_rand_bench(bool hilbert_ordered, int N) {
         assert(ctx.count == 1);
     });
 
+    // Pack the tree and search the image in place.
+    struct bench_stream ps = { 0 };
+    rtree_pack(tr, bench_write, &ps);
+    const struct rtree_packed *pk = rtree_packed_open(ps.data, ps.len);
+    assert(pk);
+    bench("search-packed", N, {
+        double *point = &points[i*2];
+        struct search_iter_one_context ctx = { 0 };
+        ctx.point = point;
+        ctx.data = (void *)(uintptr_t)(i);
+        rtree_packed_search(pk, point, point, search_iter_one, &ctx);
+        assert(ctx.count == 1);
+    });
+    xfree(ps.data);
+
+
+    bench("search-batch", N, {
+        if (i%1000 == 0) {
+            int n = N-i < 1000 ? N-i : 1000;
+            int res = 0;
+            rtree_search_batch(tr, &points[i*2], NULL, n, search_batch_iter, 
+                &res);
+            assert(res == n);
+        }
+    });
 
     bench("search-1%", 1000, {
         const double p = 0.01;
@@ -307,6 +420,25 @@ void test_rand_bench(bool hilbert_ordered, int N) {
         rtree_search(tr, min, max, search_iter, &res);
     });
 
+    bench("search-10%-par", 1000, {
+        const double p = 0.10;
+        double min[2];
+        double max[2];
+        min[0] = rand_double() * 360.0 - 180.0;
+        min[1] = rand_double() * 180.0 - 90.0;
+        max[0] = min[0] + 360.0*p;
+        max[1] = min[1] + 180.0*p;
+        atomic_int res = 0;
+        rtree_search_parallel(tr, min, max, 0, search_parallel_iter, &res);
+    });
+
+    bench("knn-10", 100000, {
+        double *point = &points[i*2];
+        int res = 0;
+        rtree_knn(tr, point, NULL, 10, knn_iter, &res);
+        assert(res == 10);
+    });
+
     bench("delete", N, {
         double *point = &points[i*2];
         rtree_delete(tr, point, point, (void*)(uintptr_t)(i));
@@ -394,15 +526,114 @@ void test_rand_bench(bool hilbert_ordered, int N) {
 
 
 
-int main() {
+static double sweep_ns(clock_t begin, int N) {
+    return (double)(clock() - begin) / CLOCKS_PER_SEC / N * 1e9;
+}
+
+// Prints one line for the leaf and branch sizes that this was built with. The
+// 'run.sh bench sweep' command builds and runs this for each pair of sizes.
+void test_sweep_bench(int N) {
+    double *points = make_random_points(N);
+    size_t leafsize, branchsize;
+    rtree_node_sizes(&leafsize, &branchsize);
+
+    struct rtree *tr = rtree_new_with_allocator(xmalloc, xfree);
+    size_t tmem = (size_t)total_mem;
+    clock_t begin = clock();
+    for (int i = 0; i < N; i++) {
+        rtree_insert(tr, &points[i*2], NULL, (void *)(uintptr_t)(i));
+    }
+    double insert_ns = sweep_ns(begin, N);
+    double bytes_op = (double)((size_t)total_mem-tmem)/N;
+
+    begin = clock();
+    for (int i = 0; i < N; i++) {
+        struct search_iter_one_context ctx = { 0 };
+        ctx.point = &points[i*2];
+        ctx.data = (void *)(uintptr_t)(i);
+        rtree_search(tr, &points[i*2], NULL, search_iter_one, &ctx);
+        assert(ctx.count == 1);
+    }
+    double search_ns = sweep_ns(begin, N);
+
+    begin = clock();
+    for (int i = 0; i < 1000; i++) {
+        double min[2], max[2];
+        min[0] = rand_double() * 360.0 - 180.0;
+        min[1] = rand_double() * 180.0 - 90.0;
+        max[0] = min[0] + 360.0*0.01;
+        max[1] = min[1] + 180.0*0.01;
+        int res = 0;
+        rtree_search(tr, min, max, search_iter, &res);
+    }
+    double search1_ns = sweep_ns(begin, 1000);
+
+    begin = clock();
+    for (int i = 0; i < N; i++) {
+        rtree_delete(tr, &points[i*2], NULL, (void *)(uintptr_t)(i));
+    }
+    double delete_ns = sweep_ns(begin, N);
+    assert(rtree_count(tr) == 0);
+    rtree_free(tr);
+    xfree(points);
+
+    printf("%10zu %12zu %10.1f %10.1f %12.1f %10.1f %10.2f\n", leafsize, 
+        branchsize, insert_ns, search_ns, search1_ns, delete_ns, bytes_op);
+}
+
+// Searches a tree that, with the default count, is larger than the last level
+// cache, so that most node loads are from memory. The 'run.sh bench prefetch'
+// command builds and runs this with and without RTREE_PREFETCH.
+void test_large_bench(int N) {
+    double *points = make_random_points(N);
+    struct rtree *tr = rtree_new_with_allocator(xmalloc, xfree);
+    size_t tmem = (size_t)total_mem;
+    for (int i = 0; i < N; i++) {
+        rtree_insert(tr, &points[i*2], NULL, (void *)(uintptr_t)(i));
+    }
+    printf("tree size: %.1f MB\n", (double)((size_t)total_mem-tmem)/1024/1024);
+    // search the points in a different order than they were inserted
+    shuffle_points(points, N);
+    int res = 0;
+    bench("search-item", N, {
+        rtree_search(tr, &points[i*2], NULL, search_iter, &res);
+    });
+    assert(res >= N);
+    bench("search-1%", 1000, {
+        const double p = 0.01;
+        double min[2];
+        double max[2];
+        min[0] = rand_double() * 360.0 - 180.0;
+        min[1] = rand_double() * 180.0 - 90.0;
+        max[0] = min[0] + 360.0*p;
+        max[1] = min[1] + 180.0*p;
+        rtree_search(tr, min, max, search_iter, &res);
+    });
+    rtree_free(tr);
+    xfree(points);
+}
+
+int main(int argc, char **argv) {
     int seed = getenv("SEED")?atoi(getenv("SEED")):time(NULL);
     int N = getenv("N")?atoi(getenv("N")):1000000;
-    printf("seed=%d, count=%d\n", seed, N);
     srand(seed);
-
     init_test_allocator(false);
-    test_rand_bench(false, N);
-    test_rand_bench(true, N);
+    if (argc > 2 && strcmp(argv[2], "sweep") == 0) {
+        test_sweep_bench(N);
+        cleanup_test_allocator();
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[2], "prefetch") == 0) {
+        printf("seed=%d, count=%d\n", seed, N);
+        test_large_bench(N);
+        cleanup_test_allocator();
+        return 0;
+    }
+    printf("seed=%d, count=%d\n", seed, N);
+    test_rand_bench(false, false, false, N);
+    test_rand_bench(true, false, false, N);
+    test_rand_bench(false, true, false, N);
+    test_rand_bench(false, false, true, N);
     cleanup_test_allocator();
     return 0;
 }
\ No newline at end of file
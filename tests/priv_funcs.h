@@ -5,15 +5,86 @@
 // checker
 //////////////////
 
-static bool node_check_rect(const struct rect *rect, struct node *node) {
-    struct rect rect2 = node_rect_calc(node);
-    if (!rect_equals(rect, &rect2)){
-        fprintf(stderr, "invalid rect\n");
+// returns the exact rect of all items below the node
+static struct rect node_rect_items(const struct node *node) {
+    if (node->kind == LEAF) {
+        return node_rect_calc(node);
+    }
+    struct rect rect = node_rect_items(node->nodes[0]);
+    for (int i = 1; i < node->count; i++) {
+        struct rect rect2 = node_rect_items(node->nodes[i]);
+        rect_expand(&rect, &rect2);
+    }
+    return rect;
+}
+
+static bool node_check_rect(const struct rtree *tr, const struct rect *rect,
+    struct node *node)
+{
+    if (node->count > node_maxitems(node->kind)) {
+        fprintf(stderr, "invalid count\n");
+        return false;
+    }
+#ifdef USE_QUANTBRANCH
+    // branch rects contain the rounded rects of the quantized branches below
+    // them, which are checked for their rounding further down, see
+    // RTREE_QUANTBRANCH
+    (void)tr;
+    bool loose = true;
+    // and only the branch nodes of leaves are quantized
+    if (node->kind == BRANCH && node->quant != (node->nodes[0]->kind == LEAF)) {
+        fprintf(stderr, "invalid quant\n");
         return false;
     }
+#else
+    // branch rects are not shrunk by concurrent deletes, see
+    // rtree_opt_concurrent
+    bool loose = tr->concurrent;
+#endif
+    if (loose) {
+        struct rect rect1 = node_rect_items(node);
+        if (!rect_contains(rect, &rect1)) {
+            fprintf(stderr, "invalid rect\n");
+            return false;
+        }
+    } else {
+        struct rect rect1 = *rect;
+        struct rect rect2 = node_rect_calc(node);
+#ifdef USE_FLOATBRANCH
+        // branch rects may be rounded outwards, see RTREE_FLOATBRANCH
+        rect_round(&rect1);
+        rect_round(&rect2);
+#endif
+        if (!rect_equals(&rect1, &rect2)){
+            fprintf(stderr, "invalid rect\n");
+            return false;
+        }
+    }
     if (node->kind == BRANCH) {
         for (int i = 0; i < node->count; i++) {
-            if (!node_check_rect(&node->rects[i], node->nodes[i])) {
+            struct rect rect = node_rect(node, i);
+#ifdef USE_QUANTBRANCH
+            // and also contain the rects of the child, as they are saved
+            struct rect rect2 = node_rect_calc(node->nodes[i]);
+            if (!rect_contains(&rect, &rect2)) {
+                fprintf(stderr, "invalid rect\n");
+                return false;
+            }
+            // by no more than the rounding to the steps of the frame, unless
+            // the children are changed by other writers
+            for (int j = 0; j < DIMS && node->quant && !tr->concurrent; j++) {
+                NUMTYPE min = node->frame.min[j], max = node->frame.max[j];
+                if (rect.min[j] != quant_decode(min, max,
+                        quant_encode(min, max, rect2.min[j], false)) ||
+                    rect.max[j] != quant_decode(min, max,
+                        quant_encode(min, max, rect2.max[j], true)))
+                {
+                    fprintf(stderr, "invalid rect\n");
+                    return false;
+                }
+            }
+#endif
+            if (!node_check_rect(tr, &rect, node->nodes[i])) {
                 return false;
             }
         }
@@ -23,7 +94,7 @@ static bool node_check_rect(const struct rect *rect, struct node *node) {
 
 static bool rtree_check_rects(const struct rtree *tr) {
     if (tr->root) {
-        if (!node_check_rect(&tr->rect, tr->root)) return false;
+        if (!node_check_rect(tr, &tr->rect, tr->root)) return false;
     }
     return true;
 }
@@ -43,9 +114,41 @@ static bool rtree_check_height(const struct rtree *tr) {
     return true;
 }
 
+// every item is in the index with its rect, see rtree_opt_index
+static bool node_check_index(const struct rtree *tr, const struct node *node) {
+    if (node->kind == BRANCH) {
+        for (int i = 0; i < node->count; i++) {
+            if (!node_check_index(tr, node->nodes[i])) return false;
+        }
+        return true;
+    }
+    for (int i = 0; i < node->count; i++) {
+        const struct index_entry *entry = index_get(tr, node->datas[i]);
+        struct rect rect = node_rect(node, i);
+        if (!entry || !rect_equals(&entry->rect, &rect) ||
+            memcmp(&entry->item, &node->datas[i], sizeof(struct item)) != 0)
+        {
+            fprintf(stderr, "invalid index entry\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool rtree_check_index(const struct rtree *tr) {
+    if (!tr->index) return true;
+    if (tr->index->count != tr->count) {
+        fprintf(stderr, "invalid index count\n");
+        return false;
+    }
+    if (tr->root && !node_check_index(tr, tr->root)) return false;
+    return true;
+}
+
 bool rtree_check(const struct rtree *tr) {
     if (!rtree_check_rects(tr)) return false;
     if (!rtree_check_height(tr)) return false;
+    if (!rtree_check_index(tr)) return false;
     return true;
 }
 
@@ -60,11 +163,13 @@ static void node_write_svg(const struct node *node, const struct rect *rect,
     if (node) {
         if (node->kind == BRANCH) {
             for (int i = 0; i < node->count; i++) {
-                node_write_svg(node->nodes[i], &node->rects[i], f, depth+1);
+                struct rect rect = node_rect(node, i);
+                node_write_svg(node->nodes[i], &rect, f, depth+1);
             }
         } else {
             for (int i = 0; i < node->count; i++) {
-                node_write_svg(NULL, &node->rects[i], f, depth+1);
+                struct rect rect = node_rect(node, i);
+                node_write_svg(NULL, &rect, f, depth+1);
             }
         }
     }
@@ -111,4 +216,11 @@ void rtree_write_svg(const struct rtree *tr, const char *path) {
     fclose(f);
 }
 
+// rtree_node_sizes returns the number of bytes used by a leaf node and by a
+// branch node of leaves, as printed by 'run.sh bench sweep'.
+void rtree_node_sizes(size_t *leaf, size_t *branch) {
+    *leaf = node_size(LEAF, false);
+    *branch = node_size(BRANCH, true);
+}
+
 #endif // TEST_PRIVATE_FUNCTIONS
@@ -52,13 +52,42 @@ echo "CC: $CC"
 echo "CFLAGS: $CFLAGS"
 $CC --version
 
-if [[ "$1" == "bench" ]]; then
+if [[ "$1" == "bench" && "$2" == "sweep" ]]; then
+    # Build and run the benchmark for each pair of leaf and branch sizes, 
+    # which may be changed with LEAFITEMS and BRANCHITEMS.
+    echo "SWEEPING..."
+    export SEED=${SEED:-$(date +%s)}
+    echo "seed=$SEED, count=${N:-1000000}"
+    printf "%5s %6s %10s %12s %10s %10s %12s %10s %10s\n" leaf branch \
+        leaf-bytes branch-bytes insert-ns search-ns search-1%-ns delete-ns \
+        bytes/item
+    for leaf in ${LEAFITEMS:-16 32 64 128}; do
+        for branch in ${BRANCHITEMS:-16 32 64 128}; do
+            $CC $CFLAGS -DRTREE_LEAFITEMS=$leaf -DRTREE_BRANCHITEMS=$branch \
+                ../rtree.c bench.c -lm
+            printf "%5d %6d " $leaf $branch
+            ./a.out $@
+        done
+    done
+elif [[ "$1" == "bench" && "$2" == "prefetch" ]]; then
+    # Build and run a search benchmark with and without RTREE_PREFETCH, on a 
+    # tree that is larger than the last level cache of most machines.
+    echo "PREFETCHING..."
+    export SEED=${SEED:-$(date +%s)}
+    export N=${N:-4000000}
+    for opt in "" "-DRTREE_PREFETCH"; do
+        echo "-- ${opt:-no prefetch} --"
+        $CC $CFLAGS $opt ../rtree.c bench.c -lm
+        ./a.out $@
+    done
+elif [[ "$1" == "bench" ]]; then
     echo "BENCHMARKING..."
     echo $CC $CFLAGS ../rtree.c bench.c -lm
     $CC $CFLAGS ../rtree.c bench.c -lm
     ./a.out $@
 else
-    echo "For benchmarks: 'run.sh bench'"
+    echo "For benchmarks: 'run.sh bench', 'run.sh bench sweep', or"
+    echo "'run.sh bench prefetch'"
     if [[ "$RACE" != "1" ]]; then
         echo "For data race check: 'RACE=1 run.sh'"
     fi
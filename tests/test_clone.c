@@ -187,6 +187,203 @@ void test_clone_delete_nocallbacks(void) {
     test_clone_delete_withcallbacks(false);
 }
 
+void test_clone_load(void) {
+    size_t N = 10000;
+    struct pair **pairs;
+    while (!(pairs = xmalloc(sizeof(struct pair*) * N)));
+    double *mins;
+    while (!(mins = xmalloc(sizeof(double) * 2 * N)));
+    double *maxs;
+    while (!(maxs = xmalloc(sizeof(double) * 2 * N)));
+    for (size_t i = 0; i < N; i++) {
+        while (!(pairs[i] = xmalloc(sizeof(struct pair))));
+        fill_rand_rect(&pairs[i]->min[0]);
+        pairs[i]->val = i;
+        memcpy(&mins[i*2], pairs[i]->min, sizeof(double)*2);
+        memcpy(&maxs[i*2], pairs[i]->max, sizeof(double)*2);
+    }
+    struct rtree *tr;
+    int udata = 9876;
+    while(!(tr = rtree_new_with_allocator(xmalloc, xfree)));
+    rtree_set_udata(tr, &udata);
+    rtree_set_item_callbacks(tr, pair_clone, pair_free);
+    while(!(rtree_load(tr, mins, maxs, (void**)pairs, N)));
+    assert(rtree_count(tr) == N);
+    assert(rtree_check(tr));
+
+    struct rtree *tr2;
+    while(!(tr2 = rtree_clone(tr)));
+    for (size_t i = 0; i < N; i++) {
+        assert(find_one(tr2, pairs[i]->min, pairs[i]->max, pairs[i], 
+            pair_compare0, NULL));
+        while(!(rtree_delete_with_comparator(tr2, pairs[i]->min, 
+            pairs[i]->max, pairs[i], pair_compare, NULL)));
+        assert(rtree_count(tr2) == N-i-1);
+    }
+    assert(rtree_check(tr2));
+    assert(rtree_count(tr) == N);
+    assert(rtree_check(tr));
+
+    rtree_free(tr2);
+    rtree_free(tr);
+    for (size_t i = 0; i < N; i++) {
+        xfree(pairs[i]);
+    }
+    xfree(pairs);
+    xfree(mins);
+    xfree(maxs);
+}
+
+// Compacting moves the items of the nodes that only belong to the rtree, and
+// clones the items of the nodes that are shared, so neither rtree loses its
+// items, and every item is freed once.
+void test_clone_compact_withcallbacks(bool withcallbacks) {
+    size_t N = 10000;
+    struct pair **pairs;
+    while (!(pairs = xmalloc(sizeof(struct pair*) * N)));
+    for (size_t i = 0; i < N; i++) {
+        while (!(pairs[i] = xmalloc(sizeof(struct pair))));
+        fill_rand_rect(&pairs[i]->min[0]);
+        pairs[i]->val = i;
+    }
+    struct rtree *tr;
+    int udata = 9876;
+    while(!(tr = rtree_new_with_allocator(xmalloc, xfree)));
+    if (withcallbacks) {
+        rtree_set_udata(tr, &udata);
+        rtree_set_item_callbacks(tr, pair_clone, pair_free);
+    }
+    for (size_t i = 0; i < N; i++) {
+        while(!(rtree_insert(tr, pairs[i]->min, pairs[i]->max, pairs[i])));
+    }
+    struct rtree *tr2;
+    while(!(tr2 = rtree_clone(tr)));
+
+    // delete most of the items, leaving a sparse tree
+    for (size_t i = 0; i < N; i++) {
+        if (i%10 != 0) {
+            while(!(rtree_delete_with_comparator(tr, pairs[i]->min,
+                pairs[i]->max, pairs[i], pair_compare, NULL)));
+        }
+    }
+    while(!(rtree_compact(tr)));
+    assert(rtree_count(tr) == N/10);
+    assert(rtree_check(tr));
+    while(!(rtree_compact(tr)));
+    assert(rtree_count(tr) == N/10);
+    assert(rtree_check(tr));
+    for (size_t i = 0; i < N; i++) {
+        assert(find_one(tr, pairs[i]->min, pairs[i]->max, pairs[i],
+            pair_compare0, NULL) == (i%10 == 0));
+        assert(find_one(tr2, pairs[i]->min, pairs[i]->max, pairs[i],
+            pair_compare0, NULL));
+    }
+    assert(rtree_count(tr2) == N);
+    assert(rtree_check(tr2));
+
+    rtree_free(tr2);
+    rtree_free(tr);
+    for (size_t i = 0; i < N; i++) {
+        xfree(pairs[i]);
+    }
+    xfree(pairs);
+}
+
+void test_clone_compact(void) {
+    test_clone_compact_withcallbacks(true);
+}
+
+void test_clone_compact_nocallbacks(void) {
+    test_clone_compact_withcallbacks(false);
+}
+
+// Compacting is all or nothing, like bulk loading. Make sure that a failed
+// compact leaves the tree as it was and leaks nothing.
+void test_clone_compact_oom(void) {
+    size_t N = 1000;
+    struct pair **pairs;
+    while (!(pairs = xmalloc(sizeof(struct pair*) * N)));
+    for (size_t i = 0; i < N; i++) {
+        while (!(pairs[i] = xmalloc(sizeof(struct pair))));
+        fill_rand_rect(&pairs[i]->min[0]);
+        pairs[i]->val = i;
+    }
+    int udata = 9876;
+    for (int h = 0; h < 100; h++) {
+        struct rtree *tr;
+        while(!(tr = rtree_new_with_allocator(xmalloc, xfree)));
+        if (h % 2) {
+            rtree_set_udata(tr, &udata);
+            rtree_set_item_callbacks(tr, pair_clone, pair_free);
+        }
+        size_t n = (size_t)(rand() % N) + 1;
+        for (size_t i = 0; i < n; i++) {
+            while(!(rtree_insert(tr, pairs[i]->min, pairs[i]->max, 
+                pairs[i])));
+        }
+        struct rtree *tr2 = NULL;
+        if (h % 4 < 2) {
+            while(!(tr2 = rtree_clone(tr)));
+        }
+        rtree_compact(tr);
+        assert(rtree_count(tr) == n);
+        assert(rtree_check(tr));
+        for (size_t i = 0; i < n; i++) {
+            assert(find_one(tr, pairs[i]->min, pairs[i]->max, pairs[i],
+                pair_compare0, NULL));
+        }
+        if (tr2) {
+            assert(rtree_count(tr2) == n);
+            assert(rtree_check(tr2));
+            rtree_free(tr2);
+        }
+        rtree_free(tr);
+    }
+    for (size_t i = 0; i < N; i++) {
+        xfree(pairs[i]);
+    }
+    xfree(pairs);
+}
+
+// Bulk loading is all or nothing, so with random allocation failures it will
+// mostly fail. Make sure that failed loads leave the tree empty and leak
+// nothing.
+void test_clone_load_oom(void) {
+    size_t N = 1000;
+    struct pair **pairs;
+    while (!(pairs = xmalloc(sizeof(struct pair*) * N)));
+    double *mins;
+    while (!(mins = xmalloc(sizeof(double) * 2 * N)));
+    for (size_t i = 0; i < N; i++) {
+        while (!(pairs[i] = xmalloc(sizeof(struct pair))));
+        fill_rand_rect(&pairs[i]->min[0]);
+        pairs[i]->val = i;
+        memcpy(&mins[i*2], pairs[i]->min, sizeof(double)*2);
+    }
+    int udata = 9876;
+    for (int h = 0; h < 1000; h++) {
+        struct rtree *tr;
+        while(!(tr = rtree_new_with_allocator(xmalloc, xfree)));
+        if (h % 2) {
+            rtree_set_udata(tr, &udata);
+            rtree_set_item_callbacks(tr, pair_clone, pair_free);
+        }
+        size_t n = (size_t)(rand() % N) + 1;
+        if (rtree_load(tr, mins, NULL, (void**)pairs, n)) {
+            assert(rtree_count(tr) == n);
+            assert(rtree_check(tr));
+        } else {
+            assert(rtree_count(tr) == 0);
+        }
+        rtree_free(tr);
+    }
+    for (size_t i = 0; i < N; i++) {
+        xfree(pairs[i]);
+    }
+    xfree(pairs);
+    xfree(mins);
+}
+
 void test_clone_pairs_diverge_withcallbacks(bool withcallbacks) {
     size_t N = 10000;
     struct pair **pairs;
@@ -439,7 +636,7 @@ void *thdwork(void *tdata) {
 
 
 
-void test_clone_threads(void) {
+static void clone_threads(bool slab) {
     // This should probably be tested with both:
     //
     //   $ run.sh
@@ -452,6 +649,10 @@ void test_clone_threads(void) {
     assert(objs);
     struct rtree *rtree = rtree_new_with_allocator(xmalloc, xfree);
     assert(rtree);
+    if (slab) {
+        // the clones in all threads share the slab
+        assert(rtree_opt_slab_allocator(rtree));
+    }
     rtree_set_item_callbacks(rtree, bt_cobj_clone, bt_cobj_free);
 
     // create a bunch of random objects
@@ -468,6 +669,7 @@ void test_clone_threads(void) {
         assert(!prev);
     }
     assert(rtree_count(rtree) == (size_t)NOBJS);
+    assert(!rtree_opt_slab_allocator(rtree) == !slab);
 
     // make one local clone
     struct rtree *rtree2 = rtree_clone(rtree);
@@ -525,6 +727,137 @@ void test_clone_threads(void) {
     rtree_free(rtree2);
 }
 
+void test_clone_threads(void) {
+    clone_threads(false);
+}
+
+void test_clone_threads_slab(void) {
+    clone_threads(true);
+}
+
+static bool shared_sum_iter(const double min[], const double max[], 
+    const void *data, void *udata)
+{
+    (void)min; (void)max;
+    *(size_t*)udata += (size_t)(uintptr_t)data;
+    return true;
+}
+
+// Returns the sum of the items in the rtree, which are the numbers from one
+// to the count when the items are inserted in order.
+static size_t shared_sum(const struct rtree *tr) {
+    size_t sum = 0;
+    rtree_scan(tr, shared_sum_iter, &sum);
+    return sum;
+}
+
+void test_clone_shared(void) {
+    int N = 1000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree)));
+    struct rtree_shared *sh;
+    while (!(sh = rtree_shared_new(tr)));
+    assert(rtree_shared_writer(sh) == tr);
+    const struct rtree *snap0 = rtree_shared_acquire(sh);
+    assert(rtree_count(snap0) == 0);
+
+    double first[2];
+    for (int i = 0; i < N; i++) {
+        double point[2] = { rand_double()*360-180, rand_double()*180-90 };
+        while (!rtree_insert(tr, point, NULL, (void*)(uintptr_t)(i+1)));
+        if (i == 0) {
+            memcpy(first, point, sizeof(first));
+        }
+    }
+    // not published yet
+    assert(rtree_count(rtree_shared_acquire(sh)) == 0);
+    rtree_shared_release(sh, snap0);
+    rtree_shared_release(sh, snap0);
+
+    while (!rtree_shared_publish(sh));
+    const struct rtree *snap1 = rtree_shared_acquire(sh);
+    assert(rtree_count(snap1) == (size_t)N);
+    assert(rtree_check((struct rtree *)snap1));
+
+    // changes to the writer do not affect a snapshot that is held
+    while (!rtree_delete(tr, first, NULL, (void*)(uintptr_t)1));
+    assert(rtree_count(tr) == (size_t)N-1);
+    while (!rtree_shared_publish(sh));
+    const struct rtree *snap2 = rtree_shared_acquire(sh);
+    assert(rtree_count(snap2) == (size_t)N-1);
+    assert(shared_sum(snap1) == (size_t)N*(N+1)/2);
+    assert(shared_sum(snap2) == (size_t)N*(N+1)/2-1);
+    rtree_shared_release(sh, snap2);
+
+    // a snapshot may outlive the handle
+    rtree_shared_free(sh);
+    assert(rtree_check((struct rtree *)snap1));
+    assert(shared_sum(snap1) == (size_t)N*(N+1)/2);
+    rtree_shared_release(sh, snap1);
+}
+
+struct shared_thctx {
+    struct rtree_shared *sh;
+    atomic_bool *done;
+    size_t batch;
+};
+
+static void *shared_reader(void *tdata) {
+    struct shared_thctx *ctx = tdata;
+    size_t last = 0;
+    while (!atomic_load(ctx->done)) {
+        const struct rtree *tr = rtree_shared_acquire(ctx->sh);
+        size_t count = rtree_count(tr);
+        // each snapshot is a whole published state, and never older than
+        // the one before it
+        assert(count%ctx->batch == 0 && count >= last);
+        assert(shared_sum(tr) == count*(count+1)/2);
+        last = count;
+        rtree_shared_release(ctx->sh, tr);
+    }
+    return NULL;
+}
+
+void test_clone_shared_threads(void) {
+    // This should probably be tested with both:
+    //
+    //   $ run.sh
+    //   $ RACE=1 run.sh
+    //
+    int NREADERS = 8;
+    int NBATCHES = 100;
+    size_t BATCH = 100;
+    struct rtree *tr = rtree_new_with_allocator(xmalloc, xfree);
+    assert(tr);
+    struct rtree_shared *sh = rtree_shared_new(tr);
+    assert(sh);
+    atomic_bool done = false;
+    struct shared_thctx ctx = { .sh = sh, .done = &done, .batch = BATCH };
+    pthread_t *threads = xmalloc(NREADERS*sizeof(pthread_t));
+    assert(threads);
+    for (int i = 0; i < NREADERS; i++) {
+        assert(!pthread_create(&threads[i], NULL, shared_reader, &ctx));
+    }
+    size_t count = 0;
+    for (int i = 0; i < NBATCHES; i++) {
+        for (size_t j = 0; j < BATCH; j++) {
+            double point[2] = { rand_double()*360-180, rand_double()*180-90 };
+            count++;
+            assert(rtree_insert(tr, point, NULL, (void*)(uintptr_t)count));
+        }
+        assert(rtree_shared_publish(sh));
+    }
+    atomic_store(&done, true);
+    for (int i = 0; i < NREADERS; i++) {
+        assert(!pthread_join(threads[i], NULL));
+    }
+    xfree(threads);
+    const struct rtree *snap = rtree_shared_acquire(sh);
+    assert(rtree_count(snap) == count);
+    rtree_shared_release(sh, snap);
+    rtree_shared_free(sh);
+}
+
 int main(int argc, char **argv) {
     do_chaos_test(test_clone_items);
     do_chaos_test(test_clone_items_nocallbacks);
@@ -536,6 +869,16 @@ int main(int argc, char **argv) {
     // do_chaos_test(test_clone_pop_nocallbacks);
 
 
+    do_test(test_clone_load);
+    do_chaos_test(test_clone_load_oom);
+    do_test(test_clone_compact);
+    do_test(test_clone_compact_nocallbacks);
+    do_chaos_test(test_clone_compact_oom);
     do_test(test_clone_threads);
+    do_test(test_clone_threads_slab);
+    do_chaos_test(test_clone_shared);
+#ifndef RTREE_NOATOMICS
+    do_test(test_clone_shared_threads);
+#endif
     return 0;
 }
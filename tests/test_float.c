@@ -0,0 +1,14 @@
+#include "tests.h"
+
+// The tests of test_generic.c, with a specialization of the rtree that stores
+// the rects of the branch nodes as floats, see RTREE_FLOATBRANCH. Its symbols
+// are prefixed with rtree2f, keeping them apart from the default rtree.c that
+// is linked in too.
+#define RTREE_PREFIX rtree2f
+#define RTREE_DATATYPE int
+#undef RTREE_FLOATBRANCH
+#undef RTREE_SOA
+#undef RTREE_QUANTBRANCH
+#define RTREE_FLOATBRANCH
+#define GENERIC_NAME test_float
+#include "test_generic.c"
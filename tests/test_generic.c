@@ -0,0 +1,259 @@
+#include "tests.h"
+
+// A second specialization of the rtree is built into this test, with three
+// dimensions, float coordinates, integer items, and fewer children in the
+// branches than in the leaves. Its symbols are prefixed with rtree3f, keeping
+// them apart from the default rtree.c that is linked in too. The private
+// struct rect is renamed to not collide with tests.h.
+//
+// Another test may choose its own specialization before including this file,
+// such as test_points.c. The tests below use the plain rtree names, which
+// rtree.h maps to the symbols of the specialization, and its DIMS and NUMTYPE.
+// They are named after the file that includes this one, with GENERIC_NAME.
+#ifndef RTREE_PREFIX
+#define RTREE_PREFIX rtree3f
+#define RTREE_DIMS 3
+#define RTREE_NUMTYPE float
+#define RTREE_DATATYPE int
+#undef RTREE_MAXITEMS
+#undef RTREE_LEAFITEMS
+#undef RTREE_BRANCHITEMS
+#define RTREE_LEAFITEMS 24
+#define RTREE_BRANCHITEMS 6
+#endif
+#ifndef GENERIC_NAME
+#define GENERIC_NAME test_generic
+#endif
+#define rect generic_rect
+#include "../rtree.c"
+#undef rect
+
+#define generic_test(name) RTREE_CAT(GENERIC_NAME, name)
+
+struct box {
+    NUMTYPE min[DIMS];
+    NUMTYPE max[DIMS];
+};
+
+static void fill_rand_box(struct box *box) {
+    for (int i = 0; i < DIMS; i++) {
+        box->min[i] = rand_double()*200-100;
+#ifdef RTREE_POINTS
+        box->max[i] = box->min[i];
+#else
+        box->max[i] = box->min[i]+rand_double()*4;
+#endif
+    }
+}
+
+static bool box_intersects(const struct box *a, const struct box *b) {
+    for (int i = 0; i < DIMS; i++) {
+        if (a->min[i] > b->max[i] || a->max[i] < b->min[i]) return false;
+    }
+    return true;
+}
+
+struct box_iter_context {
+    const struct box *boxes;
+    int *seen;
+    int count;
+};
+
+static bool box_iter(const NUMTYPE *min, const NUMTYPE *max, const int data,
+    void *udata)
+{
+    struct box_iter_context *ctx = udata;
+    assert(memcmp(min, ctx->boxes[data].min, sizeof(NUMTYPE)*DIMS) == 0);
+    assert(memcmp(max, ctx->boxes[data].max, sizeof(NUMTYPE)*DIMS) == 0);
+    ctx->seen[data]++;
+    ctx->count++;
+    return true;
+}
+
+void generic_test(_ops)(void) {
+    int N = 5000;
+    struct box *boxes;
+    int *seen;
+    while (!(boxes = xmalloc(sizeof(struct box)*N)));
+    while (!(seen = xmalloc(sizeof(int)*N)));
+    for (int i = 0; i < N; i++) {
+        fill_rand_box(&boxes[i]);
+    }
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree)));
+    for (int i = 0; i < N; i++) {
+        while (!rtree_insert(tr, boxes[i].min, boxes[i].max, i));
+    }
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_check(tr));
+
+    // delete the even items
+    for (int i = 0; i < N; i += 2) {
+        while (!rtree_delete(tr, boxes[i].min, boxes[i].max, i));
+    }
+    assert(rtree_count(tr) == (size_t)N/2);
+    assert(rtree_check(tr));
+
+    // compare searches against brute force
+    for (int i = 0; i < 100; i++) {
+        struct box query;
+        fill_rand_box(&query);
+        for (int j = 0; j < DIMS; j++) {
+            query.max[j] += 20;
+        }
+        memset(seen, 0, sizeof(int)*N);
+        struct box_iter_context ctx = { .boxes = boxes, .seen = seen };
+        rtree_search(tr, query.min, query.max, box_iter, &ctx);
+        int count = 0;
+        for (int j = 0; j < N; j++) {
+            bool expect = (j&1) && box_intersects(&query, &boxes[j]);
+            assert(seen[j] == expect);
+            count += expect;
+        }
+        assert(ctx.count == count);
+    }
+
+    rtree_free(tr);
+    xfree(seen);
+    xfree(boxes);
+}
+
+struct nearest_context {
+    int count;
+    double last;
+};
+
+static bool nearest_iter(const NUMTYPE *min, const NUMTYPE *max,
+    const int data, double dist, void *udata)
+{
+    (void)min, (void)max, (void)data;
+    struct nearest_context *ctx = udata;
+    assert(dist >= ctx->last);
+    ctx->last = dist;
+    ctx->count++;
+    return true;
+}
+
+void generic_test(_load)(void) {
+    int N = 10000;
+    NUMTYPE *points;
+    int *ids;
+    while (!(points = xmalloc(sizeof(NUMTYPE)*DIMS*N)));
+    while (!(ids = xmalloc(sizeof(int)*N)));
+    for (int i = 0; i < N; i++) {
+        for (int j = 0; j < DIMS; j++) {
+            points[i*DIMS+j] = rand_double()*200-100;
+        }
+        ids[i] = i;
+    }
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree)));
+    assert(rtree_load(tr, points, NULL, ids, N));
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_check(tr));
+
+    // every item comes back from the iterator exactly once
+    char *seen;
+    while (!(seen = xmalloc(N)));
+    memset(seen, 0, N);
+    NUMTYPE lo[DIMS], hi[DIMS], zero[DIMS];
+    for (int i = 0; i < DIMS; i++) {
+        lo[i] = -100;
+        hi[i] = 100;
+        zero[i] = 0;
+    }
+    struct rtree_iter *iter;
+    assert((iter = rtree_iter_init(tr, lo, hi)));
+    const NUMTYPE *min, *max;
+    int id;
+    int count = 0;
+    while (rtree_iter_next(iter, &min, &max, &id)) {
+        assert(memcmp(min, &points[id*DIMS], sizeof(NUMTYPE)*DIMS) == 0);
+        assert(memcmp(max, min, sizeof(NUMTYPE)*DIMS) == 0);
+        assert(!seen[id]);
+        seen[id] = 1;
+        count++;
+    }
+    rtree_iter_free(iter);
+    assert(count == N);
+
+    struct nearest_context ctx = { 0 };
+    assert(rtree_knn(tr, zero, NULL, 100, nearest_iter, &ctx));
+    assert(ctx.count == 100);
+
+    rtree_free(tr);
+    xfree(seen);
+    xfree(ids);
+    xfree(points);
+}
+
+// returns the bytes allocated for an rtree of the boxes
+static int slab_mem(const struct box *boxes, int n, bool slab) {
+    int mem = atomic_load(&total_mem);
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree)));
+    while (slab && !rtree_opt_slab_allocator(tr));
+    for (int i = 0; i < n; i++) {
+        while (!rtree_insert(tr, boxes[i].min, boxes[i].max, i));
+    }
+    assert(rtree_check(tr));
+    mem = atomic_load(&total_mem)-mem;
+    rtree_free(tr);
+    return mem;
+}
+
+void generic_test(_slab)(void) {
+    int N = 100000;
+    struct box *boxes;
+    while (!(boxes = xmalloc(sizeof(struct box)*N)));
+    for (int i = 0; i < N; i++) {
+        fill_rand_box(&boxes[i]);
+    }
+    // the nodes of the slab are only as large as their kind of node, so it
+    // uses little more than the nodes that are allocated one by one, with
+    // the rest of the last chunks
+    int mem = slab_mem(boxes, N, false);
+    int mem2 = slab_mem(boxes, N, true);
+    assert(mem2 < mem+mem/8);
+    xfree(boxes);
+}
+
+#ifdef RTREE_POINTS
+void generic_test(_point_rects)(void) {
+    NUMTYPE min[DIMS], max[DIMS];
+    for (int i = 0; i < DIMS; i++) {
+        min[i] = i;
+        max[i] = i+1;
+    }
+    // the max coordinates may be missing or the same as the min
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree)));
+    assert(rtree_load(tr, min, min, (int[1]){ 0 }, 1));
+    assert(rtree_insert(tr, max, max, 1));
+    assert(rtree_update(tr, min, min, max, NULL, 0));
+    assert(rtree_count(tr) == 2);
+    assert(rtree_check(tr));
+    assert(rtree_delete(tr, max, max, 0));
+    assert(rtree_delete(tr, max, NULL, 1));
+    assert(rtree_count(tr) == 0);
+    rtree_free(tr);
+
+    // the leaves hold half of the coordinates of the leaves of the default
+    // rtree, which is linked in too
+    size_t leaf, branch, pleaf, pbranch;
+    RTREE_CAT(RTREE_PREFIX, _node_sizes)(&pleaf, &pbranch);
+#undef rtree_node_sizes
+    rtree_node_sizes(&leaf, &branch);
+    assert(pleaf < leaf);
+}
+#endif
+
+int main(int argc, char **argv) {
+    do_chaos_test(generic_test(_ops));
+    do_test(generic_test(_load));
+    do_test(generic_test(_slab));
+#ifdef RTREE_POINTS
+    do_test(generic_test(_point_rects));
+#endif
+    return 0;
+}
@@ -0,0 +1,12 @@
+#include "tests.h"
+
+// The tests of test_generic.c, with a specialization of the rtree for points,
+// which stores only one corner of each item in its leaves. Its symbols are
+// prefixed with rtree2p, keeping them apart from the default rtree.c that is
+// linked in too.
+#define RTREE_PREFIX rtree2p
+#define RTREE_DATATYPE int
+#define RTREE_POINTS
+#undef RTREE_SOA
+#define GENERIC_NAME test_points
+#include "test_generic.c"
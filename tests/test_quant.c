@@ -0,0 +1,15 @@
+#include "tests.h"
+
+// The tests of test_generic.c, with a specialization of the rtree that
+// quantizes the rects of the branch nodes of leaves, see RTREE_QUANTBRANCH.
+// Its symbols are prefixed with rtree2q, keeping them apart from the default
+// rtree.c that is linked in too. The steps may be chosen with CFLAGS.
+#define RTREE_PREFIX rtree2q
+#define RTREE_DATATYPE int
+#ifndef RTREE_QUANTBRANCH
+#define RTREE_QUANTBRANCH 8
+#endif
+#undef RTREE_SOA
+#undef RTREE_FLOATBRANCH
+#define GENERIC_NAME test_quant
+#include "test_generic.c"
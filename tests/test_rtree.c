@@ -1,3 +1,5 @@
+#include <sys/mman.h>
+#include <pthread.h>
 #include "tests.h"
 
 double predef[] = {-52.9434,2.3502,79.7989,0.0965,-70.7779,57.1756,36.2933,77.0761,21.4716,3.4453,-14.5109,-18.9968,-33.9442,-11.1449,10.3230,-66.1787,-76.7850,-68.3149,48.2775,-57.6251,1.8490,32.8058,-6.3306,-50.2694,-11.0860,-26.7247,-71.1707,-77.4811,-40.9573,-81.1828,13.3053,26.7539,-15.3284,-43.5700,-16.2263,30.5950,53.7956,42.5554,-17.4207,-45.7420,28.6247,-73.9760,-47.9121,-24.0529,20.3135,81.6178,-75.7848,-61.4280,60.6492,45.6531,32.6774,-1.8117,6.7576,-30.7179,36.9515,84.9250,22.8975,23.5716,
@@ -181,7 +183,7 @@ bool iter_two(const double *min, const double *max, const void *data,
 }
 
 
-void test_rtree_ops(void) {
+static void rtree_ops(bool slab, bool rstar) {
     int N = 100000;
     double *coords;
     while (!(coords = xmalloc(sizeof(double)*N*4))) {}
@@ -190,6 +192,12 @@ void test_rtree_ops(void) {
     }
     struct rtree *tr;
     while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    if (slab) {
+        while (!rtree_opt_slab_allocator(tr)){}
+    }
+    if (rstar) {
+        rtree_opt_rstar(tr);
+    }
     for (int i = 0; i < N; i++) {
         double *min = &coords[i*4+0];
         double *max = &coords[i*4+2];
@@ -251,6 +259,1737 @@ void test_rtree_ops(void) {
     xfree(coords);
 }
 
+void test_rtree_ops(void) {
+    rtree_ops(false, false);
+}
+
+void test_rtree_ops_slab(void) {
+    rtree_ops(true, false);
+}
+
+void test_rtree_ops_rstar(void) {
+    rtree_ops(false, true);
+}
+
+// Two streams of inserts, each moving along a path of its own, which is what
+// the hints of the caller are for. The same hints are used for a second rtree
+// too, where they are stale at first.
+void test_rtree_hinted(void) {
+    int N = 20000;
+    double *coords;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    for (int i = 0; i < N; i++) {
+        double x = (i&1) ? 10+(i/2)*0.01 : -10-(i/2)*0.01;
+        double y = rand_double()*10-5;
+        coords[i*4+0] = x;
+        coords[i*4+1] = y;
+        coords[i*4+2] = x+rand_double()*0.1;
+        coords[i*4+3] = y+rand_double()*0.1;
+    }
+    struct rtree_hint hints[2] = { 0 };
+    for (int j = 0; j < 2; j++) {
+        struct rtree *tr;
+        while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+        if (j == 1) {
+            rtree_opt_rstar(tr);
+        }
+        for (int i = 0; i < N; i++) {
+            double *min = &coords[i*4+0];
+            double *max = &coords[i*4+2];
+            void *data = (void *)(uintptr_t)i;
+            while (!rtree_insert_hinted(tr, &hints[i&1], min, max, data)){}
+            if (i%1000==0) assert(rtree_check(tr));
+        }
+        assert(rtree_count(tr) == (size_t)N);
+        assert(rtree_check(tr));
+        for (int i = 0; i < N; i++) {
+            double *min = &coords[i*4+0];
+            double *max = &coords[i*4+2];
+            void *data = (void *)(uintptr_t)i;
+            assert(find_one(tr, min, max, data, NULL, NULL));
+        }
+        for (int i = 0; i < N; i += 2) {
+            double *min = &coords[i*4+0];
+            double *max = &coords[i*4+2];
+            void *data = (void *)(uintptr_t)i;
+            while (!rtree_delete_hinted(tr, &hints[0], min, max, data)){}
+            assert(!find_one(tr, min, max, data, NULL, NULL));
+            if (i%1000==0) assert(rtree_check(tr));
+        }
+        assert(rtree_count(tr) == (size_t)N/2);
+        assert(rtree_check(tr));
+        for (int i = 1; i < N; i += 2) {
+            double *min = &coords[i*4+0];
+            double *max = &coords[i*4+2];
+            void *data = (void *)(uintptr_t)i;
+            while (!rtree_delete_hinted(tr, NULL, min, max, data)){}
+        }
+        assert(rtree_count(tr) == 0);
+        assert(rtree_check(tr));
+        rtree_free(tr);
+    }
+    xfree(coords);
+}
+
+static bool delete_even_iter(const double *min, const double *max,
+    const void *data, void *udata)
+{
+    (void)min, (void)max, (void)udata;
+    return ((uintptr_t)data&1) == 0;
+}
+
+static bool mark_iter(const double *min, const double *max, const void *data,
+    void *udata)
+{
+    (void)min, (void)max;
+    ((char*)udata)[(uintptr_t)data]++;
+    return true;
+}
+
+static bool coords_intersect(const double *a, const double *b) {
+    return !(a[0] > b[2] || a[2] < b[0] || a[1] > b[3] || a[3] < b[1]);
+}
+
+void test_rtree_delete_area(void) {
+    int N = 20000;
+    double *coords;
+    char *seen;
+    char *expect;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    while (!(seen = xmalloc(N))) {}
+    while (!(expect = xmalloc(N))) {}
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+        expect[i] = 1;
+    }
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))) {}
+    for (int i = 0; i < N; i++) {
+        void *data = (void *)(uintptr_t)i;
+        while (!rtree_insert(tr, &coords[i*4], &coords[i*4+2], data)) {}
+    }
+    // the deletes must not change the clone
+    struct rtree *tr2;
+    while (!(tr2 = rtree_clone(tr))) {}
+
+    double areas[][4] = {
+        { -100, -50, 20, 30 },   // the even items
+        { -180, -90, 0, 90 },    // every item
+        { -1, -1, 1, 1 },        // nothing that is left
+        { -180, -90, 180, 90 },  // the rest
+    };
+    for (int j = 0; j < 4; j++) {
+        double *area = areas[j];
+        bool (*iter)(const double *min, const double *max, const void *data,
+            void *udata) = j == 0 ? delete_even_iter : NULL;
+        while (!rtree_delete_area(tr, &area[0], &area[2], iter, NULL)) {}
+        size_t count = 0;
+        for (int i = 0; i < N; i++) {
+            if (coords_intersect(&coords[i*4], area) && (!iter || !(i&1))) {
+                expect[i] = 0;
+            }
+            count += expect[i];
+        }
+        assert(rtree_count(tr) == count);
+        assert(rtree_check(tr));
+        memset(seen, 0, N);
+        rtree_scan(tr, mark_iter, seen);
+        assert(memcmp(seen, expect, N) == 0);
+    }
+    assert(rtree_count(tr) == 0);
+    rtree_free(tr);
+
+    assert(rtree_count(tr2) == (size_t)N);
+    assert(rtree_check(tr2));
+    memset(seen, 0, N);
+    rtree_scan(tr2, mark_iter, seen);
+    for (int i = 0; i < N; i++) {
+        assert(seen[i] == 1);
+    }
+    rtree_free(tr2);
+    xfree(expect);
+    xfree(seen);
+    xfree(coords);
+}
+
+struct find_exact_context {
+    const double *rect;
+    void *data;
+    int count;
+};
+
+static bool find_exact_iter(const double *min, const double *max, 
+    const void *data, void *udata)
+{
+    struct find_exact_context *ctx = udata;
+    if (data == ctx->data && memcmp(min, &ctx->rect[0], 16) == 0 &&
+        memcmp(max, &ctx->rect[2], 16) == 0)
+    {
+        ctx->count++;
+    }
+    return true;
+}
+
+// returns the number of items with the exact rect and data
+static int find_exact(struct rtree *tr, const double rect[4], void *data) {
+    struct find_exact_context ctx = { .rect = rect, .data = data };
+    rtree_search(tr, &rect[0], &rect[2], find_exact_iter, &ctx);
+    return ctx.count;
+}
+
+void test_rtree_update(void) {
+    int N = 20000;
+    double *coords;
+    double *coords2;
+    double *orig;
+    char *seen;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    while (!(coords2 = xmalloc(sizeof(double)*N*4))) {}
+    while (!(orig = xmalloc(sizeof(double)*N*4))) {}
+    while (!(seen = xmalloc(N))) {}
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+    }
+    memcpy(orig, coords, sizeof(double)*N*4);
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))) {}
+    for (int i = 0; i < N; i++) {
+        void *data = (void *)(uintptr_t)i;
+        while (!rtree_insert(tr, &coords[i*4], &coords[i*4+2], data)) {}
+    }
+    // the updates must not change the clone
+    struct rtree *tr2;
+    while (!(tr2 = rtree_clone(tr))) {}
+
+    // move the items by a little, which mostly stay in their leaves, and then 
+    // by a lot, which mostly do not.
+    double offsets[] = { 0.01, 30 };
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; i < N; i++) {
+            double *rect = &coords[i*4];
+            double *rect2 = &coords2[i*4];
+            double dx = (rand_double()*2-1)*offsets[j];
+            double dy = (rand_double()*2-1)*offsets[j];
+            rect2[0] = rect[0]+dx;
+            rect2[1] = rect[1]+dy;
+            rect2[2] = rect[2]+dx;
+            rect2[3] = rect[3]+dy;
+            void *data = (void *)(uintptr_t)i;
+            while (!rtree_update(tr, &rect[0], &rect[2], &rect2[0], &rect2[2],
+                data)) {}
+        }
+        assert(rtree_count(tr) == (size_t)N);
+        assert(rtree_check(tr));
+        for (int i = 0; i < N; i++) {
+            void *data = (void *)(uintptr_t)i;
+            assert(find_exact(tr, &coords2[i*4], data) == 1);
+            assert(find_exact(tr, &coords[i*4], data) == 0);
+        }
+        memset(seen, 0, N);
+        rtree_scan(tr, mark_iter, seen);
+        for (int i = 0; i < N; i++) {
+            assert(seen[i] == 1);
+        }
+        double *tmp = coords;
+        coords = coords2;
+        coords2 = tmp;
+    }
+
+    // updating an item that is not in the rtree does nothing
+    double none[4] = { 500, 500, 501, 501 };
+    assert(rtree_update(tr, &none[0], &none[2], &coords[0], &coords[2], 
+        (void *)(uintptr_t)N));
+    assert(rtree_count(tr) == (size_t)N);
+    rtree_free(tr);
+
+    // move all items of small rtrees, so that reinserting an item will 
+    // sometimes split a full root.
+    for (int n = 1; n < 250; n++) {
+        while (!(tr = rtree_new_with_allocator(xmalloc, xfree))) {}
+        for (int i = 0; i < n; i++) {
+            fill_rand_rect(&coords[i*4]);
+            void *data = (void *)(uintptr_t)i;
+            while (!rtree_insert(tr, &coords[i*4], &coords[i*4+2], data)) {}
+        }
+        for (int i = 0; i < n; i++) {
+            double *rect = &coords[i*4];
+            double rect2[4];
+            fill_rand_rect(rect2);
+            void *data = (void *)(uintptr_t)i;
+            while (!rtree_update(tr, &rect[0], &rect[2], &rect2[0], &rect2[2],
+                data)) {}
+            memcpy(rect, rect2, sizeof(rect2));
+        }
+        assert(rtree_count(tr) == (size_t)n);
+        assert(rtree_check(tr));
+        for (int i = 0; i < n; i++) {
+            assert(find_exact(tr, &coords[i*4], (void *)(uintptr_t)i) == 1);
+        }
+        rtree_free(tr);
+    }
+
+    assert(rtree_count(tr2) == (size_t)N);
+    assert(rtree_check(tr2));
+    for (int i = 0; i < N; i++) {
+        assert(find_exact(tr2, &orig[i*4], (void *)(uintptr_t)i) == 1);
+    }
+    rtree_free(tr2);
+    xfree(seen);
+    xfree(orig);
+    xfree(coords2);
+    xfree(coords);
+}
+
+static uint64_t id_hash(const void *data, void *udata) {
+    (void)udata;
+    return *(const int *)data;
+}
+
+static bool id_equal(const void *a, const void *b, void *udata) {
+    (void)udata;
+    return *(const int *)a == *(const int *)b;
+}
+
+void test_rtree_index(void) {
+    int N = 20000;
+    double *coords;
+    double *coords2;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    while (!(coords2 = xmalloc(sizeof(double)*N*4))) {}
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+    }
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))) {}
+    // the items that are already in the rtree are indexed too
+    for (int i = 0; i < N; i++) {
+        if (i == N/2) {
+            while (!rtree_opt_index(tr, NULL, NULL)) {}
+            assert(rtree_opt_index(tr, NULL, NULL));
+            assert(!rtree_opt_concurrent(tr));
+            assert(rtree_check(tr));
+        }
+        void *data = (void *)(uintptr_t)i;
+        while (!rtree_insert(tr, &coords[i*4], &coords[i*4+2], data)) {}
+    }
+    assert(rtree_check(tr));
+    // the changes must not change the clone, or its index
+    struct rtree *tr2;
+    while (!(tr2 = rtree_clone(tr))) {}
+
+    // move every item by its data alone
+    for (int i = 0; i < N; i++) {
+        double *rect = &coords[i*4];
+        double *rect2 = &coords2[i*4];
+        double dx = (rand_double()*2-1)*10;
+        double dy = (rand_double()*2-1)*10;
+        rect2[0] = rect[0]+dx;
+        rect2[1] = rect[1]+dy;
+        rect2[2] = rect[2]+dx;
+        rect2[3] = rect[3]+dy;
+        void *data = (void *)(uintptr_t)i;
+        while (!rtree_update_indexed(tr, &rect2[0], &rect2[2], data)) {}
+    }
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_check(tr));
+    for (int i = 0; i < N; i++) {
+        assert(find_exact(tr, &coords2[i*4], (void *)(uintptr_t)i) == 1);
+    }
+
+    // delete the odd items by their data alone
+    for (int i = 1; i < N; i += 2) {
+        while (!rtree_delete_indexed(tr, (void *)(uintptr_t)i)) {}
+    }
+    assert(rtree_count(tr) == (size_t)N/2);
+    assert(rtree_check(tr));
+    for (int i = 0; i < N; i++) {
+        assert(find_exact(tr, &coords2[i*4], (void *)(uintptr_t)i) == !(i&1));
+    }
+
+    // unknown data does nothing
+    void *none = (void *)(uintptr_t)1;
+    assert(rtree_delete_indexed(tr, none));
+    assert(rtree_update_indexed(tr, &coords2[0], &coords2[2], none));
+    assert(rtree_count(tr) == (size_t)N/2);
+
+    // deleting areas, with nodes that are freed whole
+    while (!rtree_delete_area(tr, (double[2]){ -180, -90 }, 
+        (double[2]){ 0, 90 }, NULL, NULL)) {}
+    assert(rtree_check(tr));
+    while (!rtree_delete_area(tr, (double[2]){ -200, -110 }, 
+        (double[2]){ 200, 110 }, NULL, NULL)) {}
+    assert(rtree_count(tr) == 0);
+    assert(rtree_check(tr));
+    rtree_free(tr);
+
+    assert(rtree_count(tr2) == (size_t)N);
+    assert(rtree_check(tr2));
+    for (int i = 0; i < N; i += 100) {
+        while (!rtree_delete_indexed(tr2, (void *)(uintptr_t)i)) {}
+        assert(find_exact(tr2, &coords[i*4], (void *)(uintptr_t)i) == 0);
+    }
+    assert(rtree_count(tr2) == (size_t)N-N/100);
+    assert(rtree_check(tr2));
+    rtree_free(tr2);
+
+    // look up the items by an id that their data points to
+    int *ids;
+    while (!(ids = xmalloc(sizeof(int)*N))) {}
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))) {}
+    while (!rtree_opt_index(tr, id_hash, id_equal)) {}
+    for (int i = 0; i < N; i++) {
+        ids[i] = i;
+        while (!rtree_insert(tr, &coords[i*4], &coords[i*4+2], &ids[i])) {}
+    }
+    for (int i = 0; i < N; i++) {
+        int id = i;
+        if (i&1) {
+            while (!rtree_delete_indexed(tr, &id)) {}
+        } else {
+            while (!rtree_update_indexed(tr, &coords2[i*4], &coords2[i*4+2],
+                &id)) {}
+            assert(find_exact(tr, &coords2[i*4], &ids[i]) == 1);
+        }
+    }
+    assert(rtree_count(tr) == (size_t)N/2);
+    assert(rtree_check(tr));
+    rtree_free(tr);
+    xfree(ids);
+    xfree(coords2);
+    xfree(coords);
+}
+
+void test_rtree_slab(void) {
+    int N = 10000;
+    double *coords;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_opt_slab_allocator(tr)){}
+    assert(rtree_opt_slab_allocator(tr));
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+        while (!rtree_insert(tr, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+    assert(rtree_check(tr));
+
+    // the slab cannot be activated on a tree with items
+    struct rtree *tr2;
+    while (!(tr2 = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_insert(tr2, &coords[0], &coords[2], NULL)){}
+    assert(!rtree_opt_slab_allocator(tr2));
+    rtree_free(tr2);
+
+    // clones share the slab, and diverge using nodes from the same free list
+    while (!(tr2 = rtree_clone(tr))){}
+    for (int i = 0; i < N; i += 2) {
+        while (!rtree_delete(tr2, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+    for (int i = 0; i < N; i += 6) {
+        while (!rtree_insert(tr2, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+    assert(rtree_check(tr));
+    assert(rtree_check(tr2));
+    assert(rtree_count(tr) == (size_t)N);
+    for (int i = 0; i < N; i++) {
+        void *data = (void *)(uintptr_t)i;
+        assert(find_one(tr, &coords[i*4+0], &coords[i*4+2], data, NULL, NULL));
+        assert(find_one(tr2, &coords[i*4+0], &coords[i*4+2], data, NULL, 
+            NULL) == (i%2 == 1 || i%6 == 0));
+    }
+
+    // the first free leaves the shared slab, the last one releases it in bulk
+    rtree_free(tr);
+    assert(rtree_check(tr2));
+    rtree_free(tr2);
+    xfree(coords);
+}
+
+void test_rtree_load(void) {
+    int N = 100000;
+    double *coords;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    double *mins;
+    while (!(mins = xmalloc(sizeof(double)*N*2))) {}
+    double *maxs;
+    while (!(maxs = xmalloc(sizeof(double)*N*2))) {}
+    void **datas;
+    while (!(datas = xmalloc(sizeof(void*)*N))) {}
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+        memcpy(&mins[i*2], &coords[i*4+0], sizeof(double)*2);
+        memcpy(&maxs[i*2], &coords[i*4+2], sizeof(double)*2);
+        datas[i] = (void *)(uintptr_t)i;
+    }
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    assert(rtree_load(tr, mins, maxs, datas, 0));
+    assert(rtree_count(tr) == 0);
+    while (!rtree_load(tr, mins, maxs, datas, N)){}
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_check(tr));
+    for (int i = 0; i < N; i++) {
+        double *min = &coords[i*4+0];
+        double *max = &coords[i*4+2];
+        assert(find_one(tr, min, max, datas[i], NULL, NULL));
+    }
+    struct iter_scan_all_ctx ctx0 = { 0 };
+    rtree_scan(tr, iter_scan_all, &ctx0);
+    assert(ctx0.count == (size_t)N);
+
+    // loading into a non-empty tree inserts one at a time
+    void *extra = (void *)(uintptr_t)N;
+    while (!rtree_load(tr, mins, NULL, &extra, 1)){}
+    assert(rtree_count(tr) == (size_t)N+1);
+    assert(find_one(tr, mins, mins, extra, NULL, NULL));
+    while (!rtree_delete(tr, mins, NULL, extra)){}
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_check(tr));
+
+    // the packed tree must still support inserts and deletes
+    for (int i = 0; i < N; i++) {
+        double *min = &coords[i*4+0];
+        double *max = &coords[i*4+2];
+        if (i % 2) {
+            while (!rtree_delete(tr, min, max, datas[i])){}
+            assert(!find_one(tr, min, max, datas[i], NULL, NULL));
+        } else {
+            while (!rtree_insert(tr, max, NULL, datas[i])){}
+        }
+        if (i%1000==0) assert(rtree_check(tr));
+    }
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_check(tr));
+    rtree_free(tr);
+
+    // load points
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_load(tr, mins, NULL, datas, N)){}
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_check(tr));
+    for (int i = 0; i < N; i++) {
+        assert(find_one(tr, &mins[i*2], NULL, datas[i], NULL, NULL));
+    }
+    rtree_free(tr);
+
+    xfree(datas);
+    xfree(maxs);
+    xfree(mins);
+    xfree(coords);
+}
+
+struct iter_collect_ctx {
+    size_t count;
+    uint8_t *seen;
+};
+
+bool iter_collect(const double *min, const double *max, const void *data,
+    void *udata)
+{
+    (void)min, (void)max;
+    struct iter_collect_ctx *ctx = udata;
+    ctx->seen[(uintptr_t)data]++;
+    ctx->count++;
+    return true;
+}
+
+void test_rtree_iter(void) {
+    int N = 10000;
+    double *coords;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    uint8_t *seen;
+    while (!(seen = xmalloc(N))) {}
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    struct rtree_iter *iter;
+    while (!(iter = rtree_iter_init(tr, NULL, NULL))) {}
+    assert(!rtree_iter_next(iter, NULL, NULL, NULL));
+    rtree_iter_free(iter);
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+        while (!rtree_insert(tr, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+
+    // the iterator must produce the same items as rtree_search
+    for (int i = 0; i < 100; i++) {
+        double target[4];
+        fill_rand_rect(target);
+        memset(seen, 0, N);
+        struct iter_collect_ctx ctx = { .seen = seen };
+        rtree_search(tr, &target[0], &target[2], iter_collect, &ctx);
+        while (!(iter = rtree_iter_init(tr, &target[0], &target[2]))) {}
+        size_t count = 0;
+        const double *min, *max;
+        const void *data;
+        while (rtree_iter_next(iter, &min, &max, &data)) {
+            size_t j = (uintptr_t)data;
+            assert(memcmp(min, &coords[j*4+0], sizeof(double)*2) == 0);
+            assert(memcmp(max, &coords[j*4+2], sizeof(double)*2) == 0);
+            assert(seen[j] == 1);
+            seen[j]++;
+            count++;
+        }
+        assert(count == ctx.count);
+        assert(!rtree_iter_next(iter, NULL, NULL, NULL));
+        rtree_iter_free(iter);
+    }
+
+    // interleave two iterators, while deleting every item from the tree
+    struct rtree_iter *iter2;
+    while (!(iter = rtree_iter_init(tr, NULL, NULL))) {}
+    while (!(iter2 = rtree_iter_init(tr, NULL, NULL))) {}
+    for (int i = 0; i < N; i++) {
+        while (!rtree_delete(tr, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+    assert(rtree_count(tr) == 0);
+    memset(seen, 0, N);
+    size_t count = 0;
+    while (1) {
+        const void *data, *data2;
+        bool ok = rtree_iter_next(iter, NULL, NULL, &data);
+        bool ok2 = rtree_iter_next(iter2, NULL, NULL, &data2);
+        assert(ok == ok2);
+        if (!ok) {
+            break;
+        }
+        assert(data == data2);
+        assert(seen[(uintptr_t)data] == 0);
+        seen[(uintptr_t)data] = 1;
+        count++;
+    }
+    assert(count == (size_t)N);
+    rtree_free(tr);
+    // the snapshot outlives the tree
+    assert(!rtree_iter_next(iter, NULL, NULL, NULL));
+    rtree_iter_free(iter2);
+    rtree_iter_free(iter);
+
+    xfree(seen);
+    xfree(coords);
+}
+
+struct iter_sum_ctx {
+    size_t count;
+    uint64_t sum;
+};
+
+bool iter_sum(const double *min, const double *max, const void *data,
+    void *udata)
+{
+    (void)min, (void)max;
+    struct iter_sum_ctx *ctx = udata;
+    ctx->count++;
+    ctx->sum += (uintptr_t)data;
+    return true;
+}
+
+struct iter_batch_ctx {
+    struct iter_sum_ctx *queries;
+    size_t count;
+    size_t limit;
+};
+
+bool iter_batch(const double *min, const double *max, const void *data,
+    size_t index, void *udata)
+{
+    struct iter_batch_ctx *ctx = udata;
+    iter_sum(min, max, data, &ctx->queries[index]);
+    ctx->count++;
+    return ctx->count < ctx->limit;
+}
+
+void test_rtree_batch(void) {
+    int N = 10000;
+    int Q = 1000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    for (int i = 0; i < N; i++) {
+        double coords[4];
+        fill_rand_rect(coords);
+        while (!rtree_insert(tr, &coords[0], &coords[2],
+            (void *)(uintptr_t)i)){}
+    }
+    double *mins, *maxs;
+    while (!(mins = xmalloc(sizeof(double)*Q*2))) {}
+    while (!(maxs = xmalloc(sizeof(double)*Q*2))) {}
+    for (int i = 0; i < Q; i++) {
+        double coords[4];
+        fill_rand_rect(coords);
+        memcpy(&mins[i*2], &coords[0], sizeof(double)*2);
+        memcpy(&maxs[i*2], &coords[2], sizeof(double)*2);
+    }
+    struct iter_sum_ctx *expect, *queries;
+    while (!(expect = xmalloc(sizeof(struct iter_sum_ctx)*Q))) {}
+    while (!(queries = xmalloc(sizeof(struct iter_sum_ctx)*Q))) {}
+    // Try different batch sizes, and search using points when odd.
+    int sizes[] = { 0, 1, 63, 64, 65, 130, Q };
+    for (int s = 0; s < (int)(sizeof(sizes)/sizeof(int)); s++) {
+        int n = sizes[s];
+        bool points = s % 2;
+        size_t total = 0;
+        for (int i = 0; i < n; i++) {
+            expect[i] = (struct iter_sum_ctx){ 0 };
+            rtree_search(tr, &mins[i*2], points ? NULL : &maxs[i*2],
+                iter_sum, &expect[i]);
+            total += expect[i].count;
+        }
+        memset(queries, 0, sizeof(struct iter_sum_ctx)*Q);
+        struct iter_batch_ctx ctx = { .queries = queries, .limit = SIZE_MAX };
+        rtree_search_batch(tr, mins, points ? NULL : maxs, n, iter_batch,
+            &ctx);
+        assert(ctx.count == total);
+        for (int i = 0; i < n; i++) {
+            assert(queries[i].count == expect[i].count);
+            assert(queries[i].sum == expect[i].sum);
+        }
+    }
+
+    // stop early
+    struct iter_batch_ctx ctx = { .queries = queries, .limit = 5 };
+    rtree_search_batch(tr, mins, maxs, Q, iter_batch, &ctx);
+    assert(ctx.count == 5);
+
+    rtree_free(tr);
+    xfree(queries);
+    xfree(expect);
+    xfree(maxs);
+    xfree(mins);
+}
+
+struct iter_parallel_ctx {
+    struct iter_sum_ctx threads[8];
+    atomic_int count;
+    int limit;
+};
+
+bool iter_parallel(const double *min, const double *max, const void *data,
+    int thread, void *udata)
+{
+    struct iter_parallel_ctx *ctx = udata;
+    assert(thread >= 0 && thread < 8);
+    iter_sum(min, max, data, &ctx->threads[thread]);
+    return atomic_fetch_add(&ctx->count, 1)+1 < ctx->limit;
+}
+
+void test_rtree_parallel(void) {
+    int N = 20000;
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    struct iter_parallel_ctx ctx = { .limit = INT_MAX };
+    rtree_search_parallel(tr, (double[2]){ -180, -90 }, (double[2]){ 180, 90 },
+        4, iter_parallel, &ctx);
+    assert(ctx.count == 0);
+    for (int i = 0; i < N; i++) {
+        double coords[4];
+        fill_rand_rect(coords);
+        while (!rtree_insert(tr, &coords[0], &coords[2],
+            (void *)(uintptr_t)i)){}
+    }
+    for (int i = 0; i < 50; i++) {
+        double target[4];
+        fill_rand_rect(target);
+        if (i == 0) {
+            // whole tree
+            target[0] = -180, target[1] = -90, target[2] = 180, target[3] = 90;
+        }
+        struct iter_sum_ctx expect = { 0 };
+        rtree_search(tr, &target[0], &target[2], iter_sum, &expect);
+        int nthreads = i%8+1;
+        memset(&ctx, 0, sizeof(struct iter_parallel_ctx));
+        ctx.limit = INT_MAX;
+        rtree_search_parallel(tr, &target[0], &target[2], nthreads,
+            iter_parallel, &ctx);
+        struct iter_sum_ctx total = { 0 };
+        for (int j = 0; j < 8; j++) {
+            assert(j < nthreads || ctx.threads[j].count == 0);
+            total.count += ctx.threads[j].count;
+            total.sum += ctx.threads[j].sum;
+        }
+        assert(total.count == expect.count);
+        assert(total.sum == expect.sum);
+    }
+
+    // stop early, each thread may deliver one more item after the stop
+    memset(&ctx, 0, sizeof(struct iter_parallel_ctx));
+    ctx.limit = 10;
+    rtree_search_parallel(tr, (double[2]){ -180, -90 }, (double[2]){ 180, 90 },
+        4, iter_parallel, &ctx);
+    assert(ctx.count >= 10 && ctx.count < 10+4);
+
+    rtree_free(tr);
+}
+
+struct concurrent_ctx {
+    struct rtree *tr;
+    double *coords;
+    int start;
+    int end;
+};
+
+// inserts the items of the thread, the first half using a hint of its own,
+// and then deletes every other one
+static void *concurrent_writer(void *udata) {
+    struct concurrent_ctx *ctx = udata;
+    double *coords = ctx->coords;
+    struct rtree_hint hint = { 0 };
+    for (int i = ctx->start; i < ctx->end; i++) {
+        if (i < (ctx->start+ctx->end)/2) {
+            while (!rtree_insert_hinted(ctx->tr, &hint, &coords[i*4+0], 
+                &coords[i*4+2], (void *)(uintptr_t)i)){}
+        } else {
+            while (!rtree_insert(ctx->tr, &coords[i*4+0], &coords[i*4+2],
+                (void *)(uintptr_t)i)){}
+        }
+    }
+    for (int i = ctx->start; i < ctx->end; i += 2) {
+        while (!rtree_delete(ctx->tr, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+    return NULL;
+}
+
+// deletes the items of the thread, some of which may already be deleted
+static void *concurrent_deleter(void *udata) {
+    struct concurrent_ctx *ctx = udata;
+    double *coords = ctx->coords;
+    for (int i = ctx->start; i < ctx->end; i++) {
+        while (!rtree_delete(ctx->tr, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+    return NULL;
+}
+
+static void concurrent_writers(bool rstar, bool slab) {
+    int N = 20000;
+    int NTHREADS = 4;
+    double *coords;
+    while (!(coords = xmalloc(sizeof(double)*4*N))){}
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+    }
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    if (rstar) {
+        rtree_opt_rstar(tr);
+    }
+    if (slab) {
+        while (!rtree_opt_slab_allocator(tr)){}
+    }
+    assert(rtree_opt_concurrent(tr));
+
+    // a few items first, which are shared with a clone, so that the writers 
+    // copy the nodes that they change
+    int M = N/10;
+    for (int i = 0; i < M; i++) {
+        while (!rtree_insert(tr, &coords[i*4+0], &coords[i*4+2], 
+            (void *)(uintptr_t)i)){}
+    }
+    struct rtree *tr2;
+    while (!(tr2 = rtree_clone(tr))){}
+
+    pthread_t threads[NTHREADS];
+    struct concurrent_ctx ctxs[NTHREADS];
+    for (int i = 0; i < NTHREADS; i++) {
+        ctxs[i] = (struct concurrent_ctx){ 
+            .tr = tr,
+            .coords = coords,
+            .start = M+(N-M)*i/NTHREADS,
+            .end = M+(N-M)*(i+1)/NTHREADS,
+        };
+        assert(!pthread_create(&threads[i], NULL, concurrent_writer, 
+            &ctxs[i]));
+    }
+    for (int i = 0; i < NTHREADS; i++) {
+        assert(!pthread_join(threads[i], NULL));
+    }
+    assert(rtree_check(tr));
+    assert(rtree_check(tr2));
+    assert(rtree_count(tr2) == (size_t)M);
+    int count = M;
+    for (int i = 0; i < NTHREADS; i++) {
+        count += (ctxs[i].end-ctxs[i].start)/2;
+    }
+    assert(rtree_count(tr) == (size_t)count);
+    for (int i = M; i < N; i++) {
+        bool deleted = false;
+        for (int j = 0; j < NTHREADS; j++) {
+            if (i >= ctxs[j].start && i < ctxs[j].end) {
+                deleted = (i-ctxs[j].start)%2 == 0;
+            }
+        }
+        assert(find_one(tr, &coords[i*4+0], &coords[i*4+2], 
+            (void *)(uintptr_t)i, NULL, NULL) == !deleted);
+        assert(!find_one(tr2, &coords[i*4+0], &coords[i*4+2], 
+            (void *)(uintptr_t)i, NULL, NULL));
+    }
+    rtree_free(tr2);
+
+    // delete the rest, from many threads too
+    for (int i = 0; i < NTHREADS; i++) {
+        ctxs[i] = (struct concurrent_ctx){ 
+            .tr = tr,
+            .coords = coords,
+            .start = N*i/NTHREADS,
+            .end = N*(i+1)/NTHREADS,
+        };
+    }
+    for (int i = 0; i < NTHREADS; i++) {
+        assert(!pthread_create(&threads[i], NULL, concurrent_deleter, 
+            &ctxs[i]));
+    }
+    for (int i = 0; i < NTHREADS; i++) {
+        assert(!pthread_join(threads[i], NULL));
+    }
+    assert(rtree_count(tr) == 0);
+    assert(rtree_check(tr));
+    rtree_free(tr);
+    xfree(coords);
+}
+
+void test_rtree_concurrent(void) {
+    concurrent_writers(false, false);
+    concurrent_writers(true, true);
+}
+
+struct concurrent_update_ctx {
+    struct rtree *tr;
+    double *coords;
+    double *coords2;
+    int start;
+    int end;
+};
+
+// moves the items of the thread to their new rects
+static void *concurrent_updater(void *udata) {
+    struct concurrent_update_ctx *ctx = udata;
+    for (int i = ctx->start; i < ctx->end; i++) {
+        while (!rtree_update(ctx->tr, &ctx->coords[i*4+0], 
+            &ctx->coords[i*4+2], &ctx->coords2[i*4+0], &ctx->coords2[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+    return NULL;
+}
+
+void test_rtree_concurrent_update(void) {
+    int N = 20000;
+    int NTHREADS = 4;
+    double *coords;
+    double *coords2;
+    while (!(coords = xmalloc(sizeof(double)*4*N))){}
+    while (!(coords2 = xmalloc(sizeof(double)*4*N))){}
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+        fill_rand_rect(&coords2[i*4]);
+    }
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    assert(rtree_opt_concurrent(tr));
+    for (int i = 0; i < N; i++) {
+        while (!rtree_insert(tr, &coords[i*4+0], &coords[i*4+2], 
+            (void *)(uintptr_t)i)){}
+    }
+
+    // an item that is not in the rtree is not moved into it
+    while (!rtree_update(tr, &coords2[0], &coords2[2], &coords[0], &coords[2],
+        (void *)(uintptr_t)0)){}
+    while (!rtree_update(tr, &coords[0], &coords[2], &coords2[0], &coords2[2],
+        (void *)(uintptr_t)N)){}
+    assert(rtree_count(tr) == (size_t)N);
+    assert(find_exact(tr, &coords[0], (void *)(uintptr_t)0) == 1);
+    assert(find_exact(tr, &coords2[0], (void *)(uintptr_t)N) == 0);
+
+    pthread_t threads[NTHREADS];
+    struct concurrent_update_ctx ctxs[NTHREADS];
+    for (int i = 0; i < NTHREADS; i++) {
+        ctxs[i] = (struct concurrent_update_ctx){ 
+            .tr = tr,
+            .coords = coords,
+            .coords2 = coords2,
+            .start = N*i/NTHREADS,
+            .end = N*(i+1)/NTHREADS,
+        };
+        assert(!pthread_create(&threads[i], NULL, concurrent_updater, 
+            &ctxs[i]));
+    }
+    for (int i = 0; i < NTHREADS; i++) {
+        assert(!pthread_join(threads[i], NULL));
+    }
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_check(tr));
+    for (int i = 0; i < N; i++) {
+        assert(find_exact(tr, &coords2[i*4], (void *)(uintptr_t)i) == 1);
+        assert(find_exact(tr, &coords[i*4], (void *)(uintptr_t)i) == 0);
+    }
+    rtree_free(tr);
+    xfree(coords2);
+    xfree(coords);
+}
+
+struct join_ctx {
+    const double *coords1;
+    const double *coords2;
+    int *counts;    // the number of pairs for each item of the first rtree
+    bool swapped;   // the first rtree was passed second
+    size_t count;
+    size_t limit;
+};
+
+static bool join_iter(const double *min1, const double *max1, 
+    const void *data1, const double *min2, const double *max2, 
+    const void *data2, void *udata)
+{
+    struct join_ctx *ctx = udata;
+    if (ctx->swapped) {
+        const double *tmp = min1; min1 = min2; min2 = tmp;
+        tmp = max1; max1 = max2; max2 = tmp;
+        const void *tmp2 = data1; data1 = data2; data2 = tmp2;
+    }
+    int i = (int)(uintptr_t)data1;
+    int j = (int)(uintptr_t)data2;
+    assert(memcmp(min1, &ctx->coords1[i*4+0], sizeof(double)*2) == 0);
+    assert(memcmp(max1, &ctx->coords1[i*4+2], sizeof(double)*2) == 0);
+    assert(memcmp(min2, &ctx->coords2[j*2], sizeof(double)*2) == 0);
+    assert(memcmp(max2, &ctx->coords2[j*2], sizeof(double)*2) == 0);
+    ctx->counts[i]++;
+    ctx->count++;
+    return ctx->count != ctx->limit;
+}
+
+// Joins rects with points, with the rtrees on either side, and compares the
+// pairs to searching the points for each rect.
+void test_rtree_join(void) {
+    int N1 = 1000;
+    int N2 = 50000;
+    double *coords1;
+    double *coords2;
+    int *counts;
+    int *expect;
+    while (!(coords1 = xmalloc(sizeof(double)*N1*4))) {}
+    while (!(coords2 = xmalloc(sizeof(double)*N2*2))) {}
+    while (!(counts = xmalloc(sizeof(int)*N1))) {}
+    while (!(expect = xmalloc(sizeof(int)*N1))) {}
+    for (int i = 0; i < N1; i++) {
+        fill_rand_rect(&coords1[i*4]);
+        coords1[i*4+2] += rand_double()*5;
+        coords1[i*4+3] += rand_double()*5;
+    }
+    for (int i = 0; i < N2; i++) {
+        coords2[i*2+0] = rand_double()*360-180;
+        coords2[i*2+1] = rand_double()*180-90;
+    }
+    struct rtree *tr1;
+    struct rtree *tr2;
+    struct rtree *tr3;
+    while (!(tr1 = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!(tr2 = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!(tr3 = rtree_new_with_allocator(xmalloc, xfree))){}
+    for (int i = 0; i < N1; i++) {
+        while (!rtree_insert(tr1, &coords1[i*4+0], &coords1[i*4+2], 
+            (void *)(uintptr_t)i)){}
+    }
+    for (int i = 0; i < N2; i++) {
+        while (!rtree_insert(tr2, &coords2[i*2], NULL, (void *)(uintptr_t)i)){}
+    }
+    size_t total = 0;
+    for (int i = 0; i < N1; i++) {
+        struct iter_scan_all_ctx ctx = { 0 };
+        rtree_search(tr2, &coords1[i*4+0], &coords1[i*4+2], iter_scan_all, 
+            &ctx);
+        expect[i] = (int)ctx.count;
+        total += ctx.count;
+    }
+    assert(total > 0);
+    for (int j = 0; j < 2; j++) {
+        memset(counts, 0, sizeof(int)*N1);
+        struct join_ctx ctx = { .coords1 = coords1, .coords2 = coords2, 
+            .counts = counts, .swapped = j == 1 };
+        if (j == 0) {
+            rtree_join(tr1, tr2, join_iter, &ctx);
+        } else {
+            rtree_join(tr2, tr1, join_iter, &ctx);
+        }
+        assert(ctx.count == total);
+        assert(memcmp(counts, expect, sizeof(int)*N1) == 0);
+    }
+
+    // stop early
+    struct join_ctx ctx = { .coords1 = coords1, .coords2 = coords2, 
+        .counts = counts, .limit = 10 };
+    rtree_join(tr1, tr2, join_iter, &ctx);
+    assert(ctx.count == 10);
+
+    // an empty rtree has no pairs
+    ctx.limit = 0;
+    ctx.count = 0;
+    rtree_join(tr1, tr3, join_iter, &ctx);
+    rtree_join(tr3, tr2, join_iter, &ctx);
+    assert(ctx.count == 0);
+
+    rtree_free(tr1);
+    rtree_free(tr2);
+    rtree_free(tr3);
+    xfree(expect);
+    xfree(counts);
+    xfree(coords2);
+    xfree(coords1);
+}
+
+struct self_join_ctx {
+    const double *coords;
+    int *counts[8];     // the number of pairs for each item, by thread
+    atomic_int count;
+    int limit;
+};
+
+static bool self_join_pair(struct self_join_ctx *ctx, const double *min1, 
+    const double *max1, const void *data1, const double *min2, 
+    const double *max2, const void *data2, int thread)
+{
+    int i = (int)(uintptr_t)data1;
+    int j = (int)(uintptr_t)data2;
+    assert(i != j);
+    assert(memcmp(min1, &ctx->coords[i*4+0], sizeof(double)*2) == 0);
+    assert(memcmp(max1, &ctx->coords[i*4+2], sizeof(double)*2) == 0);
+    assert(memcmp(min2, &ctx->coords[j*4+0], sizeof(double)*2) == 0);
+    assert(memcmp(max2, &ctx->coords[j*4+2], sizeof(double)*2) == 0);
+    ctx->counts[thread][i]++;
+    ctx->counts[thread][j]++;
+    return atomic_fetch_add(&ctx->count, 1)+1 < ctx->limit;
+}
+
+static bool self_join_iter(const double *min1, const double *max1, 
+    const void *data1, const double *min2, const double *max2, 
+    const void *data2, void *udata)
+{
+    return self_join_pair(udata, min1, max1, data1, min2, max2, data2, 0);
+}
+
+static bool self_join_iter_parallel(const double *min1, const double *max1, 
+    const void *data1, const double *min2, const double *max2, 
+    const void *data2, int thread, void *udata)
+{
+    assert(thread >= 0 && thread < 8);
+    return self_join_pair(udata, min1, max1, data1, min2, max2, data2, thread);
+}
+
+// Compares the pairs of a self join to searching the rtree for each item,
+// where each pair is found twice, and each item finds itself too.
+void test_rtree_self_join(void) {
+    int N = 5000;
+    double *coords;
+    int *expect;
+    int *counts;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    while (!(expect = xmalloc(sizeof(int)*N))) {}
+    while (!(counts = xmalloc(sizeof(int)*N*8))) {}
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    struct self_join_ctx ctx = { .coords = coords, .limit = INT_MAX };
+    for (int i = 0; i < 8; i++) {
+        ctx.counts[i] = &counts[i*N];
+    }
+    rtree_self_join(tr, self_join_iter, &ctx);
+    rtree_self_join_parallel(tr, 4, self_join_iter_parallel, &ctx);
+    assert(ctx.count == 0);
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+        coords[i*4+2] += rand_double()*3;
+        coords[i*4+3] += rand_double()*3;
+        if (i%100 == 1) {
+            // a duplicate
+            memcpy(&coords[i*4], &coords[(i-1)*4], sizeof(double)*4);
+        }
+        while (!rtree_insert(tr, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+    int total = 0;
+    for (int i = 0; i < N; i++) {
+        struct iter_scan_all_ctx sctx = { 0 };
+        rtree_search(tr, &coords[i*4+0], &coords[i*4+2], iter_scan_all, 
+            &sctx);
+        expect[i] = (int)sctx.count-1;
+        total += expect[i];
+    }
+    assert(total > 0 && total%2 == 0);
+    for (int nthreads = 0; nthreads <= 8; nthreads++) {
+        memset(counts, 0, sizeof(int)*N*8);
+        ctx.count = 0;
+        if (nthreads == 0) {
+            rtree_self_join(tr, self_join_iter, &ctx);
+        } else {
+            rtree_self_join_parallel(tr, nthreads, self_join_iter_parallel, 
+                &ctx);
+        }
+        assert(ctx.count == total/2);
+        for (int i = 0; i < N; i++) {
+            int count = 0;
+            for (int j = 0; j < 8; j++) {
+                assert(j < nthreads || j == 0 || ctx.counts[j][i] == 0);
+                count += ctx.counts[j][i];
+            }
+            assert(count == expect[i]);
+        }
+    }
+
+    // stop early, each thread may deliver one more pair after the stop
+    ctx.count = 0;
+    ctx.limit = 10;
+    rtree_self_join(tr, self_join_iter, &ctx);
+    assert(ctx.count == 10);
+    ctx.count = 0;
+    rtree_self_join_parallel(tr, 4, self_join_iter_parallel, &ctx);
+    assert(ctx.count >= 10 && ctx.count < 10+4);
+
+    rtree_free(tr);
+    xfree(counts);
+    xfree(expect);
+    xfree(coords);
+}
+
+struct iter_nearby_ctx {
+    size_t count;
+    double last;
+    bool sorted;
+    double *dists;
+};
+
+bool iter_nearby(const double *min, const double *max, const void *data,
+    double dist, void *udata)
+{
+    (void)min, (void)max, (void)data;
+    struct iter_nearby_ctx *ctx = udata;
+    if (dist < ctx->last) {
+        ctx->sorted = false;
+    }
+    ctx->last = dist;
+    ctx->dists[ctx->count++] = dist;
+    return true;
+}
+
+static double box_dist(const double *min, const double *max,
+    const double *tmin, const double *tmax)
+{
+    double dist = 0;
+    for (int i = 0; i < 2; i++) {
+        double d = 0;
+        if (min[i] > tmax[i]) {
+            d = min[i] - tmax[i];
+        } else if (max[i] < tmin[i]) {
+            d = tmin[i] - max[i];
+        }
+        dist += d*d;
+    }
+    return sqrt(dist);
+}
+
+// Manhattan distance to the point in udata
+static double manhattan_dist(const double *min, const double *max,
+    const void *data, bool item, void *udata)
+{
+    (void)data, (void)item;
+    double *point = udata;
+    double dist = 0;
+    for (int i = 0; i < 2; i++) {
+        if (min[i] > point[i]) {
+            dist += min[i] - point[i];
+        } else if (max[i] < point[i]) {
+            dist += point[i] - max[i];
+        }
+    }
+    return dist;
+}
+
+struct iter_manhattan_ctx {
+    double point[2];
+    size_t count;
+    double last;
+    bool sorted;
+};
+
+bool iter_manhattan(const double *min, const double *max, const void *data,
+    double dist, void *udata)
+{
+    (void)data;
+    struct iter_manhattan_ctx *ctx = udata;
+    assert(dist == manhattan_dist(min, max, NULL, true, ctx->point));
+    if (dist < ctx->last) {
+        ctx->sorted = false;
+    }
+    ctx->last = dist;
+    ctx->count++;
+    return true;
+}
+
+bool iter_nearby_two(const double *min, const double *max, const void *data,
+    double dist, void *udata)
+{
+    (void)dist;
+    return iter_two(min, max, data, udata);
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(double*)a;
+    double y = *(double*)b;
+    return x < y ? -1 : x > y;
+}
+
+void test_rtree_nearby(void) {
+    int N = 10000;
+    double *coords;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    double *dists;
+    while (!(dists = xmalloc(sizeof(double)*N))) {}
+    double *found;
+    while (!(found = xmalloc(sizeof(double)*N))) {}
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    struct iter_nearby_ctx ctx = { .dists = found };
+    assert(rtree_knn(tr, (double[2]){ 0, 0 }, NULL, 10, iter_nearby, &ctx));
+    assert(ctx.count == 0);
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+        while (!rtree_insert(tr, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+    for (int i = 0; i < 20; i++) {
+        double target[4];
+        fill_rand_rect(target);
+        for (int j = 0; j < N; j++) {
+            dists[j] = box_dist(&coords[j*4+0], &coords[j*4+2],
+                &target[0], &target[2]);
+        }
+        qsort(dists, N, sizeof(double), compare_doubles);
+        size_t k = i == 0 ? (size_t)N : (size_t)(rand()%100);
+        do {
+            ctx = (struct iter_nearby_ctx){ .sorted = true, .dists = found };
+        } while (!rtree_knn(tr, &target[0], &target[2], k, iter_nearby,
+            &ctx));
+        assert(ctx.sorted);
+        assert(ctx.count == k);
+        for (size_t j = 0; j < k; j++) {
+            assert(fabs(found[j]-dists[j]) < 1e-9);
+        }
+    }
+
+    // stop early
+    struct iter_two_ctx ctx1;
+    do {
+        ctx1 = (struct iter_two_ctx){ 0 };
+    } while (!rtree_knn(tr, (double[2]){ 0, 0 }, NULL, 10,
+        iter_nearby_two, &ctx1));
+    assert(ctx1.count == 2);
+
+    // custom metric
+    // The point is the first field of the context, which is shared by the
+    // dist and iter callbacks.
+    struct iter_manhattan_ctx ctx2;
+    do {
+        ctx2 = (struct iter_manhattan_ctx){ .point = { 10, 10 },
+            .sorted = true };
+    } while (!rtree_nearby(tr, manhattan_dist, iter_manhattan, &ctx2));
+    assert(ctx2.sorted);
+    assert(ctx2.count == (size_t)N);
+
+    rtree_free(tr);
+    xfree(found);
+    xfree(dists);
+    xfree(coords);
+}
+
+// in-memory stream for rtree_save and rtree_restore
+struct mstream {
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t pos;
+};
+
+bool mstream_write(const void *data, size_t size, void *udata) {
+    struct mstream *ms = udata;
+    if (ms->len+size > ms->cap) {
+        size_t cap = ms->cap == 0 ? 1024 : ms->cap;
+        while (ms->len+size > cap) {
+            cap *= 2;
+        }
+        char *data2 = xmalloc(cap);
+        if (!data2) {
+            return false;
+        }
+        if (ms->data) {
+            memcpy(data2, ms->data, ms->len);
+            xfree(ms->data);
+        }
+        ms->data = data2;
+        ms->cap = cap;
+    }
+    memcpy(ms->data+ms->len, data, size);
+    ms->len += size;
+    return true;
+}
+
+bool mstream_read(void *data, size_t size, void *udata) {
+    struct mstream *ms = udata;
+    if (ms->pos+size > ms->len) {
+        return false;
+    }
+    memcpy(data, ms->data+ms->pos, size);
+    ms->pos += size;
+    return true;
+}
+
+bool item_write_u64(const void *item, void *udata) {
+    uint64_t x = (uintptr_t)item*3;
+    return mstream_write(&x, sizeof(uint64_t), udata);
+}
+
+bool item_read_u64(void **item, void *udata) {
+    uint64_t x;
+    if (!mstream_read(&x, sizeof(uint64_t), udata)) {
+        return false;
+    }
+    *item = (void *)(uintptr_t)(x/3);
+    return true;
+}
+
+static void check_restored(struct rtree *tr, const double *coords, int N,
+    uint8_t *seen)
+{
+    assert(rtree_check(tr));
+    assert(rtree_count(tr) == (size_t)N);
+    memset(seen, 0, N);
+    struct iter_collect_ctx ctx = { .seen = seen };
+    rtree_scan(tr, iter_collect, &ctx);
+    assert(ctx.count == (size_t)N);
+    for (int i = 0; i < N; i++) {
+        assert(seen[i] == 1);
+        assert(find_one(tr, &coords[i*4+0], &coords[i*4+2], 
+            (void *)(uintptr_t)i, NULL, NULL));
+    }
+}
+
+static void save_restore(int N) {
+    double *coords;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    uint8_t *seen;
+    while (!(seen = xmalloc(N))) {}
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+        while (!rtree_insert(tr, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+
+    // round trip using the raw item data
+    struct mstream ms = { 0 };
+    while (!rtree_save(tr, mstream_write, NULL, &ms)) {
+        ms.len = 0;
+    }
+    struct rtree *tr2;
+    while (!(tr2 = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_restore(tr2, mstream_read, NULL, &ms)) {
+        assert(rtree_count(tr2) == 0);
+        ms.pos = 0;
+    }
+    assert(ms.pos == ms.len);
+    check_restored(tr2, coords, N, seen);
+
+    // the restored tree has the same structure, and the same rects unless
+    // the branch rects are quantized, which rounds them again
+    struct mstream ms2 = { 0 };
+    while (!rtree_save(tr2, mstream_write, NULL, &ms2)) {
+        ms2.len = 0;
+    }
+    assert(ms2.len == ms.len);
+#ifndef RTREE_QUANTBRANCH
+    assert(memcmp(ms2.data, ms.data, ms.len) == 0);
+#endif
+    xfree(ms2.data);
+
+    // only empty trees can be restored into
+    ms.pos = 0;
+    assert(!rtree_restore(tr2, mstream_read, NULL, &ms));
+    assert(rtree_count(tr2) == (size_t)N);
+
+    // the restored tree can be modified
+    for (int i = 0; i < N; i++) {
+        while (!rtree_delete(tr2, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+        assert(rtree_count(tr2) == (size_t)(N-i-1));
+    }
+    assert(rtree_check(tr2));
+    rtree_free(tr2);
+
+    // truncated or corrupted data cannot be restored
+    for (size_t n = 0; n < ms.len; n += ms.len/50+1) {
+        struct mstream ms3 = { .data = ms.data, .len = n };
+        while (!(tr2 = rtree_new_with_allocator(xmalloc, xfree))){}
+        assert(!rtree_restore(tr2, mstream_read, NULL, &ms3));
+        assert(rtree_count(tr2) == 0);
+        rtree_free(tr2);
+    }
+    while (!(tr2 = rtree_new_with_allocator(xmalloc, xfree))){}
+    ms.data[6]++; // version
+    ms.pos = 0;
+    assert(!rtree_restore(tr2, mstream_read, NULL, &ms));
+    ms.data[6]--;
+    ms.pos = 0;
+    assert(!rtree_restore(tr2, mstream_read, item_read_u64, &ms));
+    assert(rtree_count(tr2) == 0);
+
+    // round trip using the item callbacks
+    ms.len = 0;
+    while (!rtree_save(tr, mstream_write, item_write_u64, &ms)) {
+        ms.len = 0;
+    }
+    ms.pos = 0;
+    assert(!rtree_restore(tr2, mstream_read, NULL, &ms));
+    do {
+        ms.pos = 0;
+    } while (!rtree_restore(tr2, mstream_read, item_read_u64, &ms));
+    check_restored(tr2, coords, N, seen);
+    rtree_free(tr2);
+
+    // empty trees
+    rtree_free(tr);
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    ms.len = 0;
+    while (!rtree_save(tr, mstream_write, NULL, &ms)) {
+        ms.len = 0;
+    }
+    while (!(tr2 = rtree_new_with_allocator(xmalloc, xfree))){}
+    ms.pos = 0;
+    assert(rtree_restore(tr2, mstream_read, NULL, &ms));
+    assert(rtree_count(tr2) == 0);
+    rtree_free(tr2);
+    rtree_free(tr);
+
+    xfree(ms.data);
+    xfree(seen);
+    xfree(coords);
+}
+
+void test_rtree_save(void) {
+    save_restore(10000);
+}
+
+void test_rtree_save_oom(void) {
+    // small enough for a restore to succeed with failing mallocs
+    save_restore(20);
+}
+
+void test_rtree_index_load(void) {
+    int N = 10000;
+    double *mins;
+    double *maxs;
+    void **datas;
+    while (!(mins = xmalloc(sizeof(double)*N*2))) {}
+    while (!(maxs = xmalloc(sizeof(double)*N*2))) {}
+    while (!(datas = xmalloc(sizeof(void*)*N))) {}
+    for (int i = 0; i < N; i++) {
+        double rect[4];
+        fill_rand_rect(rect);
+        memcpy(&mins[i*2], &rect[0], sizeof(double)*2);
+        memcpy(&maxs[i*2], &rect[2], sizeof(double)*2);
+        datas[i] = (void *)(uintptr_t)i;
+    }
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_opt_index(tr, NULL, NULL)){}
+    while (!rtree_load(tr, mins, maxs, datas, N)){}
+    assert(rtree_count(tr) == (size_t)N);
+    assert(rtree_check(tr));
+    for (int i = 0; i < N; i += 2) {
+        while (!rtree_delete_indexed(tr, datas[i])){}
+    }
+    while (!rtree_compact(tr)){}
+    assert(rtree_count(tr) == (size_t)N/2);
+    assert(rtree_check(tr));
+
+    // the restored items are indexed
+    struct mstream ms = { 0 };
+    while (!rtree_save(tr, mstream_write, NULL, &ms)) {
+        ms.len = 0;
+    }
+    struct rtree *tr2;
+    while (!(tr2 = rtree_new_with_allocator(xmalloc, xfree))){}
+    while (!rtree_opt_index(tr2, NULL, NULL)){}
+    while (!rtree_restore(tr2, mstream_read, NULL, &ms)) {
+        ms.pos = 0;
+    }
+    assert(rtree_count(tr2) == (size_t)N/2);
+    assert(rtree_check(tr2));
+    for (int i = 1; i < N; i += 2) {
+        while (!rtree_delete_indexed(tr2, datas[i])){}
+    }
+    assert(rtree_count(tr2) == 0);
+    assert(rtree_check(tr2));
+    rtree_free(tr2);
+    rtree_free(tr);
+    xfree(ms.data);
+    xfree(datas);
+    xfree(maxs);
+    xfree(mins);
+}
+
+void test_rtree_packed(void) {
+    int N = 10000;
+    double *coords;
+    while (!(coords = xmalloc(sizeof(double)*N*4))) {}
+    uint8_t *seen, *seen2;
+    while (!(seen = xmalloc(N))) {}
+    while (!(seen2 = xmalloc(N))) {}
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+
+    // empty tree
+    struct mstream ms = { 0 };
+    while (!rtree_pack(tr, mstream_write, &ms)) {
+        ms.len = 0;
+    }
+    const struct rtree_packed *pk = rtree_packed_open(ms.data, ms.len);
+    assert(pk);
+    assert(rtree_packed_count(pk) == 0);
+    struct iter_scan_all_ctx ctx0 = { 0 };
+    rtree_packed_scan(pk, iter_scan_all, &ctx0);
+    assert(ctx0.count == 0);
+
+    for (int i = 0; i < N; i++) {
+        fill_rand_rect(&coords[i*4]);
+        while (!rtree_insert(tr, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i)){}
+    }
+    ms.len = 0;
+    while (!rtree_pack(tr, mstream_write, &ms)) {
+        ms.len = 0;
+    }
+    pk = rtree_packed_open(ms.data, ms.len);
+    assert(pk);
+    assert(rtree_packed_count(pk) == (size_t)N);
+
+    // scan all items, and stop after two
+    memset(seen, 0, N);
+    struct iter_collect_ctx ctx = { .seen = seen };
+    rtree_packed_scan(pk, iter_collect, &ctx);
+    assert(ctx.count == (size_t)N);
+    for (int i = 0; i < N; i++) {
+        assert(seen[i] == 1);
+    }
+    struct iter_two_ctx ctx1 = { 0 };
+    rtree_packed_scan(pk, iter_two, &ctx1);
+    assert(ctx1.count == 2);
+    ctx1.count = 0;
+    rtree_packed_search(pk, (double[2]){ -180.0, -90.0 },
+        (double[2]){ 180.0, 90.0 }, iter_two, &ctx1);
+    assert(ctx1.count == 2);
+
+    // searches match the rtree
+    for (int i = 0; i < 100; i++) {
+        double target[4];
+        fill_rand_rect(target);
+        memset(seen, 0, N);
+        memset(seen2, 0, N);
+        struct iter_collect_ctx ctx = { .seen = seen };
+        struct iter_collect_ctx ctx2 = { .seen = seen2 };
+        rtree_search(tr, &target[0], &target[2], iter_collect, &ctx);
+        rtree_packed_search(pk, &target[0], &target[2], iter_collect, &ctx2);
+        assert(ctx.count == ctx2.count);
+        assert(memcmp(seen, seen2, N) == 0);
+    }
+    for (int i = 0; i < N; i += 97) {
+        assert(find_one(tr, &coords[i*4+0], &coords[i*4+2],
+            (void *)(uintptr_t)i, NULL, NULL));
+        memset(seen, 0, N);
+        struct iter_collect_ctx ctx = { .seen = seen };
+        rtree_packed_search(pk, &coords[i*4+0], &coords[i*4+2], iter_collect,
+            &ctx);
+        assert(seen[i] == 1);
+    }
+
+    // search directly from a memory-mapped file
+    FILE *f = tmpfile();
+    assert(f);
+    assert(fwrite(ms.data, 1, ms.len, f) == ms.len);
+    assert(fflush(f) == 0);
+    void *addr = mmap(NULL, ms.len, PROT_READ, MAP_SHARED, fileno(f), 0);
+    assert(addr != MAP_FAILED);
+    pk = rtree_packed_open(addr, ms.len);
+    assert(pk);
+    memset(seen, 0, N);
+    ctx = (struct iter_collect_ctx){ .seen = seen };
+    rtree_packed_scan(pk, iter_collect, &ctx);
+    assert(ctx.count == (size_t)N);
+    assert(munmap(addr, ms.len) == 0);
+    fclose(f);
+
+    // invalid images
+    assert(!rtree_packed_open(ms.data, ms.len-1));
+    assert(!rtree_packed_open(ms.data, 8));
+    ms.data[6]++; // version
+    assert(!rtree_packed_open(ms.data, ms.len));
+    ms.data[6]--;
+
+    // corrupt nodes are skipped
+    for (size_t i = 200; i < ms.len; i += 61) {
+        ms.data[i] ^= 0x5A;
+    }
+    pk = rtree_packed_open(ms.data, ms.len);
+    assert(pk);
+    ctx0.count = 0;
+    rtree_packed_scan(pk, iter_scan_all, &ctx0);
+    assert(ctx0.count < (size_t)N);
+    rtree_packed_search(pk, (double[2]){ -180.0, -90.0 },
+        (double[2]){ 180.0, 90.0 }, iter_scan_all, &ctx0);
+
+    rtree_free(tr);
+    xfree(ms.data);
+    xfree(seen2);
+    xfree(seen);
+    xfree(coords);
+}
+
+// Coordinates that are closer together than a float can tell apart, or are
+// beyond the range of a float, must be found exactly, also when the branch
+// rects are stored as floats.
+void test_rtree_precision(void) {
+    int N = 1000;
+    double *coords;
+    while (!(coords = xmalloc(sizeof(double)*N*2))) {}
+    struct rtree *tr;
+    while (!(tr = rtree_new_with_allocator(xmalloc, xfree))){}
+    for (int i = 0; i < N; i++) {
+        coords[i*2+0] = 1.0 + (i/10)*1e-12;
+        coords[i*2+1] = i%10 == 0 ? 1e300 : i%10 == 1 ? -1e300 : 
+            -0.1 + (i%10)*1e-13;
+    }
+    shuffle(coords, N, sizeof(double)*2);
+    for (int i = 0; i < N; i++) {
+        while (!rtree_insert(tr, &coords[i*2], NULL, &coords[i*2])){}
+    }
+    assert(rtree_check(tr));
+    for (int i = 0; i < N; i++) {
+        struct iter_scan_all_ctx ctx = { 0 };
+        rtree_search(tr, &coords[i*2], NULL, iter_scan_all, &ctx);
+        assert(ctx.count == 1);
+        assert(find_one(tr, &coords[i*2], NULL, &coords[i*2], NULL, NULL));
+    }
+    for (int i = 0; i < N; i += 2) {
+        while (!rtree_delete(tr, &coords[i*2], NULL, &coords[i*2])){}
+        assert(rtree_check(tr));
+    }
+    for (int i = 0; i < N; i++) {
+        assert(find_one(tr, &coords[i*2], NULL, &coords[i*2], NULL, NULL) ==
+            (i%2 == 1));
+    }
+    rtree_free(tr);
+    xfree(coords);
+}
+
 void test_rtree_various(void) {
     struct rtree *tr = rtree_new();
     assert(tr);
@@ -263,8 +2002,31 @@ void test_rtree_various(void) {
 int main(int argc, char **argv) {
     seedrand();
     do_chaos_test(test_rtree_ops);
+    do_chaos_test(test_rtree_ops_slab);
+    do_chaos_test(test_rtree_ops_rstar);
+    do_chaos_test(test_rtree_hinted);
+    do_chaos_test(test_rtree_delete_area);
+    do_chaos_test(test_rtree_update);
+    do_chaos_test(test_rtree_index);
+    do_chaos_test(test_rtree_slab);
     do_chaos_test(test_rtree_cities_svg);
     do_chaos_test(test_rtree_predef_svg);
+    do_test(test_rtree_load);
+    do_chaos_test(test_rtree_iter);
+    do_chaos_test(test_rtree_batch);
+    do_chaos_test(test_rtree_parallel);
+#ifndef RTREE_NOATOMICS
+    do_chaos_test(test_rtree_concurrent);
+    do_chaos_test(test_rtree_concurrent_update);
+#endif
+    do_chaos_test(test_rtree_join);
+    do_chaos_test(test_rtree_self_join);
+    do_chaos_test(test_rtree_nearby);
+    do_test(test_rtree_save);
+    do_chaos_test(test_rtree_save_oom);
+    do_test(test_rtree_index_load);
+    do_chaos_test(test_rtree_packed);
+    do_chaos_test(test_rtree_precision);
     do_test(test_rtree_various);
 
     return 0;
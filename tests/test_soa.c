@@ -0,0 +1,15 @@
+#include "tests.h"
+
+// The tests of test_generic.c, with a specialization of the rtree that stores
+// the rects of each node as a structure of arrays, see RTREE_SOA. Its symbols
+// are prefixed with rtree2s, keeping them apart from the default rtree.c that
+// is linked in too.
+#define RTREE_PREFIX rtree2s
+#define RTREE_DATATYPE int
+#undef RTREE_SOA
+#undef RTREE_POINTS
+#undef RTREE_FLOATBRANCH
+#undef RTREE_QUANTBRANCH
+#define RTREE_SOA
+#define GENERIC_NAME test_soa
+#include "test_generic.c"
@@ -13,6 +13,7 @@
 #include <time.h>
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include "../rtree.h"
 
 #ifdef __clang__
@@ -27,6 +28,7 @@
 // private rtree functions
 bool rtree_check(struct rtree *tr);
 void rtree_write_svg(struct rtree *tr, const char *path);
+void rtree_node_sizes(size_t *leaf, size_t *branch);
 
 int64_t crand(void) {
     uint64_t seed = 0;
@@ -64,7 +66,8 @@ static int64_t seed = 0;
 #define do_test_rand(name) do_test0(name, 1)
 
 // chaos test simple ensures that 1 out of 3 mallocs fail. 
-#define do_chaos_test(name) { \
+#define do_chaos_test(name) do_chaos_test0(name)
+#define do_chaos_test0(name) { \
     if (argc < 2 || strstr(#name, argv[1])) { \
         printf("%s\n", #name); \
         seedrand(); \